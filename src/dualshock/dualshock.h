@@ -35,7 +35,9 @@ extern "C" {
 * Includes
 ***************************************************/
 
-#include <sys/select.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /**************************************************
 * Public Defines
@@ -43,6 +45,9 @@ extern "C" {
 
 #define DUALSHOCK_MAX_AXIS_VALUE 32767
 
+/* How many button edges we can queue between ticks */
+#define DUALSHOCK_EDGE_QUEUE_LEN 32
+
 /**************************************************
 * Public Data Types
 **************************************************/
@@ -53,6 +58,8 @@ enum dualshock_axis_t
     DUALSHOCK_AXIS_LY,
     DUALSHOCK_AXIS_RX,
     DUALSHOCK_AXIS_RY,
+    /* Only the legacy backend reports L1 and R1 pressure. On
+     * evdev these are 0 or full scale, following the buttons. */
     DUALSHOCK_AXIS_L1,
     DUALSHOCK_AXIS_L2,
     DUALSHOCK_AXIS_R1,
@@ -82,6 +89,15 @@ enum dualshock_button_t
     DUALSHOCK_NUM_BUTTONS
 };
 
+/* A button being pressed or released */
+struct dualshock_edge_t
+{
+    enum dualshock_button_t button;
+    bool pressed;
+    /* CLOCK_MONOTONIC nanoseconds, as for dualshock_read_axis_time() */
+    uint64_t timestamp_ns;
+};
+
 /**************************************************
 * Public Data
 **************************************************/
@@ -92,14 +108,87 @@ enum dualshock_button_t
 * Public Function Prototypes
 ***************************************************/
 
+/*
+ * Open the pad. Devices called eventN use the evdev API,
+ * anything else is assumed to be a legacy jsN device.
+ * Returns 0 on success.
+ */
 int dualshock_init(const char* sz_jsdev);
 
-void dualshock_read_or_timeout(struct timeval* p_delay);
+/*
+ * Start watching for the device given to dualshock_init()
+ * appearing. If it isn't open yet, it is tried once more after
+ * the watch is added, so it can't slip in between the two.
+ * Returns an inotify file descriptor to watch for readability,
+ * or -1 on error.
+ */
+int dualshock_hotplug_init(void);
+
+/*
+ * Call when the hotplug file descriptor is readable. Opens
+ * the device if it has appeared. Returns true if the pad has
+ * just been attached (dualshock_get_fd() will have changed).
+ */
+bool dualshock_hotplug_poll(void);
+
+/*
+ * Returns true if the pad is open.
+ */
+bool dualshock_is_connected(void);
+
+/*
+ * Returns the joystick file descriptor, so it can be
+ * watched for readability. -1 if not open.
+ */
+int dualshock_get_fd(void);
+
+/*
+ * Read and process pending joystick events. Call when
+ * the file descriptor is readable.
+ *
+ * Returns -1 if the pad has been disconnected, in which
+ * case the device is closed and all axes and buttons read
+ * as neutral until it is re-attached. Returns 0 otherwise.
+ */
+int dualshock_poll(void);
 
 int dualshock_read_axis(enum dualshock_axis_t axis);
 
+/*
+ * When the axis last changed, in CLOCK_MONOTONIC nanoseconds
+ * (see get_time_ns()). With evdev this is the kernel's timestamp,
+ * otherwise it is when we read the event. 0 if never changed.
+ */
+uint64_t dualshock_read_axis_time(enum dualshock_axis_t axis);
+
 bool dualshock_read_button(enum dualshock_button_t axis);
 
+/*
+ * Call once at the start of every control tick. Takes all the
+ * button edges queued since the previous call and makes them
+ * available to the functions below until the next call.
+ */
+void dualshock_tick(void);
+
+/*
+ * Returns true if the button was pressed (at least once)
+ * between the last two calls to dualshock_tick(), even if it
+ * has since been released.
+ */
+bool dualshock_pressed_since_last_tick(enum dualshock_button_t button);
+
+/*
+ * Returns true if the button was released (at least once)
+ * between the last two calls to dualshock_tick().
+ */
+bool dualshock_released_since_last_tick(enum dualshock_button_t button);
+
+/*
+ * Get the edges taken by the last call to dualshock_tick(),
+ * oldest first. Returns the number of edges.
+ */
+size_t dualshock_get_edges(const struct dualshock_edge_t **pp_edges);
+
 #ifdef __cplusplus
 }
 #endif
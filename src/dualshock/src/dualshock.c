@@ -17,6 +17,33 @@
 * You should have received a copy of the GNU General Public License
 * along with PWRS.  If not, see <http://www.gnu.org/licenses/>.
 *
+* There are two backends:
+*
+* - The legacy joystick API (/dev/input/jsN). Events carry a
+*   32-bit millisecond timestamp of no particular epoch, so we
+*   stamp them with CLOCK_MONOTONIC when they are read.
+*
+* - evdev (/dev/input/eventN). We grab the device for exclusive
+*   access and ask the kernel for CLOCK_MONOTONIC timestamps,
+*   so each event carries the time the kernel saw it. Axes are
+*   rescaled from whatever range the driver reports. The driver
+*   has no pressure axes for L1 and R1, so those axes follow
+*   the buttons and read either 0 or full scale.
+*
+* Both backends feed the same js_state, so the rest of the
+* program can't tell which is in use.
+*
+* Button changes are also queued as timestamped edges in a
+* ring buffer. dualshock_tick() moves them out of the ring once
+* per control tick, so a press shorter than a tick is never
+* lost and modes don't need to debounce.
+*
+* Hotplug: the directory holding the device is watched with
+* inotify. When our device node appears (or has its permissions
+* fixed up by udev) we try to open it. A read returning 0 or
+* ENODEV means the pad has gone; we close it and reset js_state
+* to neutral so nothing keeps acting on the last stick position.
+*
 *****************************************************/
 
 /**************************************************
@@ -30,23 +57,41 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <errno.h>
-#include <sys/select.h>
 #include <fcntl.h>
-#include <assert.h>
+#include <string.h>
 #include <inttypes.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <linux/input.h>
 
+#include "util/util.h"
 #include "../dualshock.h"
 
 /**************************************************
 * Defines
 ***************************************************/
 
-/* None */
+/* How many events we try to read per read() call */
+#define READ_BATCH 64
+
+/* The legacy joystick API numbers axes 0..ABS_CNT-1 */
+#define MAX_STICK_IDX ABS_CNT
+
+/* Any device whose name starts with this uses evdev */
+#define EVDEV_PREFIX "event"
 
 /**************************************************
 * Data Types
 **************************************************/
 
+enum backend_t
+{
+    BACKEND_JOYSTICK,
+    BACKEND_EVDEV
+};
+
 enum event_type_t
 {
     EVENT_TYPE_BUTTON = 1,
@@ -98,24 +143,59 @@ enum event_button_idx_t
     EVENT_BUTTON_IDX_CROSS = 14,
     EVENT_BUTTON_IDX_SQUARE = 15,
 };
+
 struct js_state_t
 {
-    int16_t lx;
-    int16_t ly;
-    int16_t rx;
-    int16_t ry;
-    uint16_t l2;
-    uint16_t r2;
-    uint16_t l1;
-    uint16_t r1;
+    int axes[DUALSHOCK_NUM_AXES];
+    uint64_t axis_time_ns[DUALSHOCK_NUM_AXES];
     bool buttons[DUALSHOCK_NUM_BUTTONS];
 };
 
+/* Maps an evdev ABS_ code to one of our axes */
+struct evdev_axis_t
+{
+    uint16_t code;
+    enum dualshock_axis_t axis;
+    /* Sticks are centred and signed, triggers are unsigned */
+    bool is_stick;
+};
+
+/* Maps an evdev BTN_ code to one of our buttons */
+struct evdev_button_t
+{
+    uint16_t code;
+    enum dualshock_button_t button;
+    /* Also drive this axis, fully in or out, because the
+     * driver doesn't report the pressure */
+    bool has_axis;
+    enum dualshock_axis_t axis;
+};
+
+/* The range the driver reports for an axis */
+struct evdev_range_t
+{
+    int minimum;
+    int maximum;
+};
+
 /**************************************************
 * Function Prototypes
 **************************************************/
 
-static void process_event(const struct event_data_t *p_data);
+static int open_device(void);
+static void close_device(void);
+static int poll_joystick(void);
+static int poll_evdev(void);
+static int init_evdev(void);
+static void process_event(const struct event_data_t *p_data, uint64_t timestamp_ns);
+static void process_batch(const struct event_data_t *p_events, size_t num_events);
+static void process_evdev_batch(const struct input_event *p_events, size_t num_events);
+static void process_evdev_event(const struct input_event *p_event);
+static void resync_evdev(uint64_t timestamp_ns);
+static void set_evdev_axis(size_t index, int raw_value, uint64_t timestamp_ns);
+static void set_evdev_button(size_t index, bool pressed, uint64_t timestamp_ns);
+static void set_axis(enum dualshock_axis_t axis, int value, uint64_t timestamp_ns);
+static void set_button(enum dualshock_button_t button, bool pressed, uint64_t timestamp_ns);
 
 /**************************************************
 * Public Data
@@ -127,89 +207,176 @@ extern int verbose_flag;
 * Private Data
 **************************************************/
 
-static int fd;
+static int fd = -1;
+static int inotify_fd = -1;
+static char sz_path[PATH_MAX];
+static const char *p_basename = sz_path;
+static enum backend_t backend = BACKEND_JOYSTICK;
 static struct js_state_t js_state;
 
+/* Whole events are processed straight out of here. Any
+ * trailing partial event is kept for the next read. */
+static struct event_data_t rx_events[READ_BATCH];
+static size_t rx_used = 0;
+
+static const struct evdev_axis_t evdev_axes[] =
+{
+    { ABS_X,  DUALSHOCK_AXIS_LX, true },
+    { ABS_Y,  DUALSHOCK_AXIS_LY, true },
+    { ABS_RX, DUALSHOCK_AXIS_RX, true },
+    { ABS_RY, DUALSHOCK_AXIS_RY, true },
+    { ABS_Z,  DUALSHOCK_AXIS_L2, false },
+    { ABS_RZ, DUALSHOCK_AXIS_R2, false },
+};
+
+static struct evdev_range_t evdev_ranges[NUMELTS(evdev_axes)];
+/* Set by SYN_DROPPED: ignore events until the next SYN_REPORT, then resync */
+static bool evdev_dropped = false;
+
+/* Edges waiting for the next dualshock_tick(). When full, the
+ * oldest edge is dropped. */
+static struct dualshock_edge_t edge_ring[DUALSHOCK_EDGE_QUEUE_LEN];
+static size_t edge_head = 0;
+static size_t edge_count = 0;
+
+/* Edges taken by the last dualshock_tick() */
+static struct dualshock_edge_t tick_edges[DUALSHOCK_EDGE_QUEUE_LEN];
+static size_t tick_edge_count = 0;
+static bool tick_pressed[DUALSHOCK_NUM_BUTTONS];
+static bool tick_released[DUALSHOCK_NUM_BUTTONS];
+
+static const struct evdev_button_t evdev_buttons[] =
+{
+    { BTN_WEST,       DUALSHOCK_BUTTON_SQUARE },
+    { BTN_EAST,       DUALSHOCK_BUTTON_CIRCLE },
+    { BTN_NORTH,      DUALSHOCK_BUTTON_TRIANGLE },
+    { BTN_SOUTH,      DUALSHOCK_BUTTON_CROSS },
+    { BTN_MODE,       DUALSHOCK_BUTTON_PS },
+    { BTN_START,      DUALSHOCK_BUTTON_START },
+    { BTN_SELECT,     DUALSHOCK_BUTTON_SELECT },
+    { BTN_THUMBL,     DUALSHOCK_BUTTON_LEFTSTICK },
+    { BTN_THUMBR,     DUALSHOCK_BUTTON_RIGHTSTICK },
+    { BTN_DPAD_UP,    DUALSHOCK_BUTTON_UP },
+    { BTN_DPAD_DOWN,  DUALSHOCK_BUTTON_DOWN },
+    { BTN_DPAD_LEFT,  DUALSHOCK_BUTTON_LEFT },
+    { BTN_DPAD_RIGHT, DUALSHOCK_BUTTON_RIGHT },
+    { BTN_TL,         DUALSHOCK_BUTTON_L1, true, DUALSHOCK_AXIS_L1 },
+    { BTN_TL2,        DUALSHOCK_BUTTON_L2 },
+    { BTN_TR,         DUALSHOCK_BUTTON_R1, true, DUALSHOCK_AXIS_R1 },
+    { BTN_TR2,        DUALSHOCK_BUTTON_R2 },
+};
+
 /**************************************************
 * Public Functions
 ***************************************************/
 
 int dualshock_init(const char *sz_jsdev)
 {
-    int retval = 0;
-    printf("Opening joystick device %s\n", sz_jsdev);
-    fd = open(sz_jsdev, O_RDONLY);
-    if (fd > 0)
+    snprintf(sz_path, sizeof(sz_path), "%s", sz_jsdev);
+    const char *p_slash = strrchr(sz_path, '/');
+    p_basename = p_slash ? (p_slash + 1) : sz_path;
+    backend = (strncmp(p_basename, EVDEV_PREFIX, strlen(EVDEV_PREFIX)) == 0) ? BACKEND_EVDEV : BACKEND_JOYSTICK;
+    return open_device();
+}
+
+int dualshock_hotplug_init(void)
+{
+    char sz_dir[PATH_MAX];
+    snprintf(sz_dir, sizeof(sz_dir), "%.*s", (int) (p_basename - sz_path), sz_path);
+    if (sz_dir[0] == '\0')
     {
-        printf("Joystick device %s is open\n", sz_jsdev);
+        strcpy(sz_dir, ".");
     }
-    else
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0)
     {
-        perror("Can't open device");
-        retval = fd;
+        perror("inotify_init1");
+        return -1;
     }
-    return retval;
+    if (inotify_add_watch(inotify_fd, sz_dir, IN_CREATE | IN_ATTRIB) < 0)
+    {
+        perror(sz_dir);
+        close(inotify_fd);
+        inotify_fd = -1;
+        return -1;
+    }
+    printf("Watching %s for %s\n", sz_dir, p_basename);
+    if (fd < 0)
+    {
+        /* It may have appeared before the watch was in place,
+         * in which case we'll never get told about it */
+        open_device();
+    }
+    return inotify_fd;
+}
+
+bool dualshock_hotplug_poll(void)
+{
+    bool attached = false;
+    uint8_t buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t rx;
+    while ((rx = read(inotify_fd, buffer, sizeof(buffer))) > 0)
+    {
+        const uint8_t *p = buffer;
+        while (p < (buffer + rx))
+        {
+            const struct inotify_event *p_event = (const struct inotify_event *) p;
+            if ((p_event->len > 0) && (strcmp(p_event->name, p_basename) == 0) && (fd < 0))
+            {
+                attached = (open_device() == 0);
+            }
+            p += sizeof(struct inotify_event) + p_event->len;
+        }
+    }
+    return attached;
+}
+
+bool dualshock_is_connected(void)
+{
+    return fd >= 0;
 }
 
-void dualshock_read_or_timeout(struct timeval *p_delay)
+int dualshock_get_fd(void)
 {
-    fd_set rfds;
-    FD_ZERO(&rfds);
-    if (fd > 0)
+    return fd;
+}
+
+int dualshock_poll(void)
+{
+    int retval;
+    if (backend == BACKEND_EVDEV)
     {
-        FD_SET(fd, &rfds);
-        select(fd + 1, &rfds, NULL, NULL, p_delay);
+        retval = poll_evdev();
     }
     else
     {
-        select(0, NULL, NULL, NULL, p_delay);
+        retval = poll_joystick();
     }
-    if (FD_ISSET(fd, &rfds))
+    if (retval < 0)
     {
-        struct event_data_t data;
-        size_t rx = read(fd, &data, sizeof(data));
-        if (verbose_flag)
-        {
-            //printf("Read %zu from joystick\n", rx);
-        }
-        assert(rx == sizeof(data));
-        process_event(&data);
+        printf("Joystick device %s has gone\n", sz_path);
+        close_device();
     }
+    return retval;
 }
 
 int dualshock_read_axis(enum dualshock_axis_t axis)
 {
-    int retval = 0;
-    switch (axis)
-    {
-    case DUALSHOCK_AXIS_LX:
-        retval = js_state.lx;
-        break;
-    case DUALSHOCK_AXIS_LY:
-        retval = js_state.ly;
-        break;
-    case DUALSHOCK_AXIS_RX:
-        retval = js_state.rx;
-        break;
-    case DUALSHOCK_AXIS_RY:
-        retval = js_state.ry;
-        break;
-    case DUALSHOCK_AXIS_L2:
-        retval = js_state.l2;
-        break;
-    case DUALSHOCK_AXIS_R2:
-        retval = js_state.r2;
-        break;
-    case DUALSHOCK_AXIS_L1:
-        retval = js_state.l1;
-        break;
-    case DUALSHOCK_AXIS_R1:
-        retval = js_state.r1;
-        break;
-    default:
+    if (axis >= DUALSHOCK_NUM_AXES)
+    {
         abort();
     }
-    return retval;
+    return js_state.axes[axis];
+}
+
+uint64_t dualshock_read_axis_time(enum dualshock_axis_t axis)
+{
+    if (axis >= DUALSHOCK_NUM_AXES)
+    {
+        abort();
+    }
+    return js_state.axis_time_ns[axis];
 }
 
 bool dualshock_read_button(enum dualshock_button_t button)
@@ -217,11 +384,339 @@ bool dualshock_read_button(enum dualshock_button_t button)
     return js_state.buttons[button];
 }
 
+void dualshock_tick(void)
+{
+    memset(tick_pressed, 0, sizeof(tick_pressed));
+    memset(tick_released, 0, sizeof(tick_released));
+    tick_edge_count = 0;
+    while (edge_count > 0)
+    {
+        const struct dualshock_edge_t *p_edge = &edge_ring[edge_head];
+        if (p_edge->pressed)
+        {
+            tick_pressed[p_edge->button] = true;
+        }
+        else
+        {
+            tick_released[p_edge->button] = true;
+        }
+        tick_edges[tick_edge_count++] = *p_edge;
+        BOUNDS_INCREMENT(edge_head, NUMELTS(edge_ring), 0);
+        edge_count--;
+    }
+}
+
+bool dualshock_pressed_since_last_tick(enum dualshock_button_t button)
+{
+    return tick_pressed[button];
+}
+
+bool dualshock_released_since_last_tick(enum dualshock_button_t button)
+{
+    return tick_released[button];
+}
+
+size_t dualshock_get_edges(const struct dualshock_edge_t **pp_edges)
+{
+    *pp_edges = tick_edges;
+    return tick_edge_count;
+}
+
 /**************************************************
 * Private Functions
 ***************************************************/
 
-static void process_event(const struct event_data_t *p_event)
+/*
+ * Open the device named in dualshock_init().
+ */
+static int open_device(void)
+{
+    int retval = 0;
+    printf("Opening %s device %s\n", (backend == BACKEND_EVDEV) ? "evdev" : "joystick", sz_path);
+    fd = open(sz_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    rx_used = 0;
+    if (fd >= 0)
+    {
+        if (backend == BACKEND_EVDEV)
+        {
+            retval = init_evdev();
+        }
+        if (retval == 0)
+        {
+            printf("Joystick device %s is open\n", sz_path);
+        }
+        else
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    else
+    {
+        perror("Can't open device");
+        retval = -1;
+    }
+    return retval;
+}
+
+/*
+ * The pad has gone. Close it and centre everything.
+ */
+static void close_device(void)
+{
+    if (fd >= 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    rx_used = 0;
+    memset(&js_state, 0, sizeof(js_state));
+    edge_count = 0;
+}
+
+/*
+ * Read everything waiting on a legacy joystick device.
+ *
+ * Returns -1 if the device has gone away.
+ */
+static int poll_joystick(void)
+{
+    while (fd >= 0)
+    {
+        uint8_t *p_buffer = (uint8_t *) rx_events;
+        const size_t wanted = sizeof(rx_events) - rx_used;
+        ssize_t rx = read(fd, p_buffer + rx_used, wanted);
+        if (rx < 0)
+        {
+            if (errno == ENODEV)
+            {
+                return -1;
+            }
+            if ((errno != EAGAIN) && (errno != EINTR))
+            {
+                perror("Reading joystick");
+            }
+            break;
+        }
+        else if (rx == 0)
+        {
+            return -1;
+        }
+        if (verbose_flag)
+        {
+            //printf("Read %zd from joystick\n", rx);
+        }
+        rx_used += rx;
+
+        const size_t num_events = rx_used / sizeof(struct event_data_t);
+        const size_t used = num_events * sizeof(struct event_data_t);
+        process_batch(rx_events, num_events);
+
+        /* Carry over any partial event */
+        memmove(p_buffer, p_buffer + used, rx_used - used);
+        rx_used -= used;
+
+        if ((size_t) rx < wanted)
+        {
+            /* Short read - nothing more waiting */
+            break;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Read everything waiting on an evdev device. The kernel
+ * only ever hands back whole events.
+ *
+ * Returns -1 if the device has gone away.
+ */
+static int poll_evdev(void)
+{
+    while (fd >= 0)
+    {
+        struct input_event events[READ_BATCH];
+        ssize_t rx = read(fd, events, sizeof(events));
+        if (rx < 0)
+        {
+            if (errno == ENODEV)
+            {
+                return -1;
+            }
+            if ((errno != EAGAIN) && (errno != EINTR))
+            {
+                perror("Reading evdev");
+            }
+            break;
+        }
+        else if (rx == 0)
+        {
+            return -1;
+        }
+        process_evdev_batch(events, rx / sizeof(events[0]));
+        if ((size_t) rx < sizeof(events))
+        {
+            /* Short read - nothing more waiting */
+            break;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Set up a freshly opened evdev device: exclusive access,
+ * monotonic timestamps and the axis ranges.
+ */
+static int init_evdev(void)
+{
+    int grab = 1;
+    if (ioctl(fd, EVIOCGRAB, grab) < 0)
+    {
+        /* Not fatal, we just might share the pad with someone */
+        perror("EVIOCGRAB");
+    }
+
+    int clock_id = CLOCK_MONOTONIC;
+    if (ioctl(fd, EVIOCSCLOCKID, &clock_id) < 0)
+    {
+        perror("EVIOCSCLOCKID");
+        return -1;
+    }
+
+    for (size_t i = 0; i < NUMELTS(evdev_axes); i++)
+    {
+        struct input_absinfo info;
+        if ((ioctl(fd, EVIOCGABS(evdev_axes[i].code), &info) < 0) || (info.maximum <= info.minimum))
+        {
+            /* Assume the DS3's usual 8-bit axes */
+            info.minimum = 0;
+            info.maximum = 255;
+        }
+        evdev_ranges[i].minimum = info.minimum;
+        evdev_ranges[i].maximum = info.maximum;
+    }
+
+    /* Pick up anything already held or deflected */
+    evdev_dropped = false;
+    resync_evdev(get_time_ns());
+    return 0;
+}
+
+/*
+ * Read the current key and axis state straight from the
+ * device, for when we have missed (or never saw) the events.
+ */
+static void resync_evdev(uint64_t timestamp_ns)
+{
+    uint8_t keys[(KEY_MAX + 8) / 8];
+    memset(keys, 0, sizeof(keys));
+    if (ioctl(fd, EVIOCGKEY(sizeof(keys)), keys) < 0)
+    {
+        perror("EVIOCGKEY");
+    }
+    else
+    {
+        for (size_t i = 0; i < NUMELTS(evdev_buttons); i++)
+        {
+            const uint16_t code = evdev_buttons[i].code;
+            set_evdev_button(i, (keys[code / 8] & (1U << (code % 8))) != 0, timestamp_ns);
+        }
+    }
+
+    for (size_t i = 0; i < NUMELTS(evdev_axes); i++)
+    {
+        struct input_absinfo info;
+        if (ioctl(fd, EVIOCGABS(evdev_axes[i].code), &info) == 0)
+        {
+            set_evdev_axis(i, info.value, timestamp_ns);
+        }
+    }
+}
+
+/*
+ * Process a batch of events read in one go. The pad streams
+ * axis updates constantly, so only the last update to each
+ * axis in the batch is applied. Buttons are processed in order.
+ */
+static void process_batch(const struct event_data_t *p_events, size_t num_events)
+{
+    const uint64_t now = get_time_ns();
+    int16_t last_update[MAX_STICK_IDX];
+    memset(last_update, 0xFF, sizeof(last_update));
+
+    for (size_t i = 0; i < num_events; i++)
+    {
+        const struct event_data_t *p_event = &p_events[i];
+        if (((p_event->type & ~EVENT_TYPE_INIT) == EVENT_TYPE_STICK) && (p_event->idx < MAX_STICK_IDX))
+        {
+            last_update[p_event->idx] = i;
+        }
+    }
+
+    for (size_t i = 0; i < num_events; i++)
+    {
+        const struct event_data_t *p_event = &p_events[i];
+        if (((p_event->type & ~EVENT_TYPE_INIT) == EVENT_TYPE_STICK) &&
+            (p_event->idx < MAX_STICK_IDX) &&
+            (last_update[p_event->idx] != (int16_t) i))
+        {
+            /* Superseded later in this batch */
+            continue;
+        }
+        process_event(p_event, now);
+    }
+}
+
+/*
+ * As process_batch(), but for evdev events. If the kernel
+ * reports SYN_DROPPED, everything up to the next SYN_REPORT
+ * is unreliable, so skip it and read the state back instead.
+ */
+static void process_evdev_batch(const struct input_event *p_events, size_t num_events)
+{
+    int16_t last_update[ABS_CNT];
+    memset(last_update, 0xFF, sizeof(last_update));
+
+    for (size_t i = 0; i < num_events; i++)
+    {
+        if ((p_events[i].type == EV_ABS) && (p_events[i].code < ABS_CNT))
+        {
+            last_update[p_events[i].code] = i;
+        }
+    }
+
+    for (size_t i = 0; i < num_events; i++)
+    {
+        const struct input_event *p_event = &p_events[i];
+        if (p_event->type == EV_SYN)
+        {
+            if (p_event->code == SYN_DROPPED)
+            {
+                evdev_dropped = true;
+            }
+            else if ((p_event->code == SYN_REPORT) && evdev_dropped)
+            {
+                evdev_dropped = false;
+                resync_evdev(get_time_ns());
+            }
+            continue;
+        }
+        if (evdev_dropped)
+        {
+            continue;
+        }
+        if ((p_event->type == EV_ABS) &&
+            (p_event->code < ABS_CNT) &&
+            (last_update[p_event->code] != (int16_t) i))
+        {
+            /* Superseded later in this batch */
+            continue;
+        }
+        process_evdev_event(p_event);
+    }
+}
+
+static void process_event(const struct event_data_t *p_event, uint64_t timestamp_ns)
 {
     if (verbose_flag)
     {
@@ -233,34 +728,34 @@ static void process_event(const struct event_data_t *p_event)
     if ((p_event->type == EVENT_TYPE_STICK) || (p_event->type == EVENT_TYPE_INITSTICK))
     {
         enum event_stick_idx_t idx = p_event->idx;
-        int value = p_event->value;
+        int value = (int16_t) p_event->value;
         switch (idx)
         {
         /* The sticks appear backwards to how you would expect */
         case EVENT_STICK_IDX_LX:
-            js_state.lx = -value;
+            set_axis(DUALSHOCK_AXIS_LX, -value, timestamp_ns);
             break;
         case EVENT_STICK_IDX_LY:
-            js_state.ly = -value;
+            set_axis(DUALSHOCK_AXIS_LY, -value, timestamp_ns);
             break;
         case EVENT_STICK_IDX_RX:
-            js_state.rx = -value;
+            set_axis(DUALSHOCK_AXIS_RX, -value, timestamp_ns);
             break;
         case EVENT_STICK_IDX_RY:
-            js_state.ry = -value;
+            set_axis(DUALSHOCK_AXIS_RY, -value, timestamp_ns);
             break;
         /* We want shoulder buttons as unsigned values */
         case EVENT_STICK_IDX_L2:
-            js_state.l2 = value + DUALSHOCK_MAX_AXIS_VALUE;
+            set_axis(DUALSHOCK_AXIS_L2, value + DUALSHOCK_MAX_AXIS_VALUE, timestamp_ns);
             break;
         case EVENT_STICK_IDX_R2:
-            js_state.r2 = value + DUALSHOCK_MAX_AXIS_VALUE;
+            set_axis(DUALSHOCK_AXIS_R2, value + DUALSHOCK_MAX_AXIS_VALUE, timestamp_ns);
             break;
         case EVENT_STICK_IDX_L1:
-            js_state.l1 = value + DUALSHOCK_MAX_AXIS_VALUE;
+            set_axis(DUALSHOCK_AXIS_L1, value + DUALSHOCK_MAX_AXIS_VALUE, timestamp_ns);
             break;
         case EVENT_STICK_IDX_R1:
-            js_state.r1 = value + DUALSHOCK_MAX_AXIS_VALUE;
+            set_axis(DUALSHOCK_AXIS_R1, value + DUALSHOCK_MAX_AXIS_VALUE, timestamp_ns);
             break;
         default:
             /* Ignore unwanted events */
@@ -270,58 +765,59 @@ static void process_event(const struct event_data_t *p_event)
     else if ((p_event->type == EVENT_TYPE_BUTTON) || (p_event->type == EVENT_TYPE_INITBUTTON))
     {
         enum event_button_idx_t idx = p_event->idx;
+        bool pressed = p_event->value;
         switch (idx)
         {
         case EVENT_BUTTON_IDX_SELECT:
-            js_state.buttons[DUALSHOCK_BUTTON_SELECT] = p_event->value;
+            set_button(DUALSHOCK_BUTTON_SELECT, pressed, timestamp_ns);
             break;
         case EVENT_BUTTON_IDX_LEFTSTICK:
-            js_state.buttons[DUALSHOCK_BUTTON_LEFTSTICK] = p_event->value;
+            set_button(DUALSHOCK_BUTTON_LEFTSTICK, pressed, timestamp_ns);
             break;
         case EVENT_BUTTON_IDX_RIGHTSTICK:
-            js_state.buttons[DUALSHOCK_BUTTON_RIGHTSTICK] = p_event->value;
+            set_button(DUALSHOCK_BUTTON_RIGHTSTICK, pressed, timestamp_ns);
             break;
         case EVENT_BUTTON_IDX_START:
-            js_state.buttons[DUALSHOCK_BUTTON_START] = p_event->value;
+            set_button(DUALSHOCK_BUTTON_START, pressed, timestamp_ns);
             break;
         case EVENT_BUTTON_IDX_UP:
-            js_state.buttons[DUALSHOCK_BUTTON_UP] = p_event->value;
+            set_button(DUALSHOCK_BUTTON_UP, pressed, timestamp_ns);
             break;
         case EVENT_BUTTON_IDX_RIGHT:
-            js_state.buttons[DUALSHOCK_BUTTON_RIGHT] = p_event->value;
+            set_button(DUALSHOCK_BUTTON_RIGHT, pressed, timestamp_ns);
             break;
         case EVENT_BUTTON_IDX_DOWN:
-            js_state.buttons[DUALSHOCK_BUTTON_DOWN] = p_event->value;
+            set_button(DUALSHOCK_BUTTON_DOWN, pressed, timestamp_ns);
             break;
         case EVENT_BUTTON_IDX_LEFT:
-            js_state.buttons[DUALSHOCK_BUTTON_LEFT] = p_event->value;
+            set_button(DUALSHOCK_BUTTON_LEFT, pressed, timestamp_ns);
             break;
         case EVENT_BUTTON_IDX_L2:
-            js_state.buttons[DUALSHOCK_BUTTON_L2] = p_event->value;
+            set_button(DUALSHOCK_BUTTON_L2, pressed, timestamp_ns);
             break;
         case EVENT_BUTTON_IDX_R2:
-            js_state.buttons[DUALSHOCK_BUTTON_R2] = p_event->value;
+            set_button(DUALSHOCK_BUTTON_R2, pressed, timestamp_ns);
             break;
         case EVENT_BUTTON_IDX_L1:
-            js_state.buttons[DUALSHOCK_BUTTON_L1] = p_event->value;
+            set_button(DUALSHOCK_BUTTON_L1, pressed, timestamp_ns);
             break;
         case EVENT_BUTTON_IDX_R1:
-            js_state.buttons[DUALSHOCK_BUTTON_R1] = p_event->value;
+            set_button(DUALSHOCK_BUTTON_R1, pressed, timestamp_ns);
             break;
         case EVENT_BUTTON_IDX_PS:
-            js_state.buttons[DUALSHOCK_BUTTON_PS] = p_event->value;
+            set_button(DUALSHOCK_BUTTON_PS, pressed, timestamp_ns);
             break;
         case EVENT_BUTTON_IDX_TRIANGLE:
-            js_state.buttons[DUALSHOCK_BUTTON_TRIANGLE] = p_event->value;
+            set_button(DUALSHOCK_BUTTON_TRIANGLE, pressed, timestamp_ns);
             break;
         case EVENT_BUTTON_IDX_CIRCLE:
-            js_state.buttons[DUALSHOCK_BUTTON_CIRCLE] = p_event->value;
+            set_button(DUALSHOCK_BUTTON_CIRCLE, pressed, timestamp_ns);
             break;
         case EVENT_BUTTON_IDX_CROSS:
-            js_state.buttons[DUALSHOCK_BUTTON_CROSS] = p_event->value;
+            set_button(DUALSHOCK_BUTTON_CROSS, pressed, timestamp_ns);
             break;
         case EVENT_BUTTON_IDX_SQUARE:
-            js_state.buttons[DUALSHOCK_BUTTON_SQUARE] = p_event->value;
+            set_button(DUALSHOCK_BUTTON_SQUARE, pressed, timestamp_ns);
             break;
         default:
             /* Ignore unwanted events */
@@ -331,7 +827,106 @@ static void process_event(const struct event_data_t *p_event)
 
 }
 
+static void process_evdev_event(const struct input_event *p_event)
+{
+    const uint64_t timestamp_ns =
+        ((uint64_t) p_event->input_event_sec * 1000000000) +
+        ((uint64_t) p_event->input_event_usec * 1000);
+
+    if (verbose_flag)
+    {
+        printf("\ttime = %"PRIu64"\n", timestamp_ns);
+        printf("\ttype = %02"PRIx16"\n", p_event->type);
+        printf("\tcode = %04"PRIx16"\n", p_event->code);
+        printf("\tvalue = %"PRId32"\n", p_event->value);
+    }
+
+    if (p_event->type == EV_ABS)
+    {
+        for (size_t i = 0; i < NUMELTS(evdev_axes); i++)
+        {
+            if (evdev_axes[i].code == p_event->code)
+            {
+                set_evdev_axis(i, p_event->value, timestamp_ns);
+                break;
+            }
+        }
+    }
+    else if (p_event->type == EV_KEY)
+    {
+        for (size_t i = 0; i < NUMELTS(evdev_buttons); i++)
+        {
+            if (evdev_buttons[i].code == p_event->code)
+            {
+                /* value 2 is auto-repeat, which still means pressed */
+                set_evdev_button(i, p_event->value != 0, timestamp_ns);
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * Scale a raw value from evdev_axes[index] and store it.
+ */
+static void set_evdev_axis(size_t index, int raw_value, uint64_t timestamp_ns)
+{
+    const int minimum = evdev_ranges[index].minimum;
+    const int span = evdev_ranges[index].maximum - minimum;
+    /* Scale to 0..2*DUALSHOCK_MAX_AXIS_VALUE */
+    int value = (int) ((((int64_t) (raw_value - minimum)) * 2 * DUALSHOCK_MAX_AXIS_VALUE) / span);
+    if (evdev_axes[index].is_stick)
+    {
+        /* Centred, and backwards like the joystick API */
+        value = DUALSHOCK_MAX_AXIS_VALUE - value;
+    }
+    set_axis(evdev_axes[index].axis, value, timestamp_ns);
+}
+
+/*
+ * Store the state of evdev_buttons[index], and of the axis
+ * that goes with it, if any.
+ */
+static void set_evdev_button(size_t index, bool pressed, uint64_t timestamp_ns)
+{
+    set_button(evdev_buttons[index].button, pressed, timestamp_ns);
+    if (evdev_buttons[index].has_axis)
+    {
+        set_axis(evdev_buttons[index].axis, pressed ? (2 * DUALSHOCK_MAX_AXIS_VALUE) : 0, timestamp_ns);
+    }
+}
+
+/*
+ * Store a new axis value, and when it arrived.
+ */
+static void set_axis(enum dualshock_axis_t axis, int value, uint64_t timestamp_ns)
+{
+    js_state.axes[axis] = value;
+    js_state.axis_time_ns[axis] = timestamp_ns;
+}
+
+/*
+ * Store a new button state, queueing an edge if it changed.
+ */
+static void set_button(enum dualshock_button_t button, bool pressed, uint64_t timestamp_ns)
+{
+    if (js_state.buttons[button] != pressed)
+    {
+        if (edge_count == NUMELTS(edge_ring))
+        {
+            /* Full - lose the oldest */
+            BOUNDS_INCREMENT(edge_head, NUMELTS(edge_ring), 0);
+            edge_count--;
+        }
+        struct dualshock_edge_t *p_edge = &edge_ring[(edge_head + edge_count) % NUMELTS(edge_ring)];
+        p_edge->button = button;
+        p_edge->pressed = pressed;
+        p_edge->timestamp_ns = timestamp_ns;
+        edge_count++;
+    }
+    js_state.buttons[button] = pressed;
+}
+
 /**************************************************
 * End of file
 ***************************************************/
-
@@ -32,7 +32,7 @@ extern "C" {
 * Includes
 ***************************************************/
 
-/* None */
+#include "shaping/shaping.h"
 
 /**************************************************
 * Public Defines
@@ -67,6 +67,21 @@ void mode_init(void);
  */
 void mode_handle(void);
 
+/*
+ * Abandon the current mode and go back to the menu, e.g.
+ * after the joystick has been reconnected.
+ */
+void mode_reset(void);
+
+/*
+ * Rebuild the remote control stick-to-speed tables. Call
+ * after mode_init() if the defaults aren't wanted.
+ */
+void mode_set_shaping(
+    const struct shaping_config_t *p_left,
+    const struct shaping_config_t *p_right
+);
+
 #ifdef __cplusplus
 }
 #endif
@@ -59,6 +59,8 @@
 #include "gpio/gpio.h"
 #include "lcd/lcd.h"
 #include "motor/motor.h"
+#include "perf/perf.h"
+#include "shaping/shaping.h"
 
 #include "modes/modes.h"
 
@@ -70,6 +72,12 @@
 #define LINE_SENSOR_RIGHT GPIO_MAKE_IO_PIN(0, 20)
 #define LINE_SENSOR_POWER GPIO_MAKE_IO_PIN(0, 26)
 
+/* Range readings older than this are no use for steering */
+#define RANGE_STALE_NS (250 * 1000 * 1000ULL)
+
+/* The ultrasonics are noisy - steer on the median of this many readings */
+#define RANGE_MEDIAN_LEN 3
+
 /**************************************************
 * Data Types
 **************************************************/
@@ -95,13 +103,14 @@ static void mode_menu(void);
 static void mode_remote_control(void);
 static void mode_straight_line(void);
 static void mode_line_follow(void);
+static void mode_diagnostics(void);
+static void mode_link_stats(void);
 static void render_text(int motor_left, int motor_right);
 static void change_mode(mode_function_t new_mode);
 static bool select_mode(
     const struct menu_t *p_menu,
     const struct menu_item_t *p_menu_item
 );
-static bool debounce_button(void);
 
 /**************************************************
 * Public Data
@@ -130,6 +139,10 @@ static const struct menu_item_t top_menu_items[] =
     { "Maze", MENU_ITEM_TYPE_ACTION, NULL, select_mode },
     /* http://piwars.org/2017-competition/challenges/line-following/ */
     { "Line", MENU_ITEM_TYPE_ACTION, NULL, select_mode },
+    /* Control loop timings */
+    { "Diag", MENU_ITEM_TYPE_ACTION, NULL, select_mode },
+    /* Serial link counters */
+    { "Link", MENU_ITEM_TYPE_ACTION, NULL, select_mode },
 };
 
 static const struct menu_t top_menu =
@@ -140,8 +153,6 @@ static const struct menu_t top_menu =
     .hide_back = true
 };
 
-static enum dualshock_button_t last_button = DUALSHOCK_NUM_BUTTONS;
-
 static struct straight_line_t straight_line;
 
 static struct line_follow_t line_follow = {
@@ -151,6 +162,16 @@ static struct line_follow_t line_follow = {
 
 static char msg[14] = { 0 };
 
+static enum perf_stage_t diag_stage = PERF_STAGE_TICK;
+
+/* Stick-to-speed tables for remote control */
+static struct shaping_axis_t shaping_left;
+static struct shaping_axis_t shaping_right;
+
+/* Timestamps of the stick movements we've already traced */
+static uint64_t traced_stick_left = 0;
+static uint64_t traced_stick_right = 0;
+
 /**************************************************
 * Public Functions
 ***************************************************/
@@ -163,6 +184,14 @@ void mode_init(void)
     gpio_make_output(LINE_SENSOR_POWER, 0);
     gpio_make_input(LINE_SENSOR_LEFT);
     gpio_make_input(LINE_SENSOR_RIGHT);
+
+    const struct shaping_config_t config = {
+        .deadzone_pct = SHAPING_DEFAULT_DEADZONE_PCT,
+        .expo_pct = SHAPING_DEFAULT_EXPO_PCT,
+        .trim_pct = SHAPING_DEFAULT_TRIM_PCT,
+        .slew_per_tick = SHAPING_DEFAULT_SLEW
+    };
+    mode_set_shaping(&config, &config);
 }
 
 /*
@@ -175,6 +204,28 @@ void mode_handle(void)
    current_mode();
 }
 
+/*
+ * Go back to the top menu.
+ */
+void mode_reset(void)
+{
+    gpio_set_output(LINE_SENSOR_POWER, 0);
+    change_mode(mode_menu);
+}
+
+/*
+ * Build the lookup tables now, so remote control mode only
+ * has to index them.
+ */
+void mode_set_shaping(
+    const struct shaping_config_t *p_left,
+    const struct shaping_config_t *p_right
+)
+{
+    shaping_init(&shaping_left, p_left, MOTOR_MAX_SPEED);
+    shaping_init(&shaping_right, p_right, MOTOR_MAX_SPEED);
+}
+
 /**************************************************
 * Private Functions
 ***************************************************/
@@ -192,36 +243,27 @@ static void mode_menu(void)
         mode_first = false;
     }
 
-    if (debounce_button())
-    {
-        return;
-    }
-
-    if (dualshock_read_button(DUALSHOCK_BUTTON_UP))
+    if (dualshock_pressed_since_last_tick(DUALSHOCK_BUTTON_UP))
     {
         printf("Up!\r\n");
         menu_keypress(MENU_KEYPRESS_UP);
-        last_button = DUALSHOCK_BUTTON_UP;
     }
-    else if (dualshock_read_button(DUALSHOCK_BUTTON_DOWN))
+    else if (dualshock_pressed_since_last_tick(DUALSHOCK_BUTTON_DOWN))
     {
         printf("Down!\r\n");
         menu_keypress(MENU_KEYPRESS_DOWN);
-        last_button = DUALSHOCK_BUTTON_DOWN;
     }
-    else if (dualshock_read_button(DUALSHOCK_BUTTON_CROSS))
+    else if (dualshock_pressed_since_last_tick(DUALSHOCK_BUTTON_CROSS))
     {
         printf("Enter!\r\n");
         menu_keypress(MENU_KEYPRESS_ENTER);
-        last_button = DUALSHOCK_BUTTON_CROSS;
     }
-    else if (dualshock_read_button(DUALSHOCK_BUTTON_TRIANGLE))
+    else if (dualshock_pressed_since_last_tick(DUALSHOCK_BUTTON_TRIANGLE))
     {
         printf("Backlight toggle!\r\n");
         lcd_toggle_backlight();
-        last_button = DUALSHOCK_BUTTON_TRIANGLE;
     }
-    else if (dualshock_read_button(DUALSHOCK_BUTTON_CIRCLE))
+    else if (dualshock_pressed_since_last_tick(DUALSHOCK_BUTTON_CIRCLE))
     {
         printf("Shutting Down!\r\n");
 #ifndef LCD_SIM
@@ -235,17 +277,26 @@ static void mode_menu(void)
  */
 static void mode_remote_control(void)
 {
-    if (debounce_button())
-    {
-        return;
-    }
-
     const int stick_left = dualshock_read_axis(DUALSHOCK_AXIS_LY);
     const int stick_right = dualshock_read_axis(DUALSHOCK_AXIS_RY);
 
-    /* max input is +/- 32767 */
-    const int motor_left = (stick_left * MOTOR_MAX_SPEED) / DUALSHOCK_MAX_AXIS_VALUE;
-    const int motor_right = (stick_right * MOTOR_MAX_SPEED) / DUALSHOCK_MAX_AXIS_VALUE;
+    /* Deadzone, expo, trim and slew limit - sticks at rest give exactly 0 */
+    const int motor_left = shaping_apply(&shaping_left, stick_left);
+    const int motor_right = shaping_apply(&shaping_right, stick_right);
+
+    /* Trace each new stick movement through to the motor controller */
+    const uint64_t stick_left_time = dualshock_read_axis_time(DUALSHOCK_AXIS_LY);
+    const uint64_t stick_right_time = dualshock_read_axis_time(DUALSHOCK_AXIS_RY);
+    if (stick_left_time != traced_stick_left)
+    {
+        motor_trace(MOTOR_LEFT, stick_left_time);
+        traced_stick_left = stick_left_time;
+    }
+    if (stick_right_time != traced_stick_right)
+    {
+        motor_trace(MOTOR_RIGHT, stick_right_time);
+        traced_stick_right = stick_right_time;
+    }
 
     render_text(motor_left, motor_right);
 
@@ -253,17 +304,15 @@ static void mode_remote_control(void)
 
     motor_control(MOTOR_RIGHT, motor_right);
 
-    if (dualshock_read_button(DUALSHOCK_BUTTON_CROSS))
+    if (dualshock_pressed_since_last_tick(DUALSHOCK_BUTTON_CROSS))
     {
-        last_button = DUALSHOCK_BUTTON_CROSS;
         change_mode(mode_menu);
     }
 
-    if (dualshock_read_button(DUALSHOCK_BUTTON_TRIANGLE))
+    if (dualshock_pressed_since_last_tick(DUALSHOCK_BUTTON_TRIANGLE))
     {
         printf("Backlight toggle!\r\n");
         lcd_toggle_backlight();
-        last_button = DUALSHOCK_BUTTON_TRIANGLE;
     }
 }
 
@@ -272,18 +321,27 @@ static void mode_remote_control(void)
  */
 static void mode_straight_line(void)
 {
-    if (debounce_button())
-    {
-        return;
-    }
-
     // Calculate balance - i.e. how far off centre the robot is
     // 0.5 is dead straight.
     // < 0.5 means robot is closer to left wall and should go right
     // > 0.5 means robot is closer to right wall and should go left
-    double range_left = motor_read_distance(0);
-    double range_right = motor_read_distance(1);
-    double range_front = motor_read_distance(2);
+    struct motor_sample_t sample;
+    struct stats_window_t history;
+    double ranges[3];
+    bool fresh = true;
+    for (uint8_t i = 0; i < NUMELTS(ranges); i++)
+    {
+        if (!motor_read_distance_sample(i, &sample) ||
+            (sample.age_ns > RANGE_STALE_NS))
+        {
+            fresh = false;
+        }
+        motor_read_distance_history(i, &history);
+        ranges[i] = stats_window_median(&history, RANGE_MEDIAN_LEN);
+    }
+    double range_left = ranges[0];
+    double range_right = ranges[1];
+    double range_front = ranges[2];
     double total = range_left + range_right;
     double balance = range_left / total;
 
@@ -311,9 +369,9 @@ static void mode_straight_line(void)
 
     render_text(motor_left, motor_right);
 
-    if (!straight_line.running)
+    if (!straight_line.running || !fresh)
     {
-        // Force speed to be zero
+        // Force speed to be zero - don't steer on old readings
         motor_left = 0;
         motor_right = 0;
     }
@@ -322,23 +380,20 @@ static void mode_straight_line(void)
 
     motor_control(MOTOR_RIGHT, motor_right);
 
-    if (dualshock_read_button(DUALSHOCK_BUTTON_CROSS))
+    if (dualshock_pressed_since_last_tick(DUALSHOCK_BUTTON_CROSS))
     {
         gpio_set_output(LINE_SENSOR_POWER, 0);
-        last_button = DUALSHOCK_BUTTON_CROSS;
         change_mode(mode_menu);
     }
 
-    if (dualshock_read_button(DUALSHOCK_BUTTON_TRIANGLE))
+    if (dualshock_pressed_since_last_tick(DUALSHOCK_BUTTON_TRIANGLE))
     {
         lcd_toggle_backlight();
-        last_button = DUALSHOCK_BUTTON_TRIANGLE;
     }
 
-    if (dualshock_read_button(DUALSHOCK_BUTTON_START))
+    if (dualshock_pressed_since_last_tick(DUALSHOCK_BUTTON_START))
     {
         straight_line.running = ! straight_line.running;
-        last_button = DUALSHOCK_BUTTON_START;
     }
 }
 
@@ -369,7 +424,7 @@ struct maze_solve_t {
 static struct maze_solve_t maze_solve;
 
 static bool maze_state_leg_run(void) {
-    maze_solve.motor_left = 240
+    maze_solve.motor_left = 240;
     maze_solve.motor_right = 240;
     if (motor_read_distance(2) < 20)
     {
@@ -440,11 +495,6 @@ static bool maze_state_idle_run(void) {
  */
 static void mode_maze_solve(void)
 {
-    if (debounce_button())
-    {
-        return;
-    }
-
     switch (maze_solve.state)
     {
         case MAZE_STATE_IDLE:
@@ -541,23 +591,20 @@ static void mode_maze_solve(void)
 
     motor_control(MOTOR_RIGHT, motor_right);
 
-    if (dualshock_read_button(DUALSHOCK_BUTTON_CROSS))
+    if (dualshock_pressed_since_last_tick(DUALSHOCK_BUTTON_CROSS))
     {
         gpio_set_output(LINE_SENSOR_POWER, 0);
-        last_button = DUALSHOCK_BUTTON_CROSS;
         change_mode(mode_menu);
     }
 
-    if (dualshock_read_button(DUALSHOCK_BUTTON_TRIANGLE))
+    if (dualshock_pressed_since_last_tick(DUALSHOCK_BUTTON_TRIANGLE))
     {
         lcd_toggle_backlight();
-        last_button = DUALSHOCK_BUTTON_TRIANGLE;
     }
 
-    if (dualshock_read_button(DUALSHOCK_BUTTON_START))
+    if (dualshock_pressed_since_last_tick(DUALSHOCK_BUTTON_START))
     {
         maze_solve.running = ! maze_solve.running;
-        last_button = DUALSHOCK_BUTTON_START;
     }
 }
 
@@ -566,11 +613,6 @@ static void mode_maze_solve(void)
  */
 static void mode_line_follow(void)
 {
-    if (debounce_button())
-    {
-        return;
-    }
-
     // Read line sensors
     int motor_left = line_follow.speed;
     int motor_right = line_follow.speed;
@@ -599,34 +641,101 @@ static void mode_line_follow(void)
 
     motor_control(MOTOR_RIGHT, motor_right);
 
-    if (dualshock_read_button(DUALSHOCK_BUTTON_CROSS))
+    if (dualshock_pressed_since_last_tick(DUALSHOCK_BUTTON_CROSS))
     {
-        last_button = DUALSHOCK_BUTTON_CROSS;
         change_mode(mode_menu);
     }
 
-    if (dualshock_read_button(DUALSHOCK_BUTTON_TRIANGLE))
+    if (dualshock_pressed_since_last_tick(DUALSHOCK_BUTTON_TRIANGLE))
     {
         lcd_toggle_backlight();
-        last_button = DUALSHOCK_BUTTON_TRIANGLE;
     }
 
-    if (dualshock_read_button(DUALSHOCK_BUTTON_START))
+    if (dualshock_pressed_since_last_tick(DUALSHOCK_BUTTON_START))
     {
         line_follow.running = ! line_follow.running;
-        last_button = DUALSHOCK_BUTTON_START;
     }
 
-    if (dualshock_read_button(DUALSHOCK_BUTTON_UP))
+    if (dualshock_pressed_since_last_tick(DUALSHOCK_BUTTON_UP))
     {
         line_follow.speed += 5;
-        last_button = DUALSHOCK_BUTTON_UP;
     }
 
-    if (dualshock_read_button(DUALSHOCK_BUTTON_DOWN))
+    if (dualshock_pressed_since_last_tick(DUALSHOCK_BUTTON_DOWN))
     {
         line_follow.speed -= 5;
-        last_button = DUALSHOCK_BUTTON_DOWN;
+    }
+}
+
+/**
+ * Diagnostics mode. Shows the latency histogram for one control
+ * loop stage, in microseconds. Up/Down select the stage, Start
+ * clears all the histograms.
+ */
+static void mode_diagnostics(void)
+{
+    const struct stats_hist_t *p_hist = perf_get(diag_stage);
+
+    snprintf(msg, sizeof(msg) - 1, "%-8s", perf_get_name(diag_stage));
+    font_draw_text_small(0, 0, msg, LCD_WHITE, LCD_BLACK, FONT_MONOSPACE);
+    snprintf(msg, sizeof(msg) - 1, "p50 %6u", (unsigned int) (stats_hist_percentile(p_hist, 50.0) / 1000));
+    font_draw_text_small(0, 10, msg, LCD_WHITE, LCD_BLACK, FONT_MONOSPACE);
+    snprintf(msg, sizeof(msg) - 1, "p99 %6u", (unsigned int) (stats_hist_percentile(p_hist, 99.0) / 1000));
+    font_draw_text_small(0, 20, msg, LCD_WHITE, LCD_BLACK, FONT_MONOSPACE);
+    snprintf(msg, sizeof(msg) - 1, "p999%6u", (unsigned int) (stats_hist_percentile(p_hist, 99.9) / 1000));
+    font_draw_text_small(0, 30, msg, LCD_WHITE, LCD_BLACK, FONT_MONOSPACE);
+    snprintf(msg, sizeof(msg) - 1, "max %6u", (unsigned int) (p_hist->max / 1000));
+    font_draw_text_small(0, 40, msg, LCD_WHITE, LCD_BLACK, FONT_MONOSPACE);
+    lcd_flush();
+
+    if (dualshock_pressed_since_last_tick(DUALSHOCK_BUTTON_CROSS))
+    {
+        change_mode(mode_menu);
+    }
+
+    if (dualshock_pressed_since_last_tick(DUALSHOCK_BUTTON_UP))
+    {
+        diag_stage = (diag_stage == 0) ? (PERF_NUM_STAGES - 1) : (diag_stage - 1);
+    }
+
+    if (dualshock_pressed_since_last_tick(DUALSHOCK_BUTTON_DOWN))
+    {
+        BOUNDS_INCREMENT(diag_stage, PERF_NUM_STAGES, 0);
+    }
+
+    if (dualshock_pressed_since_last_tick(DUALSHOCK_BUTTON_START))
+    {
+        perf_reset();
+    }
+}
+
+/*
+ * Show the serial link counters. Everything that isn't a bad
+ * checksum or escape is lumped together as "Err" - the SIGUSR1
+ * dump has the details.
+ */
+static void mode_link_stats(void)
+{
+    struct motor_link_stats_t stats;
+    motor_get_link_stats(&stats);
+    const uint32_t errors = stats.oversize_frames + stats.truncated_frames + stats.unknown_commands +
+        stats.read_errors + stats.write_errors;
+
+    snprintf(msg, sizeof(msg) - 1, "RxK %6u", (unsigned int) (stats.bytes_rx / 1024));
+    font_draw_text_small(0, 0, msg, LCD_WHITE, LCD_BLACK, FONT_MONOSPACE);
+    snprintf(msg, sizeof(msg) - 1, "TxK %6u", (unsigned int) (stats.bytes_tx / 1024));
+    font_draw_text_small(0, 10, msg, LCD_WHITE, LCD_BLACK, FONT_MONOSPACE);
+    snprintf(msg, sizeof(msg) - 1, "Csum%6u", (unsigned int) stats.bad_checksums);
+    font_draw_text_small(0, 20, msg, LCD_WHITE, LCD_BLACK, FONT_MONOSPACE);
+    snprintf(msg, sizeof(msg) - 1, "Esc %6u", (unsigned int) stats.bad_escapes);
+    font_draw_text_small(0, 30, msg, LCD_WHITE, LCD_BLACK, FONT_MONOSPACE);
+    snprintf(msg, sizeof(msg) - 1, "Err %6u", (unsigned int) errors);
+    font_draw_text_small(0, 40, msg, LCD_WHITE, LCD_BLACK, FONT_MONOSPACE);
+    lcd_flush();
+
+    if (dualshock_pressed_since_last_tick(DUALSHOCK_BUTTON_CROSS))
+    {
+        change_mode(mode_menu);
     }
 }
 
@@ -635,6 +744,7 @@ static void mode_line_follow(void)
  */
 static void render_text(int motor_left, int motor_right)
 {
+    const uint64_t start = get_time_ns();
     snprintf(msg, sizeof(msg) - 1, "%c%03d %c%03d", (motor_left < 0) ? '-' : '+', abs(motor_left), (motor_right < 0) ? '-' : '+', abs(motor_right));
     font_draw_text_small(0, 0, msg, LCD_WHITE, LCD_BLACK, FONT_MONOSPACE);
     int current_mA[4] = { 0 };
@@ -660,7 +770,11 @@ static void render_text(int motor_left, int motor_right)
     font_draw_text_small(0, 30, msg, LCD_WHITE, LCD_BLACK, FONT_MONOSPACE);
     snprintf(msg, sizeof(msg) - 1, " %03d  %03d", range_cm[0], range_cm[1]);
     font_draw_text_small(0, 40, msg, LCD_WHITE, LCD_BLACK, FONT_MONOSPACE);
+    perf_record(PERF_STAGE_RENDER_TEXT, start);
+
+    const uint64_t flush_start = get_time_ns();
     lcd_flush();
+    perf_record(PERF_STAGE_LCD_FLUSH, flush_start);
 }
 
 /*
@@ -687,6 +801,8 @@ static bool select_mode(
     {
         /* Remote mode */
         change_mode(mode_remote_control);
+        shaping_left.last_output = 0;
+        shaping_right.last_output = 0;
     }
     else if (p_menu_item == &top_menu_items[1])
     {
@@ -707,6 +823,14 @@ static bool select_mode(
         change_mode(mode_line_follow);
         line_follow.running = false;
     }
+    else if (p_menu_item == &top_menu_items[4])
+    {
+        change_mode(mode_diagnostics);
+    }
+    else if (p_menu_item == &top_menu_items[5])
+    {
+        change_mode(mode_link_stats);
+    }
     else
     {
         /* Go back to menu? */
@@ -717,29 +841,6 @@ static bool select_mode(
     return retval;
 }
 
-/**
- * While button is still held, mode routine should
- * do nothing. Avoids accidentally selecting something
- * immediately when you enter a mode.
- */
-static bool debounce_button(void)
-{
-    bool retval = false;
-    if (last_button != DUALSHOCK_NUM_BUTTONS)
-    {
-        if (dualshock_read_button(last_button))
-        {
-            /* Button still down .. do nothing */
-            retval = true;
-        }
-        else
-        {
-            last_button = DUALSHOCK_NUM_BUTTONS;
-        }
-    }
-    return retval;
-}
-
 /**************************************************
 * End of file
 ***************************************************/
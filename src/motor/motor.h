@@ -37,7 +37,9 @@ extern "C" {
 * Includes
 ***************************************************/
 
-/* None */
+#include "util/util.h"
+#include "stats/stats.h"
+#include "protocol/protocol.h"
 
 /**************************************************
 * Public Defines
@@ -47,6 +49,27 @@ extern "C" {
 
 #define MESSAGE_LEN 5
 
+/* Re-send an unchanged speed this often, so the controller
+ * knows we're still here */
+#define MOTOR_DEFAULT_KEEPALIVE_MS 200
+
+/* The controller stops the motors after a second without a
+ * request, so leave room for a lost frame or two */
+#define MOTOR_MAX_KEEPALIVE_MS 500
+
+/* The rate the link always starts at */
+#define MOTOR_DEFAULT_BAUD 115200
+
+/* Most pings motor_self_test() will send - each can take up
+ * to 100 ms if the controller doesn't answer */
+#define MOTOR_MAX_SELF_TEST_COUNT 10000
+
+#define MOTOR_NUM_CURRENT_CHANNELS 4
+#define MOTOR_NUM_RANGE_SENSORS 3
+
+/* Readings kept per sensor for motor_xxx_history() */
+#define MOTOR_HISTORY_LEN STATS_WINDOW_MAX
+
 /**************************************************
 * Public Data Types
 **************************************************/
@@ -72,6 +95,36 @@ typedef enum motor_t
 /* Outside of this is clipped */
 typedef int motor_speed_t;
 
+/* A sensor reading, and when it arrived */
+struct motor_sample_t
+{
+    double value;
+    /* get_time_ns() when the indication was read from the
+     * serial port, or 0 if there hasn't been one */
+    uint64_t timestamp_ns;
+    /* How long ago that was (UINT64_MAX if never) */
+    uint64_t age_ns;
+};
+
+/* Counters for the serial link since motor_init() */
+struct motor_link_stats_t
+{
+    uint32_t bytes_rx;
+    uint32_t bytes_tx;
+    /* Good frames, by command */
+    uint32_t frames_rx[MAX_VALID_COMMAND];
+    uint32_t frames_tx[MAX_VALID_COMMAND];
+    /* Received frames thrown away */
+    uint32_t bad_checksums;
+    uint32_t bad_escapes;
+    uint32_t oversize_frames;
+    uint32_t truncated_frames;
+    uint32_t unknown_commands;
+    /* Failed read() or write() calls */
+    uint32_t read_errors;
+    uint32_t write_errors;
+};
+
 /**************************************************
 * Public Data
 **************************************************/
@@ -121,15 +174,133 @@ extern enum motor_status_t motor_control(
     motor_speed_t speed
 );
 
+/**
+ * Set how often an unchanged speed is re-sent.
+ *
+ * motor_control() only sends a request when the speed for
+ * that side has changed, or when it hasn't sent one for
+ * `interval_ms`. The default is MOTOR_DEFAULT_KEEPALIVE_MS.
+ *
+ * @param[in] interval_ms The keepalive interval, up to
+ *                        MOTOR_MAX_KEEPALIVE_MS, or 0 to send
+ *                        every request regardless
+ */
+extern void motor_set_keepalive(uint32_t interval_ms);
+
+/**
+ * Set the baud rate to run the serial link at.
+ *
+ * motor_init() always opens the port at MOTOR_DEFAULT_BAUD.
+ * If the controller says it can change rate, both ends then
+ * switch to `baud`, falling back to MOTOR_DEFAULT_BAUD if the
+ * link doesn't work at the new rate. Call before motor_init().
+ *
+ * @param[in] baud The rate, SERIAL_MIN_BAUD..SERIAL_MAX_BAUD.
+ *                 Rates without a Bxxx constant are allowed,
+ *                 if the UART driver can manage them.
+ */
+extern void motor_set_baud(uint32_t baud);
+
+/**
+ * @return The baud rate the serial link is running at now
+ */
+extern uint32_t motor_get_baud(void);
+
+/**
+ * Measure the latency of the serial link, by sending the
+ * controller `count` pings one at a time and timing each
+ * answer. Prints a histogram of the round trips.
+ *
+ * Waits for the controller to finish booting and for any
+ * baud rate change first. Call after motor_init() and before
+ * motor_start_thread().
+ *
+ * @param[in] count    How many pings to send, up to
+ *                     MOTOR_MAX_SELF_TEST_COUNT
+ * @param[in] p_output Where to print the results
+ * @return An error code. MOTOR_STATUS_NO_RESPONSE means no
+ * pings were answered. A controller which can't answer pings
+ * is not an error.
+ */
+extern enum motor_status_t motor_self_test(unsigned int count, FILE *p_output);
+
+/**
+ * Start a batch. Speeds given to motor_control() are held
+ * until the matching motor_commit(), so everything decided in
+ * one tick reaches the controller as one burst. Batches may
+ * be nested.
+ */
+extern void motor_begin(void);
+
+/**
+ * End a batch. If this is the outermost batch, send every
+ * held speed with a single write - or, if the I/O thread is
+ * running, hand them to it.
+ *
+ * @return An error code
+ */
+extern enum motor_status_t motor_commit(void);
+
+/**
+ * Start a thread to look after the serial port. It sleeps
+ * until data arrives, decodes it straight away and publishes
+ * the readings, so motor_current() and motor_read_distance()
+ * are always fresh and never block. It also sends whatever
+ * motor_commit() hands it. Once it is running, motor_poll()
+ * does nothing. motor_close() stops it.
+ *
+ * Call after motor_init().
+ *
+ * @return An error code
+ */
+extern enum motor_status_t motor_start_thread(void);
+
+/**
+ * Trace the latency of the next speed request for a motor.
+ *
+ * When the next speed request for the given motor has been
+ * written to the serial port, the time since `origin_ns` is
+ * recorded as PERF_STAGE_STICK_TO_MOTOR.
+ *
+ * @param[in] motor     Which motor's next request to trace.
+ * @param[in] origin_ns When the input which caused the request
+ *                      happened (see get_time_ns()).
+ */
+extern void motor_trace(
+    enum motor_t motor,
+    uint64_t origin_ns
+);
+
 /**
  * Check the motor controller serial port for ACKs and
  * tick count updates. Call this regularly
  * otherwise the serial port buffer will fill up.
+ * Not needed if motor_start_thread() has been called.
  *
  * @return An error code
  */
 motor_status_t motor_poll(void);
 
+/**
+ * Find out how far behind the motor controller we are.
+ *
+ * motor_poll() reads until the serial port is empty. Before it
+ * starts, it notes how many bytes are waiting; this function
+ * returns that number, and the largest it has ever been.
+ *
+ * @param[out] p_max If not NULL, set to the high-water mark
+ * @return the number of bytes waiting at the last poll
+ */
+extern size_t motor_get_rx_backlog(size_t *p_max);
+
+/**
+ * Get the serial port file descriptor, so the caller can
+ * call motor_poll() as soon as there is data waiting.
+ *
+ * @return the file descriptor, or -1 if the port is not open
+ */
+int motor_get_fd(void);
+
 /**
  * Find out how much current a channel is using.
  *
@@ -149,6 +320,91 @@ float motor_current(
  */
 double motor_read_distance(uint8_t sensor);
 
+/**
+ * Read the latest current measurement, and how old it is.
+ *
+ * @param[in]  channel  Which channel to read
+ * @param[out] p_sample The reading in Amps, with its timestamp
+ * @return false if the channel is invalid or hasn't reported yet
+ */
+extern bool motor_current_sample(
+    uint8_t channel,
+    struct motor_sample_t *p_sample
+);
+
+/**
+ * Read the latest ultrasound measurement, and how old it is.
+ *
+ * @param[in]  sensor   Which sensor to read
+ * @param[out] p_sample The distance in cm, with its timestamp
+ * @return false if the sensor is invalid or hasn't reported yet
+ */
+extern bool motor_read_distance_sample(
+    uint8_t sensor,
+    struct motor_sample_t *p_sample
+);
+
+/**
+ * Take a copy of the last MOTOR_HISTORY_LEN current
+ * measurements, for querying with the stats_window_xxx
+ * functions (mean, median, value some time ago, etc).
+ *
+ * @param[in]  channel   Which channel to read
+ * @param[out] p_history The readings in Amps
+ * @return false if the channel is invalid
+ */
+extern bool motor_current_history(
+    uint8_t channel,
+    struct stats_window_t *p_history
+);
+
+/**
+ * Take a copy of the last MOTOR_HISTORY_LEN ultrasound
+ * measurements, for querying with the stats_window_xxx
+ * functions (mean, median, value some time ago, etc).
+ *
+ * @param[in]  sensor    Which sensor to read
+ * @param[out] p_history The distances in cm
+ * @return false if the sensor is invalid
+ */
+extern bool motor_read_distance_history(
+    uint8_t sensor,
+    struct stats_window_t *p_history
+);
+
+/**
+ * Print, for each sensor, how often it has been reporting
+ * (a histogram of the gaps between indications).
+ *
+ * @param[in] p_output Where to print
+ */
+extern void motor_dump_sensor_rates(FILE *p_output);
+
+/**
+ * Print a histogram of how long the controller takes to
+ * acknowledge each kind of request, and how many requests
+ * had to be re-sent or were never acknowledged.
+ *
+ * @param[in] p_output Where to print
+ */
+extern void motor_dump_round_trips(FILE *p_output);
+
+/**
+ * Take a copy of the serial link counters. Safe to call
+ * while the I/O thread is running.
+ *
+ * @param[out] p_stats The counters
+ */
+extern void motor_get_link_stats(struct motor_link_stats_t *p_stats);
+
+/**
+ * Print the serial link counters: bytes and frames each way,
+ * and every kind of error.
+ *
+ * @param[in] p_output Where to print
+ */
+extern void motor_dump_link_stats(FILE *p_output);
+
 #ifdef __cplusplus
 }
 #endif
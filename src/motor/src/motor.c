@@ -29,9 +29,15 @@
 * Includes
 ***************************************************/
 
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -39,32 +45,61 @@
 #include <unistd.h>
 
 #include "util/util.h"
+#include "perf/perf.h"
+#include "protocol/protocol.h"
+#include "serial/serial.h"
+#include "stats/stats.h"
 #include "../motor.h"
 
 /**************************************************
 * Defines
 ***************************************************/
 
-/*
-Messages look like this:
+/* The wire format is described in protocol/protocol.h */
 
-COMMAND DATA_LEN <DATA> CRC
+/* MOTOR_DEFAULT_BAUD, as a termios speed */
+#define BAUDRATE B115200
 
-Message are then SLIP encoded for transmission over the UART.
+/* How long to wait for each step of a baud rate change, and
+ * how long the link may be silent at the new rate before we
+ * assume the controller has gone back to MOTOR_DEFAULT_BAUD */
+#define BAUD_TIMEOUT_NS (500 * 1000 * 1000ULL)
+#define BAUD_SILENCE_NS (1000 * 1000 * 1000ULL)
 
-Frame Start/End: MESSAGE_HEADER
-MESSAGE_HEADER => MESSAGE_ESC MESSAGE_ESC_HEADER
-MESSAGE_ESC    => MESSAGE_ESC MESSAGE_ESC_ESC
-*/
+/* The controller may still be in its bootloader when we
+ * first ask what it can do, so ask again a few times */
+#define CAPS_RETRY_NS 1000000000ULL
+#define CAPS_MAX_REQUESTS 5
 
-#define BAUDRATE B115200
+/* Room for several frames queued between motor_begin() and motor_commit() */
+#define TX_QUEUE_LEN 1024
+
+/* Big enough to empty the kernel's buffer in one go at 115200 baud */
+#define RX_BUFFER_LEN 4096
+
+/* Stop draining after this many reads, so a babbling
+ * controller can't starve everything else */
+#define RX_MAX_READS 8
 
-#define MESSAGE_HEADER             0xC0
-#define MESSAGE_ESC                0xDB
-#define MESSAGE_ESC_HEADER         0xDC
-#define MESSAGE_ESC_ESC            0xDD
+/* Setpoint updates waiting for the I/O thread. Must be a power of two. */
+#define SETPOINT_RING_LEN 16
 
-#define MAX_MESSAGE_LEN 254
+/* How long to wait for space in the UART transmit buffer */
+#define TX_TIMEOUT_MS 50
+
+/* Requests we remember while waiting for an ACK_IND */
+#define INFLIGHT_LEN 8
+
+/* How long motor_self_test() waits for each PING_IND, and
+ * how often it checks on the controller while waiting for
+ * it to boot */
+#define PING_TIMEOUT_NS (100 * 1000 * 1000ULL)
+#define SELF_TEST_POLL_NS (10 * 1000 * 1000ULL)
+
+/* How long to wait for an ACK_IND before sending a request
+ * again, and how many times to try before giving up */
+#define ACK_TIMEOUT_NS (50 * 1000 * 1000ULL)
+#define ACK_MAX_RETRIES 2
 
 #define MICROSECONDS_PER_CM 29.154519
 
@@ -80,42 +115,6 @@ MESSAGE_ESC    => MESSAGE_ESC MESSAGE_ESC_ESC
 * Data Types
 **************************************************/
 
-typedef enum motor_command_t
-{
-    MESSAGE_COMMAND_SPEED_REQ,
-    MESSAGE_COMMAND_SPEED_IND,
-    MESSAGE_COMMAND_CURRENT_OVERFLOW_IND,
-    MESSAGE_COMMAND_CURRENT_IND,
-    MESSAGE_COMMAND_RANGE_IND,
-    MAX_VALID_COMMAND
-} motor_command_t;
-
-typedef struct message_speed_req_t
-{
-    uint32_t ctx;
-    uint8_t side; // 0 = left, 1 = right
-    uint8_t clicks; // max clicks to travel
-    int16_t speed; // clicks per second
-} message_speed_req_t;
-
-typedef struct message_speed_ind_t
-{
-    uint16_t speed;
-    uint8_t motor;
-} message_speed_ind_t;
-
-typedef struct message_range_ind_t
-{
-    uint16_t range;
-    uint8_t sensor;
-} message_range_ind_t;
-
-typedef struct message_current_ind_t
-{
-    uint16_t current;
-    uint8_t motor;
-} message_current_ind_t;
-
 typedef struct motor_settings_t
 {
     bool forward;
@@ -124,32 +123,94 @@ typedef struct motor_settings_t
     unsigned int last_ticks_remaining;
 } motor_settings_t;
 
-typedef struct message_t
+/* Speeds (and trace origins) handed over by motor_commit() */
+typedef struct setpoint_update_t
+{
+    bool set[2];
+    motor_speed_t speed[2];
+    uint64_t origin_ns[2];
+} setpoint_update_t;
+
+/* A request waiting for its ACK_IND */
+typedef struct inflight_t
 {
-    motor_command_t command;
+    bool in_use;
+    enum protocol_command_t command;
+    uint16_t ctx;
+    /* Which sides it sets, so a newer request can replace it */
+    bool sides[2];
+    /* When it was last sent, for the round trip time */
+    uint64_t sent_ns;
+    /* When we started waiting for an ACK_IND for these sides,
+     * and how often we've re-sent since. Carried over from any
+     * request this one replaced, so a stream of new speeds
+     * can't keep a dead controller from timing out. */
+    uint64_t waiting_ns;
+    unsigned int retries;
+    /* The ctx of the oldest request it replaced. The controller
+     * applies requests in order, so an ACK_IND for anything from
+     * here up to ctx shows it is keeping up, even if every
+     * request is replaced before its own ACK_IND gets back. */
+    uint16_t first_ctx;
     size_t data_len;
-    size_t data_read;
-    uint8_t data[MAX_MESSAGE_LEN];
-} message_t;
+    uint8_t data[PROTOCOL_MAX_DATA_LEN];
+} inflight_t;
+
+/* Where we are in changing the link's baud rate */
+typedef enum baud_state_t
+{
+    /* At whatever rate we've settled on */
+    BAUD_STATE_IDLE,
+    /* BAUD_REQ sent, waiting for the BAUD_IND */
+    BAUD_STATE_REQUESTED,
+    /* Switched, and sent a CAPS_REQ at the new rate to check */
+    BAUD_STATE_CHECKING
+} baud_state_t;
 
-typedef enum read_state_t
+/* The latest sensor readings, and when each arrived */
+typedef struct sensor_snapshot_t
 {
-    READ_STATE_IDLE,
-    READ_STATE_COMMAND,
-    READ_STATE_LEN,
-    READ_STATE_DATA,
-    READ_STATE_CHECKSUM,
-} read_state_t;
+    float currents[MOTOR_NUM_CURRENT_CHANNELS];
+    uint64_t current_ns[MOTOR_NUM_CURRENT_CHANNELS];
+    double range_cm[MOTOR_NUM_RANGE_SENSORS];
+    uint64_t range_ns[MOTOR_NUM_RANGE_SENSORS];
+} sensor_snapshot_t;
+
 
 /**************************************************
 * Function Prototypes
 **************************************************/
 
-static uint8_t calc_checksum(const message_t* p_message);
-static void process_rx_message(const message_t* p_message);
-static void process_rx_byte(uint8_t byte);
-static void send_message(motor_command_t command, size_t data_len, const uint8_t* p_data);
-static void write_esc(int fd, uint8_t data);
+static void process_rx_message(const struct protocol_message_t* p_message, void* p_context);
+static void send_message(enum protocol_command_t command, size_t data_len, const uint8_t* p_data);
+static int write_all(const uint8_t* p_data, size_t len);
+static int flush_queue(void);
+static int send_setpoints(const setpoint_update_t* p_update);
+static void request_caps(uint64_t now_ns);
+static void check_caps(uint64_t now_ns);
+static void report_port(const char* sz_serial_port, int low_latency_err);
+static void send_request(enum protocol_command_t command, uint16_t ctx, const bool sides[2], size_t data_len, const uint8_t* p_data);
+static void handle_ack(const struct protocol_ack_ind_t* p_ind);
+static void check_inflight(uint64_t now_ns);
+static void reset_inflight(void);
+static void request_baud(uint64_t now_ns);
+static void handle_baud_ind(const struct protocol_baud_ind_t* p_ind);
+static void check_baud(uint64_t now_ns);
+static void restore_baud(void);
+static void reset_baud(void);
+static motor_status_t drain_rx(void);
+static void wait_rx(uint64_t timeout_ns);
+static void publish_begin(void);
+static void publish_end(void);
+static void read_sensors(sensor_snapshot_t* p_snapshot);
+static void read_history(const struct stats_window_t* p_history, struct stats_window_t* p_copy);
+static void fill_sample(struct motor_sample_t* p_sample, double value, uint64_t timestamp_ns);
+static bool ring_push(const setpoint_update_t* p_update);
+static bool ring_pop(setpoint_update_t* p_update);
+static void* io_thread_main(void* p_arg);
+static void stop_io_thread(void);
+static void count(uint32_t* p_counter, uint32_t n);
+static uint32_t load(const uint32_t* p_counter);
 
 #ifdef VERBOSE
 static uint32_t get_ts(void);
@@ -167,13 +228,124 @@ static uint32_t get_ts(void);
 
 static int fd = -1;
 
-static message_t rx_message = { 0 };
+static struct protocol_decoder_t decoder = { .handler = process_rx_message };
+
+static uint8_t rx_buffer[RX_BUFFER_LEN];
+
+/* Bytes waiting at the start of the last poll, and the most ever */
+static size_t rx_backlog = 0;
+static size_t rx_backlog_max = 0;
+
+/* Written with count() by the thread doing the serial I/O;
+ * the decoder keeps its own error counts */
+static struct motor_link_stats_t link_stats;
+
+/* Written by whichever thread decodes received frames */
+static sensor_snapshot_t sensors = { .range_cm = { 10, 10, 10 } };
+
+/* A copy of `sensors` for everyone else, behind a seqlock:
+ * odd while being written, even when stable */
+static sensor_snapshot_t published = { .range_cm = { 10, 10, 10 } };
+static uint32_t published_seq = 0;
+
+/* Recent readings from each sensor. These are only ever
+ * appended to between publish_begin() and publish_end(), so
+ * the same seqlock covers them. */
+static struct stats_window_t current_history[MOTOR_NUM_CURRENT_CHANNELS];
+static struct stats_window_t range_history[MOTOR_NUM_RANGE_SENSORS];
+
+/* When the bytes being decoded were read */
+static uint64_t rx_time_ns = 0;
+
+/* Gaps between indications from each sensor */
+static struct stats_hist_t current_intervals[MOTOR_NUM_CURRENT_CHANNELS];
+static struct stats_hist_t range_intervals[MOTOR_NUM_RANGE_SENSORS];
+
+/* Per side, when the input behind the next speed request happened */
+static uint64_t trace_origin_ns[2] = { 0 };
+
+/* Per side, the last speed we sent and when we sent it */
+static motor_speed_t setpoint[2] = { 0 };
+static uint64_t setpoint_sent_ns[2] = { 0 };
+static bool setpoint_valid[2] = { false, false };
 
-static read_state_t read_state = READ_STATE_IDLE;
+static uint64_t keepalive_ns = (uint64_t) MOTOR_DEFAULT_KEEPALIVE_MS * 1000000;
 
-static float currents[4] = { 0 };
+static uint16_t tx_ctx = 0;
 
-static double range_cm[3] = { 10, 10, 10 };
+/* Per side, the speed given to motor_control() but not yet committed */
+static motor_speed_t pending_speed[2] = { 0 };
+static bool pending[2] = { false, false };
+
+/* Set when the controller tells us it understands DUAL_SPEED_REQ */
+static bool dual_speed_supported = false;
+
+/* Whether we've had a CAPS_IND, and how often we've asked for one */
+static bool caps_known = false;
+static unsigned int caps_requests = 0;
+static uint64_t caps_request_ns = 0;
+
+/* Set when the controller says it will answer PING_REQs */
+static bool ping_supported = false;
+
+/* The PING_REQ motor_self_test() is waiting on, and when
+ * its answer arrived */
+static uint16_t ping_ctx = 0;
+static bool ping_waiting = false;
+static uint64_t ping_rx_ns = 0;
+
+/* Set when the controller says it will send ACK_INDs */
+static bool ack_supported = false;
+
+/* Requests not yet acknowledged. Only touched by the thread
+ * doing the serial I/O. */
+static inflight_t inflight[INFLIGHT_LEN];
+static unsigned int inflight_count = 0;
+
+/* Time from sending each command to its ACK_IND */
+static struct stats_hist_t ack_rtt[MAX_VALID_COMMAND];
+static uint64_t ack_retries = 0;
+static uint64_t ack_failures = 0;
+
+/* Set when a request went unacknowledged however many times
+ * we sent it; cleared by the next ACK_IND */
+static bool no_response = false;
+
+/* The baud rate we want, and the one we're at. Only the
+ * thread doing the serial I/O changes link_baud. */
+static uint32_t wanted_baud = MOTOR_DEFAULT_BAUD;
+static uint32_t link_baud = MOTOR_DEFAULT_BAUD;
+
+/* Set when the controller says it can change baud rate */
+static bool baud_supported = false;
+
+static baud_state_t baud_state = BAUD_STATE_IDLE;
+static uint64_t baud_deadline_ns = 0;
+
+/* Only one try per motor_init() - if a rate didn't work,
+ * it won't work next time either */
+static bool baud_tried = false;
+
+/* When we last received a good frame */
+static uint64_t last_frame_ns = 0;
+
+/* Frames waiting for flush_queue() */
+static uint8_t tx_queue[TX_QUEUE_LEN];
+static size_t tx_queue_len = 0;
+
+/* How many motor_begin() calls are waiting for a motor_commit() */
+static unsigned int tx_batch_depth = 0;
+
+/* Single producer (motor_commit()), single consumer (the I/O thread) */
+static setpoint_update_t setpoint_ring[SETPOINT_RING_LEN];
+static uint32_t ring_head = 0;
+static uint32_t ring_tail = 0;
+
+/* The optional I/O thread, and how we wake it */
+static pthread_t io_thread;
+static bool io_thread_running = false;
+static bool io_thread_stop = false;
+static int io_event_fd = -1;
 
 /**************************************************
 * Public Functions
@@ -195,19 +367,66 @@ enum motor_status_t motor_init(
 )
 {
     struct termios newtio;
-    fd = open(sz_serial_port, O_RDWR | O_NOCTTY);
+    fd = open(sz_serial_port, O_RDWR | O_NOCTTY | O_NONBLOCK);
     if (fd < 0)
     {
         perror(sz_serial_port);
         return MOTOR_STATUS_NO_DEVICE;
     }
 
+    /* Raw: no line editing, no translation, no software flow
+     * control - all of which would mangle binary frames */
     memset(&newtio, 0, sizeof(newtio));
     newtio.c_cflag = BAUDRATE | CRTSCTS | CS8 | CLOCAL | CREAD;
     newtio.c_cc[VTIME] = 0;   /* inter-character timer unused */
     newtio.c_cc[VMIN] = 0;    /* don't block */
-    tcflush(fd, TCIFLUSH);
-    tcsetattr(fd, TCSANOW, &newtio);
+
+    /* Throw away anything that arrived before now (on an
+     * Arduino, bootloader chatter). After this, received data
+     * is never flushed; the decoder finds the next frame. */
+    if (tcsetattr(fd, TCSAFLUSH, &newtio) < 0)
+    {
+        perror("Can't configure serial port");
+        close(fd);
+        fd = -1;
+        return MOTOR_STATUS_SERIAL_ERROR;
+    }
+
+    /* Otherwise a USB serial adapter holds received bytes for
+     * its latency timer before passing them on */
+    const int low_latency_err = (serial_set_low_latency(fd) == 0) ? 0 : errno;
+    report_port(sz_serial_port, low_latency_err);
+
+    memset(&link_stats, 0, sizeof(link_stats));
+    memset(&decoder.errors, 0, sizeof(decoder.errors));
+
+    /* The controller has reset, so it needs telling everything */
+    setpoint_valid[0] = false;
+    setpoint_valid[1] = false;
+
+    /* Single side requests until it says otherwise. A
+     * controller that doesn't know CAPS_REQ will just
+     * ignore it. */
+    dual_speed_supported = false;
+    ping_supported = false;
+    caps_known = false;
+    caps_requests = 0;
+    reset_inflight();
+    reset_baud();
+    request_caps(get_time_ns());
+    flush_queue();
+
+    /* Readings from before the reset are no use */
+    publish_begin();
+    for (size_t i = 0; i < NUMELTS(current_history); i++)
+    {
+        stats_window_reset(&current_history[i], MOTOR_HISTORY_LEN);
+    }
+    for (size_t i = 0; i < NUMELTS(range_history); i++)
+    {
+        stats_window_reset(&range_history[i], MOTOR_HISTORY_LEN);
+    }
+    publish_end();
 
     return MOTOR_STATUS_OK;
 }
@@ -221,11 +440,26 @@ enum motor_status_t motor_init(
  */
 void motor_close(void)
 {
+    stop_io_thread();
     if (fd >= 0)
     {
         close(fd);
         fd = -1;
     }
+    tx_queue_len = 0;
+    tx_batch_depth = 0;
+    protocol_decoder_reset(&decoder);
+    setpoint_valid[0] = false;
+    setpoint_valid[1] = false;
+    pending[0] = false;
+    pending[1] = false;
+    dual_speed_supported = false;
+    ping_supported = false;
+    caps_known = false;
+    reset_inflight();
+    reset_baud();
+    ring_head = 0;
+    ring_tail = 0;
 }
 
 /**
@@ -259,7 +493,6 @@ enum motor_status_t motor_control(
     motor_speed_t speed
 )
 {
-    static uint32_t last_ctx = 0;
     // printf("In motor_control(motor=%u, speed=%d, steps=%u)\n", motor, speed, step_count);
     if (speed > MOTOR_MAX_SPEED)
     {
@@ -269,339 +502,1542 @@ enum motor_status_t motor_control(
     {
         speed = -MOTOR_MAX_SPEED;
     }
-    if (motor == MOTOR_BOTH)
+    /* Held until the outermost motor_commit(), so that
+     * both sides can go in one frame if they both change */
+    motor_begin();
+    if ((motor == MOTOR_LEFT) || (motor == MOTOR_BOTH))
     {
-        message_speed_req_t req = {
-                .ctx = last_ctx++,
-                .side = 0,
-                .clicks = 0,
-                .speed = speed
-        };
-        send_message(MESSAGE_COMMAND_SPEED_REQ, sizeof(req), (const uint8_t*) &req);
-        req.side = 1;
-        req.ctx = last_ctx++;
-        send_message(MESSAGE_COMMAND_SPEED_REQ, sizeof(req), (const uint8_t*) &req);
-    } else {
-        message_speed_req_t req = {
-                .ctx = last_ctx++,
-                .side = (motor == MOTOR_LEFT) ? 0 : 1,
-                .clicks = 0,
-                .speed = speed
-        };
-        send_message(MESSAGE_COMMAND_SPEED_REQ, sizeof(req), (const uint8_t*) &req);
+        pending[0] = true;
+        pending_speed[0] = speed;
     }
-    return MOTOR_STATUS_OK;
+    if ((motor == MOTOR_RIGHT) || (motor == MOTOR_BOTH))
+    {
+        pending[1] = true;
+        pending_speed[1] = speed;
+    }
+    return motor_commit();
 }
 
 /**
- * Check the motor controller serial port for incoming messages,
- * dispatching them to the handler when complete.
+ * Set how often an unchanged speed is re-sent. Repeated
+ * calls to motor_control() with the same speed are dropped
+ * in between, but the controller still hears from us often
+ * enough that its safety timeout doesn't stop the motors.
  *
- * @return An error code
+ * @param[in] interval_ms The keepalive interval, or 0 to send every request
  */
-motor_status_t motor_poll(void)
+void motor_set_keepalive(uint32_t interval_ms)
 {
-    motor_status_t result = MOTOR_STATUS_OK;
-    uint8_t message_buffer[256];
-    if (fd >= 0)
-    {
-        ssize_t read_result = read(fd, message_buffer, sizeof(message_buffer));
-        if (read_result > 0)
-        {
-            //printf("Read %zu from serial port\n", read_result);
-            bool is_escape = false;
-            for (ssize_t index = 0; index < read_result; index++)
-            {
-                const uint8_t data = message_buffer[index];
-                // printf("%02x ", data);
-                if (is_escape)
-                {
-                    if (data == MESSAGE_ESC_HEADER)
-                    {
-                        // Escaped header => process normally
-                        process_rx_byte(MESSAGE_HEADER);
-                    }
-                    else if (data == MESSAGE_ESC_ESC)
-                    {
-                        process_rx_byte(MESSAGE_ESC);
-                    }
-                    else
-                    {
-                        printf("Bad escape 0x%02x\n", data);
-                    }
-                    is_escape = false;
-                }
-                else if (data == MESSAGE_ESC)
-                {
-                    is_escape = true;
-                }
-                else if (data == MESSAGE_HEADER)
-                {
-                    // Unescaped header => start of message
-                    read_state = READ_STATE_COMMAND;
-                }
-                else
-                {
-                    process_rx_byte(data);
-                }
-            }
-            // printf("\n");
-        }
-        else if (read_result < 0)
-        {
-            printf("Error reading serial port! %zd\n", read_result);
-            result = MOTOR_STATUS_SERIAL_ERROR;
-        }
-    }
-    else
-    {
-        result = MOTOR_STATUS_NO_DEVICE;
-    }
-    return result;
+    keepalive_ns = (uint64_t) interval_ms * 1000000;
 }
 
 /**
- * Find out how much current a motor is using.
+ * Set the baud rate to ask the controller for, once the port
+ * is open at MOTOR_DEFAULT_BAUD.
  *
- * @param[in] motor Which motor to read
- * @return The amount of current in Amps.
+ * @param[in] baud The rate
  */
-float motor_current(
-    uint8_t channel
-)
+void motor_set_baud(uint32_t baud)
 {
-    if (channel < NUMELTS(currents)) {
-        return currents[channel];
-    } else {
-        return 0;
-    }
+    wanted_baud = baud;
 }
 
 /**
- * Read the latest ultrasound measurement.
- *
- * @return a distance in cm to the nearest object
+ * @return The baud rate the serial link is running at now
  */
-double motor_read_distance(
-    uint8_t sensor
-)
+uint32_t motor_get_baud(void)
 {
-    if (sensor < NUMELTS(range_cm)) {
-        return range_cm[sensor];
-    } else {
-        return 0;
-    }
+    return __atomic_load_n(&link_baud, __ATOMIC_RELAXED);
 }
 
-/**************************************************
-* Private Functions
-***************************************************/
-
 /**
- * Calculate the message checksum.
+ * Ping the controller `count` times and print how long each
+ * answer took.
  *
- * XORs the all the bytes in the given message.
- *
- * @return the calculated checksum
+ * @param[in] count    How many pings to send
+ * @param[in] p_output Where to print the results
+ * @return An error code
  */
-static uint8_t calc_checksum(const message_t* p_message)
+enum motor_status_t motor_self_test(unsigned int count, FILE *p_output)
 {
-    uint8_t result = 0xFF;
-    result ^= (uint8_t) p_message->command;
-    result ^= (uint8_t) p_message->data_len;
-    for (size_t i = 0; i < p_message->data_len; i++)
+    if (fd < 0)
     {
-        result ^= p_message->data[i];
+        return MOTOR_STATUS_NO_DEVICE;
     }
-    return result;
-}
+    if (io_thread_running)
+    {
+        fprintf(p_output, "Can't run the serial self-test with the serial thread running\n");
+        return MOTOR_STATUS_SERIAL_ERROR;
+    }
+    count = MIN(count, MOTOR_MAX_SELF_TEST_COUNT);
 
-/**
- * Process the message from the controller. Currently just
- * does some logging. Checksums have already been verified at
- * this stage.
- *
- * @param[in] p_message The received message
- */
-static void process_rx_message(const message_t* p_message)
-{
-    // printf("RX %02x: ", p_message->command);
-    // for (size_t i = 0; i < p_message->data_len; i++)
-    // {
-    //     printf("%02x ", p_message->data[i]);
-    // }
-    // printf("\n");
+    /* Give the controller as long to boot as we'd give it
+     * anyway, and let any baud rate change finish */
+    const uint64_t start_ns = get_time_ns();
+    while ((!caps_known || (baud_state != BAUD_STATE_IDLE)) &&
+           ((get_time_ns() - start_ns) < (CAPS_MAX_REQUESTS * CAPS_RETRY_NS)))
+    {
+        wait_rx(SELF_TEST_POLL_NS);
+        const uint64_t now_ns = get_time_ns();
+        check_caps(now_ns);
+        check_baud(now_ns);
+        flush_queue();
+    }
+    if (!caps_known)
+    {
+        fprintf(p_output, "Motor controller not responding, skipping serial self-test\n");
+        return MOTOR_STATUS_NO_RESPONSE;
+    }
+    if (!ping_supported)
+    {
+        fprintf(p_output, "Motor controller doesn't answer pings, skipping serial self-test\n");
+        return MOTOR_STATUS_OK;
+    }
 
-    switch (p_message->command) {
-    case MESSAGE_COMMAND_SPEED_IND:
+    struct stats_hist_t rtt;
+    stats_hist_reset(&rtt);
+    unsigned int lost = 0;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        const struct protocol_ping_t req = { .ctx = ++ping_ctx };
+        uint8_t data[PROTOCOL_MAX_DATA_LEN];
+        send_message(MESSAGE_COMMAND_PING_REQ, protocol_pack_ping(data, &req), data);
+        ping_waiting = true;
+
+        /* Timed from before the write, so the round trip
+         * includes everything the kernel and driver add */
+        const uint64_t sent_ns = get_time_ns();
+        flush_queue();
+        uint64_t elapsed_ns = 0;
+        while (ping_waiting && (elapsed_ns < PING_TIMEOUT_NS))
         {
-            // printf("Speed ind %zu bytes\n", p_message->data_len);
-            if (p_message->data_len == 3)
-            {
-#ifdef VERBOSE
-                message_speed_ind_t ind = { 0 };
-                ind.speed = p_message->data[0] | (p_message->data[1] << 8);
-                ind.motor = p_message->data[2];
-                printf_verbose("%u: Speed ind motor %u, speed %u\n", get_ts(), ind.motor, ind.speed);
-#endif
-            }
+            wait_rx(PING_TIMEOUT_NS - elapsed_ns);
+            elapsed_ns = get_time_ns() - sent_ns;
         }
-        break;
-    case MESSAGE_COMMAND_CURRENT_OVERFLOW_IND:
-        printf("Overflow ind %zu bytes\n", p_message->data_len);
-        abort();
-        break;
-    case MESSAGE_COMMAND_CURRENT_IND:
+
+        if (ping_waiting)
         {
-            if (p_message->data_len == 3)
-            {
-                message_current_ind_t ind = { 0 };
-                ind.current = p_message->data[0] | (p_message->data[1] << 8);
-                ind.motor = p_message->data[2];
-                printf_verbose("%u: Current ind motor %u, current %f mA (%u)\n", get_ts(), ind.motor, ind.current * 4.9f, ind.current);
-                currents[ind.motor] = (ind.current * 4.9f) / 1000.0f;
-            }
+            ping_waiting = false;
+            lost++;
         }
-        break;
-    case MESSAGE_COMMAND_RANGE_IND:
+        else
         {
-            // printf("Range ind %zu bytes\n", p_message->data_len);
-            if (p_message->data_len == 3)
-            {
-                message_range_ind_t ind = { 0 };
-                ind.range = p_message->data[0] | (p_message->data[1] << 8);
-                ind.sensor = p_message->data[2];
-                double range = ind.range;
-                range = range / MICROSECONDS_PER_CM;
-                // There and back
-                range = range / 2;
-                range_cm[ind.sensor] = range;
-                printf_verbose("%u: Range ind sensor %u, range %f cm / %u µs\n", get_ts(), ind.sensor, range, ind.range);
-            }
+            stats_hist_record(&rtt, ping_rx_ns - sent_ns);
         }
-        break;
-    default:
-        printf("Unknown command 0x%02x\n", p_message->command);
     }
+
+    fprintf(p_output, "Serial round trips at %"PRIu32" baud (us):\n", link_baud);
+    stats_hist_print(&rtt, "Ping", 1000, p_output);
+    fprintf(p_output, "Lost %u of %u\n", lost, count);
+    return ((count > 0) && (lost == count)) ? MOTOR_STATUS_NO_RESPONSE : MOTOR_STATUS_OK;
+}
+
+/**
+ * Hold back speeds given to motor_control() until the matching
+ * motor_commit(). Calls may be nested; only the outermost
+ * motor_commit() sends.
+ */
+void motor_begin(void)
+{
+    tx_batch_depth++;
 }
 
 /**
- * Feed incoming bytes through the state machine.
- * Will call process_rx_message() when a valid message
- * has been received.
+ * Send the speeds held since motor_begin() as one burst - or,
+ * with the I/O thread running, hand them to it to send.
  *
- * @param[in] byte The received byte
+ * @return An error code. MOTOR_STATUS_NO_RESPONSE means an
+ * earlier request was never acknowledged.
  */
-static void process_rx_byte(uint8_t byte)
+enum motor_status_t motor_commit(void)
 {
-    switch (read_state)
+    enum motor_status_t result = MOTOR_STATUS_OK;
+    if (__atomic_load_n(&no_response, __ATOMIC_RELAXED))
     {
-    case READ_STATE_IDLE:
-        break;
-    case READ_STATE_COMMAND:
-        if (byte < MAX_VALID_COMMAND)
-        {
-            rx_message.command = (motor_command_t) byte;
-            read_state = READ_STATE_LEN;
-        } else {
-            read_state = READ_STATE_IDLE;
-        }
-        break;
-    case READ_STATE_LEN:
-        rx_message.data_read = 0;
-        rx_message.data_len = byte;
-        read_state = rx_message.data_len ? READ_STATE_DATA : READ_STATE_CHECKSUM;
-        break;
-    case READ_STATE_DATA:
-        rx_message.data[rx_message.data_read++] = byte;
-        if (rx_message.data_read == rx_message.data_len)
+        result = MOTOR_STATUS_NO_RESPONSE;
+    }
+    if (tx_batch_depth > 0)
+    {
+        tx_batch_depth--;
+    }
+    if ((tx_batch_depth != 0) || !(pending[0] || pending[1]))
+    {
+        return result;
+    }
+
+    setpoint_update_t update = { { false } };
+    for (uint8_t side = 0; side < NUMELTS(pending); side++)
+    {
+        update.set[side] = pending[side];
+        update.speed[side] = pending_speed[side];
+        update.origin_ns[side] = pending[side] ? trace_origin_ns[side] : 0;
+    }
+
+    if (io_thread_running)
+    {
+        if (!ring_push(&update))
         {
-            read_state = READ_STATE_CHECKSUM;
+            /* Thread is behind - keep these for next time */
+            return result;
         }
-        break;
-    case READ_STATE_CHECKSUM:
-        if (byte == calc_checksum(&rx_message))
+        const uint64_t one = 1;
+        if (write(io_event_fd, &one, sizeof(one)) != sizeof(one))
         {
-            process_rx_message(&rx_message);
+            result = MOTOR_STATUS_SERIAL_ERROR;
         }
-        else
+    }
+    else if (send_setpoints(&update) != 0)
+    {
+        result = MOTOR_STATUS_SERIAL_ERROR;
+    }
+
+    for (uint8_t side = 0; side < NUMELTS(pending); side++)
+    {
+        if (pending[side])
         {
-            printf("Dropping bad packet\n");
+            trace_origin_ns[side] = 0;
+            pending[side] = false;
         }
-        read_state = READ_STATE_IDLE;
-        break;
     }
+    return result;
 }
 
-
 /**
- * Write a message to the UART.
+ * Start a thread which sleeps on the serial port, decodes
+ * frames the moment they arrive and sends the speeds that
+ * motor_commit() hands it. Call after motor_init().
  *
- * @param command[in] The command to send
- * @param data_len[in] The number of bytes in p_data
- * @param p_data[in] The data for the command
+ * @return An error code
  */
-static void send_message(motor_command_t command, size_t data_len, const uint8_t* p_data)
+enum motor_status_t motor_start_thread(void)
 {
-    uint8_t csum = 0xFF;
-
     if (fd < 0)
     {
-        return;
+        return MOTOR_STATUS_NO_DEVICE;
     }
-
-    if (data_len >= 256)
+    if (io_thread_running)
     {
-        return;
+        return MOTOR_STATUS_OK;
     }
 
-    //printf("TX %02x: ", command);
-    //for (size_t i = 0; i < data_len; i++)
-    //{
-    //    printf("%02x ", p_data[i]);
-    //}
-    //printf("\n");
-
-    uint8_t temp = MESSAGE_HEADER;
-    write(fd, &temp, 1);
-
-    csum ^= (uint8_t) command;
-    write_esc(fd, (uint8_t) command);
-
-    csum ^= (uint8_t) data_len;
-    write_esc(fd, (uint8_t) data_len);
-
-    for (size_t i = 0; i < data_len; i++)
+    io_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (io_event_fd < 0)
     {
-        write_esc(fd, p_data[i]);
-        csum ^= (uint8_t) p_data[i];
+        perror("eventfd");
+        return MOTOR_STATUS_SERIAL_ERROR;
     }
 
-    write_esc(fd, csum);
+    __atomic_store_n(&io_thread_stop, false, __ATOMIC_RELAXED);
+    int err = pthread_create(&io_thread, NULL, io_thread_main, NULL);
+    if (err != 0)
+    {
+        fprintf(stderr, "Can't start serial thread: %s\n", strerror(err));
+        close(io_event_fd);
+        io_event_fd = -1;
+        return MOTOR_STATUS_SERIAL_ERROR;
+    }
+    io_thread_running = true;
+    return MOTOR_STATUS_OK;
 }
 
 /**
- * Write a SLIP-encoded byte to the given file descriptor.
+ * Trace the latency of the next speed request for a motor.
  *
- * @param fd[in] the open file descriptor
- * @param data[in] the byte to write
+ * @param[in] motor     Which motor's next request to trace.
+ * @param[in] origin_ns When the input which caused the request happened.
  */
-static void write_esc(int fd, uint8_t data)
+void motor_trace(
+    motor_t motor,
+    uint64_t origin_ns
+)
 {
-    if (data == MESSAGE_ESC)
+    if ((motor == MOTOR_LEFT) || (motor == MOTOR_BOTH))
     {
-        uint8_t data[] = { MESSAGE_ESC, MESSAGE_ESC_ESC };
-        write(fd, data, sizeof(data));
+        trace_origin_ns[0] = origin_ns;
     }
-    else if (data == MESSAGE_HEADER)
+    if ((motor == MOTOR_RIGHT) || (motor == MOTOR_BOTH))
     {
-        uint8_t data[] = { MESSAGE_ESC, MESSAGE_ESC_HEADER };
-        write(fd, data, sizeof(data));
+        trace_origin_ns[1] = origin_ns;
     }
-    else
+}
+
+/**
+ * Check the motor controller serial port for incoming messages,
+ * dispatching them to the handler when complete.
+ *
+ * @return An error code
+ */
+motor_status_t motor_poll(void)
+{
+    if (io_thread_running)
     {
-        write(fd, &data, 1);
+        /* Not ours to read */
+        return MOTOR_STATUS_OK;
     }
+    const motor_status_t result = drain_rx();
+    check_inflight(get_time_ns());
+    check_baud(get_time_ns());
+    flush_queue();
+    return result;
+}
+
+/**
+ * Find out how many received bytes were waiting at the start
+ * of the last motor_poll(), and the most there have ever been.
+ *
+ * @param[out] p_max If not NULL, set to the high-water mark
+ * @return the number of bytes waiting at the last poll
+ */
+size_t motor_get_rx_backlog(size_t *p_max)
+{
+    if (p_max)
+    {
+        *p_max = __atomic_load_n(&rx_backlog_max, __ATOMIC_RELAXED);
+    }
+    return __atomic_load_n(&rx_backlog, __ATOMIC_RELAXED);
+}
+
+/**
+ * Get the serial port file descriptor, so the caller can
+ * call motor_poll() as soon as there is data waiting.
+ *
+ * @return the file descriptor, or -1 if the port is not open
+ */
+int motor_get_fd(void)
+{
+    return fd;
+}
+
+/**
+ * Find out how much current a motor is using.
+ *
+ * @param[in] motor Which motor to read
+ * @return The amount of current in Amps.
+ */
+float motor_current(
+    uint8_t channel
+)
+{
+    sensor_snapshot_t snapshot;
+    read_sensors(&snapshot);
+    if (channel < NUMELTS(snapshot.currents)) {
+        return snapshot.currents[channel];
+    } else {
+        return 0;
+    }
+}
+
+/**
+ * Read the latest ultrasound measurement.
+ *
+ * @return a distance in cm to the nearest object
+ */
+double motor_read_distance(
+    uint8_t sensor
+)
+{
+    sensor_snapshot_t snapshot;
+    read_sensors(&snapshot);
+    if (sensor < NUMELTS(snapshot.range_cm)) {
+        return snapshot.range_cm[sensor];
+    } else {
+        return 0;
+    }
+}
+
+/**
+ * Read the latest current measurement, and how old it is.
+ *
+ * @param[in]  channel  Which channel to read
+ * @param[out] p_sample The reading in Amps, with its timestamp
+ * @return false if the channel is invalid or hasn't reported yet
+ */
+bool motor_current_sample(
+    uint8_t channel,
+    struct motor_sample_t *p_sample
+)
+{
+    sensor_snapshot_t snapshot;
+    read_sensors(&snapshot);
+    if (channel < NUMELTS(snapshot.currents)) {
+        fill_sample(p_sample, snapshot.currents[channel], snapshot.current_ns[channel]);
+        return snapshot.current_ns[channel] != 0;
+    } else {
+        fill_sample(p_sample, 0, 0);
+        return false;
+    }
+}
+
+/**
+ * Read the latest ultrasound measurement, and how old it is.
+ *
+ * @param[in]  sensor   Which sensor to read
+ * @param[out] p_sample The distance in cm, with its timestamp
+ * @return false if the sensor is invalid or hasn't reported yet
+ */
+bool motor_read_distance_sample(
+    uint8_t sensor,
+    struct motor_sample_t *p_sample
+)
+{
+    sensor_snapshot_t snapshot;
+    read_sensors(&snapshot);
+    if (sensor < NUMELTS(snapshot.range_cm)) {
+        fill_sample(p_sample, snapshot.range_cm[sensor], snapshot.range_ns[sensor]);
+        return snapshot.range_ns[sensor] != 0;
+    } else {
+        fill_sample(p_sample, 0, 0);
+        return false;
+    }
+}
+
+/**
+ * Take a copy of the recent current measurements, for
+ * querying with the stats_window_xxx functions.
+ *
+ * @param[in]  channel   Which channel to read
+ * @param[out] p_history The readings in Amps
+ * @return false if the channel is invalid
+ */
+bool motor_current_history(
+    uint8_t channel,
+    struct stats_window_t *p_history
+)
+{
+    if (channel < NUMELTS(current_history)) {
+        read_history(&current_history[channel], p_history);
+        return true;
+    } else {
+        stats_window_reset(p_history, 1);
+        return false;
+    }
+}
+
+/**
+ * Take a copy of the recent ultrasound measurements, for
+ * querying with the stats_window_xxx functions.
+ *
+ * @param[in]  sensor    Which sensor to read
+ * @param[out] p_history The distances in cm
+ * @return false if the sensor is invalid
+ */
+bool motor_read_distance_history(
+    uint8_t sensor,
+    struct stats_window_t *p_history
+)
+{
+    if (sensor < NUMELTS(range_history)) {
+        read_history(&range_history[sensor], p_history);
+        return true;
+    } else {
+        stats_window_reset(p_history, 1);
+        return false;
+    }
+}
+
+/**
+ * Print how long the controller takes to acknowledge each
+ * kind of request, and how many went unacknowledged.
+ *
+ * @param[in] p_output Where to print
+ */
+void motor_dump_round_trips(FILE *p_output)
+{
+    fprintf(p_output, "Request round trips (us):\n");
+    for (size_t i = 0; i < NUMELTS(ack_rtt); i++)
+    {
+        if (ack_rtt[i].count != 0)
+        {
+            stats_hist_print(&ack_rtt[i], protocol_command_name(i), 1000, p_output);
+        }
+    }
+    fprintf(p_output, "Retries %"PRIu64", unacknowledged %"PRIu64"\n", ack_retries, ack_failures);
+}
+
+/**
+ * Take a copy of the serial link counters.
+ *
+ * @param[out] p_stats The counters
+ */
+void motor_get_link_stats(struct motor_link_stats_t *p_stats)
+{
+    p_stats->bytes_rx = load(&link_stats.bytes_rx);
+    p_stats->bytes_tx = load(&link_stats.bytes_tx);
+    for (size_t i = 0; i < NUMELTS(p_stats->frames_rx); i++)
+    {
+        p_stats->frames_rx[i] = load(&link_stats.frames_rx[i]);
+        p_stats->frames_tx[i] = load(&link_stats.frames_tx[i]);
+    }
+    p_stats->bad_checksums = load(&decoder.errors.bad_checksums);
+    p_stats->bad_escapes = load(&decoder.errors.bad_escapes);
+    p_stats->oversize_frames = load(&decoder.errors.oversize);
+    p_stats->truncated_frames = load(&decoder.errors.truncated);
+    p_stats->unknown_commands = load(&decoder.errors.unknown_commands) + load(&link_stats.unknown_commands);
+    p_stats->read_errors = load(&link_stats.read_errors);
+    p_stats->write_errors = load(&link_stats.write_errors);
+}
+
+/**
+ * Print the serial link counters.
+ *
+ * @param[in] p_output Where to print
+ */
+void motor_dump_link_stats(FILE *p_output)
+{
+    struct motor_link_stats_t stats;
+    motor_get_link_stats(&stats);
+    fprintf(p_output, "Serial link: RX %"PRIu32" bytes, TX %"PRIu32" bytes\n", stats.bytes_rx, stats.bytes_tx);
+    fprintf(p_output, "%-12s %-10s %s\n", "Frames", "RX", "TX");
+    for (size_t i = 0; i < NUMELTS(stats.frames_rx); i++)
+    {
+        if ((stats.frames_rx[i] != 0) || (stats.frames_tx[i] != 0))
+        {
+            fprintf(p_output, "%-12s %-10"PRIu32" %"PRIu32"\n", protocol_command_name(i), stats.frames_rx[i], stats.frames_tx[i]);
+        }
+    }
+    fprintf(p_output, "Bad checksums %"PRIu32", bad escapes %"PRIu32", oversize %"PRIu32", truncated %"PRIu32", unknown commands %"PRIu32"\n",
+        stats.bad_checksums, stats.bad_escapes, stats.oversize_frames, stats.truncated_frames, stats.unknown_commands);
+    fprintf(p_output, "Read errors %"PRIu32", write errors %"PRIu32"\n", stats.read_errors, stats.write_errors);
+}
+
+/**
+ * Print how often each sensor has been reporting.
+ *
+ * @param[in] p_output Where to print
+ */
+void motor_dump_sensor_rates(FILE *p_output)
+{
+    char name[16];
+    fprintf(p_output, "Sensor update intervals (us):\n");
+    for (size_t i = 0; i < NUMELTS(range_intervals); i++)
+    {
+        snprintf(name, sizeof(name), "Range%zu", i);
+        stats_hist_print(&range_intervals[i], name, 1000, p_output);
+    }
+    for (size_t i = 0; i < NUMELTS(current_intervals); i++)
+    {
+        snprintf(name, sizeof(name), "Current%zu", i);
+        stats_hist_print(&current_intervals[i], name, 1000, p_output);
+    }
+}
+
+/**************************************************
+* Private Functions
+***************************************************/
+
+/**
+ * Process the message from the controller. Currently just
+ * does some logging. Checksums have already been verified at
+ * stage.
+ *
+ * @param[in] p_message The received message
+ * @param[in] p_context Unused
+ */
+static void process_rx_message(const struct protocol_message_t* p_message, void* p_context)
+{
+    (void) p_context;
+    count(&link_stats.frames_rx[p_message->command], 1);
+    last_frame_ns = rx_time_ns;
+
+    // printf("RX %02x: ", p_message->command);
+    // for (size_t i = 0; i < p_message->data_len; i++)
+    // {
+    //     printf("%02x ", p_message->data[i]);
+    // }
+    // printf("\n");
+
+    switch (p_message->command) {
+    case MESSAGE_COMMAND_SPEED_IND:
+        {
+            struct protocol_speed_ind_t ind;
+            if (protocol_unpack_speed_ind(&ind, p_message->data, p_message->data_len))
+            {
+                printf_verbose("%u: Speed ind motor %u, speed %u\n", get_ts(), ind.motor, ind.speed);
+            }
+        }
+        break;
+    case MESSAGE_COMMAND_CURRENT_OVERFLOW_IND:
+        printf("Overflow ind %zu bytes\n", p_message->data_len);
+        abort();
+        break;
+    case MESSAGE_COMMAND_CURRENT_IND:
+        {
+            struct protocol_current_ind_t ind;
+            if (protocol_unpack_current_ind(&ind, p_message->data, p_message->data_len) &&
+                (ind.motor < NUMELTS(sensors.currents)))
+            {
+                printf_verbose("%u: Current ind motor %u, current %f mA (%u)\n", get_ts(), ind.motor, ind.current * 4.9f, ind.current);
+                publish_begin();
+                sensors.currents[ind.motor] = (ind.current * 4.9f) / 1000.0f;
+                if (sensors.current_ns[ind.motor] != 0)
+                {
+                    stats_hist_record(&current_intervals[ind.motor], rx_time_ns - sensors.current_ns[ind.motor]);
+                }
+                sensors.current_ns[ind.motor] = rx_time_ns;
+                stats_window_append(&current_history[ind.motor], sensors.currents[ind.motor], rx_time_ns);
+                publish_end();
+            }
+        }
+        break;
+    case MESSAGE_COMMAND_RANGE_IND:
+        {
+            struct protocol_range_ind_t ind;
+            if (protocol_unpack_range_ind(&ind, p_message->data, p_message->data_len) &&
+                (ind.sensor < NUMELTS(sensors.range_cm)))
+            {
+                double range = ind.range;
+                range = range / MICROSECONDS_PER_CM;
+                // There and back
+                range = range / 2;
+                publish_begin();
+                sensors.range_cm[ind.sensor] = range;
+                if (sensors.range_ns[ind.sensor] != 0)
+                {
+                    stats_hist_record(&range_intervals[ind.sensor], rx_time_ns - sensors.range_ns[ind.sensor]);
+                }
+                sensors.range_ns[ind.sensor] = rx_time_ns;
+                stats_window_append(&range_history[ind.sensor], range, rx_time_ns);
+                publish_end();
+                printf_verbose("%u: Range ind sensor %u, range %f cm / %u µs\n", get_ts(), ind.sensor, range, ind.range);
+            }
+        }
+        break;
+    case MESSAGE_COMMAND_CAPS_IND:
+        {
+            struct protocol_caps_ind_t ind;
+            if (!protocol_unpack_caps_ind(&ind, p_message->data, p_message->data_len))
+            {
+                break;
+            }
+            if (baud_state == BAUD_STATE_CHECKING)
+            {
+                /* Heard clearly at the new rate */
+                printf("Serial link now at %"PRIu32" baud\n", link_baud);
+                baud_state = BAUD_STATE_IDLE;
+            }
+            if (!caps_known)
+            {
+                dual_speed_supported = (ind.caps & MESSAGE_CAPS_DUAL_SPEED) != 0;
+                ack_supported = (ind.caps & MESSAGE_CAPS_ACK) != 0;
+                baud_supported = (ind.caps & MESSAGE_CAPS_BAUD) != 0;
+                ping_supported = (ind.caps & MESSAGE_CAPS_PING) != 0;
+                printf("Motor controller %s dual speed requests\n", dual_speed_supported ? "supports" : "does not support");
+                printf("Motor controller %s requests\n", ack_supported ? "acknowledges" : "does not acknowledge");
+                caps_known = true;
+            }
+            if (!baud_tried && (wanted_baud != link_baud))
+            {
+                if (baud_supported)
+                {
+                    request_baud(rx_time_ns);
+                }
+                else
+                {
+                    printf("Motor controller can't change baud rate, staying at %"PRIu32"\n", link_baud);
+                    baud_tried = true;
+                }
+            }
+        }
+        break;
+    case MESSAGE_COMMAND_ACK_IND:
+        {
+            struct protocol_ack_ind_t ind;
+            if (protocol_unpack_ack_ind(&ind, p_message->data, p_message->data_len))
+            {
+                handle_ack(&ind);
+            }
+        }
+        break;
+    case MESSAGE_COMMAND_PING_IND:
+        {
+            struct protocol_ping_t ind;
+            if (protocol_unpack_ping(&ind, p_message->data, p_message->data_len) &&
+                ping_waiting && (ind.ctx == ping_ctx))
+            {
+                ping_rx_ns = rx_time_ns;
+                ping_waiting = false;
+            }
+        }
+        break;
+    case MESSAGE_COMMAND_BAUD_IND:
+        {
+            struct protocol_baud_ind_t ind;
+            if (protocol_unpack_baud_ind(&ind, p_message->data, p_message->data_len))
+            {
+                handle_baud_ind(&ind);
+            }
+        }
+        break;
+    default:
+        /* Valid, but not one we expect to receive */
+        count(&link_stats.unknown_commands, 1);
+    }
+}
+
+/**
+ * Write a message to the UART.
+ *
+ * The frame is SLIP-encoded into the transmit queue; call
+ * flush_queue() to send everything queued in a single write().
+ *
+ * @param command[in] The command to send
+ * @param data_len[in] The number of bytes in p_data
+ * @param p_data[in] The data for the command
+ */
+static void send_message(enum protocol_command_t command, size_t data_len, const uint8_t* p_data)
+{
+    if (fd < 0)
+    {
+        return;
+    }
+
+    if (data_len > MAX_MESSAGE_LEN)
+    {
+        return;
+    }
+
+    //printf("TX %02x: ", command);
+    //for (size_t i = 0; i < data_len; i++)
+    //{
+    //    printf("%02x ", p_data[i]);
+    //}
+    //printf("\n");
+
+    if ((TX_QUEUE_LEN - tx_queue_len) < PROTOCOL_MAX_FRAME_LEN)
+    {
+        /* Out of room, so this goes out as two bursts */
+        flush_queue();
+    }
+    tx_queue_len += protocol_encode_frame(&tx_queue[tx_queue_len], command, data_len, p_data);
+    count(&link_stats.frames_tx[command], 1);
+}
+
+/**
+ * Write out everything in the transmit queue.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int flush_queue(void)
+{
+    int retval = 0;
+    if ((tx_queue_len > 0) && (fd >= 0))
+    {
+        retval = write_all(tx_queue, tx_queue_len);
+    }
+    tx_queue_len = 0;
+    return retval;
+}
+
+/**
+ * Write a buffer to the UART, coping with short writes,
+ * signals and a full transmit buffer.
+ *
+ * @param p_data[in] The bytes to write
+ * @param len[in] The number of bytes in p_data
+ * @return 0 on success, -1 if the port failed or stayed full
+ */
+static int write_all(const uint8_t* p_data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t written = write(fd, p_data, len);
+        if (written > 0)
+        {
+            count(&link_stats.bytes_tx, (uint32_t) written);
+            p_data += written;
+            len -= (size_t) written;
+        }
+        else if ((written < 0) && (errno == EINTR))
+        {
+            /* Try again */
+        }
+        else if ((written < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+        {
+            struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+            if (poll(&pfd, 1, TX_TIMEOUT_MS) <= 0)
+            {
+                printf("Serial port stuck, dropping %zu bytes\n", len);
+                count(&link_stats.write_errors, 1);
+                return -1;
+            }
+        }
+        else
+        {
+            perror("Error writing serial port");
+            count(&link_stats.write_errors, 1);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Send a batch of speeds. A side is skipped if the controller
+ * already has that speed and has heard from us recently. If
+ * both sides need sending and the controller understands it,
+ * they go in a single dual speed request. Everything goes out
+ * in one write.
+ *
+ * Runs on the I/O thread, if there is one.
+ *
+ * @param p_update[in] The speeds to send
+ * @return 0 on success, -1 on error
+ */
+static int send_setpoints(const setpoint_update_t* p_update)
+{
+    const uint64_t now_ns = get_time_ns();
+    bool send[2] = { false, false };
+
+    for (uint8_t side = 0; side < NUMELTS(send); side++)
+    {
+        send[side] = p_update->set[side] &&
+            !(setpoint_valid[side] &&
+              (setpoint[side] == p_update->speed[side]) &&
+              (keepalive_ns != 0) &&
+              ((now_ns - setpoint_sent_ns[side]) < keepalive_ns));
+    }
+
+    if (send[0] && send[1] && dual_speed_supported)
+    {
+        const struct protocol_dual_speed_req_t req = {
+                .ctx = tx_ctx++,
+                .clicks_left = 0,
+                .clicks_right = 0,
+                .speed_left = p_update->speed[0],
+                .speed_right = p_update->speed[1]
+        };
+        uint8_t data[PROTOCOL_MAX_DATA_LEN];
+        const size_t data_len = protocol_pack_dual_speed_req(data, &req);
+        send_request(MESSAGE_COMMAND_DUAL_SPEED_REQ, req.ctx, send, data_len, data);
+    }
+    else
+    {
+        for (uint8_t side = 0; side < NUMELTS(send); side++)
+        {
+            if (send[side])
+            {
+                const struct protocol_speed_req_t req = {
+                        .ctx = tx_ctx++,
+                        .side = side,
+                        .clicks = 0,
+                        .speed = p_update->speed[side]
+                };
+                const bool sides[2] = { side == 0, side == 1 };
+                uint8_t data[PROTOCOL_MAX_DATA_LEN];
+                const size_t data_len = protocol_pack_speed_req(data, &req);
+                send_request(MESSAGE_COMMAND_SPEED_REQ, req.ctx, sides, data_len, data);
+            }
+        }
+    }
+
+    check_caps(now_ns);
+    check_inflight(now_ns);
+    check_baud(now_ns);
+
+    const int retval = flush_queue();
+
+    for (uint8_t side = 0; side < NUMELTS(send); side++)
+    {
+        /* If it never went out, the next tick has to try again */
+        if (send[side] && (retval == 0))
+        {
+            /* Only traced if the motor is actually going to change */
+            if (p_update->origin_ns[side] != 0)
+            {
+                perf_record(PERF_STAGE_STICK_TO_MOTOR, p_update->origin_ns[side]);
+            }
+            setpoint[side] = p_update->speed[side];
+            setpoint_sent_ns[side] = now_ns;
+            setpoint_valid[side] = true;
+        }
+    }
+    return retval;
+}
+
+/**
+ * Ask the controller which optional messages it understands.
+ *
+ * @param now_ns[in] The current time
+ */
+static void request_caps(uint64_t now_ns)
+{
+    send_message(MESSAGE_COMMAND_CAPS_REQ, 0, NULL);
+    caps_request_ns = now_ns;
+    caps_requests++;
+}
+
+/**
+ * Ask again what the controller can do, if it hasn't told us
+ * and it's been long enough since we last asked.
+ *
+ * @param now_ns[in] The current time
+ */
+static void check_caps(uint64_t now_ns)
+{
+    if (!caps_known &&
+        (caps_requests < CAPS_MAX_REQUESTS) &&
+        ((now_ns - caps_request_ns) >= CAPS_RETRY_NS))
+    {
+        request_caps(now_ns);
+    }
+}
+
+/**
+ * Print how the serial port has ended up configured, and
+ * complain if the driver didn't take our raw settings.
+ *
+ * @param sz_serial_port[in] The port's name
+ * @param low_latency_err[in] 0 if low latency mode was set,
+ * otherwise the errno from trying
+ */
+static void report_port(const char* sz_serial_port, int low_latency_err)
+{
+    struct termios tio;
+    if (tcgetattr(fd, &tio) < 0)
+    {
+        perror("Can't read serial port settings");
+        return;
+    }
+
+    const bool raw =
+        ((tio.c_iflag & (IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON | IXOFF)) == 0) &&
+        ((tio.c_oflag & OPOST) == 0) &&
+        ((tio.c_lflag & (ECHO | ECHONL | ICANON | ISIG | IEXTEN)) == 0) &&
+        ((tio.c_cflag & (CSIZE | PARENB | CSTOPB)) == CS8) &&
+        (tio.c_cc[VMIN] == 0) &&
+        (tio.c_cc[VTIME] == 0);
+
+    printf("Serial port %s: %"PRIu32" baud, %s, %s",
+        sz_serial_port,
+        serial_get_baud(fd),
+        raw ? "raw 8N1" : "NOT RAW",
+        (tio.c_cflag & CRTSCTS) ? "RTS/CTS" : "no flow control");
+    if (low_latency_err == 0)
+    {
+        printf(", low latency");
+    }
+    else if ((low_latency_err == ENOTTY) || (low_latency_err == EINVAL))
+    {
+        printf(", no low latency mode");
+    }
+    else
+    {
+        printf(", can't set low latency: %s", strerror(low_latency_err));
+    }
+    const int timer_ms = serial_get_latency_timer(fd);
+    if (timer_ms >= 0)
+    {
+        printf(", latency timer %d ms", timer_ms);
+    }
+    printf("\n");
+
+    if (!raw)
+    {
+        printf("Serial driver didn't accept raw mode (iflag %o oflag %o lflag %o cflag %o)\n",
+            (unsigned int) tio.c_iflag, (unsigned int) tio.c_oflag,
+            (unsigned int) tio.c_lflag, (unsigned int) tio.c_cflag);
+    }
+}
+
+/**
+ * Send a request, and if the controller acknowledges
+ * requests, remember it until the ACK_IND arrives. A request
+ * replaces any unacknowledged ones for the same side(s) -
+ * there's no point sending an old speed again - but inherits
+ * how long they've been waiting, how often they were sent and
+ * the oldest ctx whose ACK_IND would still count.
+ *
+ * @param command[in] The command to send
+ * @param ctx[in] The request's ctx
+ * @param sides[in] Which sides the request sets
+ * @param data_len[in] The number of bytes in p_data
+ * @param p_data[in] The data for the command
+ */
+static void send_request(enum protocol_command_t command, uint16_t ctx, const bool sides[2], size_t data_len, const uint8_t* p_data)
+{
+    send_message(command, data_len, p_data);
+    if (!ack_supported)
+    {
+        return;
+    }
+
+    const uint64_t now_ns = get_time_ns();
+    uint64_t waiting_ns = now_ns;
+    unsigned int retries = 0;
+    uint16_t first_ctx = ctx;
+    inflight_t* p_slot = NULL;
+    for (size_t i = 0; i < NUMELTS(inflight); i++)
+    {
+        inflight_t* p_entry = &inflight[i];
+        if (p_entry->in_use &&
+            (!p_entry->sides[0] || sides[0]) &&
+            (!p_entry->sides[1] || sides[1]))
+        {
+            waiting_ns = MIN(waiting_ns, p_entry->waiting_ns);
+            retries = MAX(retries, p_entry->retries);
+            if ((uint16_t) (ctx - p_entry->first_ctx) > (uint16_t) (ctx - first_ctx))
+            {
+                first_ctx = p_entry->first_ctx;
+            }
+            p_entry->in_use = false;
+            inflight_count--;
+        }
+        if (!p_entry->in_use)
+        {
+            p_slot = p_slot ? p_slot : p_entry;
+        }
+        else if (!p_slot || (p_slot->in_use && (p_entry->sent_ns < p_slot->sent_ns)))
+        {
+            /* Full up - the oldest makes way */
+            p_slot = p_entry;
+        }
+    }
+
+    if (!p_slot->in_use)
+    {
+        inflight_count++;
+    }
+    p_slot->in_use = true;
+    p_slot->command = command;
+    p_slot->ctx = ctx;
+    p_slot->sides[0] = sides[0];
+    p_slot->sides[1] = sides[1];
+    p_slot->sent_ns = now_ns;
+    p_slot->waiting_ns = waiting_ns;
+    p_slot->retries = retries;
+    p_slot->first_ctx = first_ctx;
+    p_slot->data_len = data_len;
+    memcpy(p_slot->data, p_data, data_len);
+}
+
+/**
+ * The controller has applied a request. Note how long it
+ * took and stop waiting for it. If the request has since been
+ * replaced, the request that replaced it gets a fresh wait.
+ *
+ * @param p_ind[in] The acknowledgement
+ */
+static void handle_ack(const struct protocol_ack_ind_t* p_ind)
+{
+    for (size_t i = 0; i < NUMELTS(inflight); i++)
+    {
+        inflight_t* p_entry = &inflight[i];
+        if (!p_entry->in_use)
+        {
+            continue;
+        }
+        if ((p_entry->ctx == p_ind->ctx) &&
+            ((uint8_t) p_entry->command == p_ind->command))
+        {
+            stats_hist_record(&ack_rtt[p_entry->command], rx_time_ns - p_entry->sent_ns);
+            p_entry->in_use = false;
+            inflight_count--;
+        }
+        else if ((uint16_t) (p_ind->ctx - p_entry->first_ctx) < (uint16_t) (p_entry->ctx - p_entry->first_ctx))
+        {
+            p_entry->first_ctx = p_ind->ctx + 1;
+            p_entry->waiting_ns = rx_time_ns;
+            p_entry->retries = 0;
+        }
+    }
+
+    /* Even a late ACK_IND shows the controller is alive */
+    if (__atomic_load_n(&no_response, __ATOMIC_RELAXED))
+    {
+        printf("Motor controller responding again\n");
+        __atomic_store_n(&no_response, false, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Send again any request whose ACK_IND is overdue, or give up
+ * on it if it has been sent too many times already. Frames
+ * are queued; the caller flushes.
+ *
+ * @param now_ns[in] The current time
+ */
+static void check_inflight(uint64_t now_ns)
+{
+    if (inflight_count == 0)
+    {
+        return;
+    }
+    for (size_t i = 0; i < NUMELTS(inflight); i++)
+    {
+        inflight_t* p_entry = &inflight[i];
+        /* waiting_ns may be later than now_ns, if the caller
+         * read the clock before sending */
+        if (!p_entry->in_use || (now_ns < (p_entry->waiting_ns + ACK_TIMEOUT_NS)))
+        {
+            continue;
+        }
+        if (p_entry->retries < ACK_MAX_RETRIES)
+        {
+            send_message(p_entry->command, p_entry->data_len, p_entry->data);
+            p_entry->sent_ns = now_ns;
+            p_entry->waiting_ns = now_ns;
+            p_entry->retries++;
+            ack_retries++;
+        }
+        else
+        {
+            p_entry->in_use = false;
+            inflight_count--;
+            ack_failures++;
+            if (!__atomic_load_n(&no_response, __ATOMIC_RELAXED))
+            {
+                printf("Motor controller not responding (%s %u unacknowledged)\n",
+                    protocol_command_name(p_entry->command), p_entry->ctx);
+                __atomic_store_n(&no_response, true, __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+/**
+ * Forget every request in flight, e.g. because the port has
+ * been reopened and the controller has reset.
+ */
+static void reset_inflight(void)
+{
+    for (size_t i = 0; i < NUMELTS(inflight); i++)
+    {
+        inflight[i].in_use = false;
+    }
+    inflight_count = 0;
+    ack_supported = false;
+    __atomic_store_n(&no_response, false, __ATOMIC_RELAXED);
+}
+
+/**
+ * Ask the controller to switch to wanted_baud.
+ *
+ * @param now_ns[in] The current time
+ */
+static void request_baud(uint64_t now_ns)
+{
+    const struct protocol_baud_req_t req = { .baud = wanted_baud };
+    uint8_t data[PROTOCOL_MAX_DATA_LEN];
+    send_message(MESSAGE_COMMAND_BAUD_REQ, protocol_pack_baud_req(data, &req), data);
+    baud_state = BAUD_STATE_REQUESTED;
+    baud_tried = true;
+    baud_deadline_ns = now_ns + BAUD_TIMEOUT_NS;
+}
+
+/**
+ * The controller has answered a BAUD_REQ. If it has switched,
+ * follow it, and check the link with a CAPS_REQ at the new
+ * rate.
+ *
+ * @param p_ind[in] The answer
+ */
+static void handle_baud_ind(const struct protocol_baud_ind_t* p_ind)
+{
+    if ((baud_state != BAUD_STATE_REQUESTED) || (p_ind->baud != wanted_baud))
+    {
+        return;
+    }
+    if (!p_ind->accepted)
+    {
+        printf("Motor controller refused %"PRIu32" baud, staying at %"PRIu32"\n", p_ind->baud, link_baud);
+        baud_state = BAUD_STATE_IDLE;
+        return;
+    }
+
+    /* Anything still queued would only be garbled by one end or
+     * the other. Speeds are sent again by the keepalive. */
+    tx_queue_len = 0;
+    if (serial_set_baud(fd, p_ind->baud) < 0)
+    {
+        /* The controller will give up and go back by itself */
+        printf("Can't set serial port to %"PRIu32" baud: %s\n", p_ind->baud, strerror(errno));
+        baud_state = BAUD_STATE_IDLE;
+        return;
+    }
+    const uint32_t actual = serial_get_baud(fd);
+    __atomic_store_n(&link_baud, actual ? actual : p_ind->baud, __ATOMIC_RELAXED);
+    protocol_decoder_reset(&decoder);
+
+    send_message(MESSAGE_COMMAND_CAPS_REQ, 0, NULL);
+    baud_state = BAUD_STATE_CHECKING;
+    baud_deadline_ns = rx_time_ns + BAUD_TIMEOUT_NS;
+}
+
+/**
+ * Give up on a baud rate change which has taken too long, or
+ * on a changed rate which has stopped working, going back to
+ * MOTOR_DEFAULT_BAUD if we'd already switched.
+ *
+ * @param now_ns[in] The current time
+ */
+static void check_baud(uint64_t now_ns)
+{
+    switch (baud_state)
+    {
+    case BAUD_STATE_REQUESTED:
+        if (now_ns >= baud_deadline_ns)
+        {
+            printf("No answer to baud rate request, staying at %"PRIu32"\n", link_baud);
+            baud_state = BAUD_STATE_IDLE;
+        }
+        break;
+    case BAUD_STATE_CHECKING:
+        if (now_ns >= baud_deadline_ns)
+        {
+            printf("No reply at %"PRIu32" baud, going back to %u\n", link_baud, MOTOR_DEFAULT_BAUD);
+            restore_baud();
+        }
+        break;
+    case BAUD_STATE_IDLE:
+        /* The controller goes back by itself if it stops
+         * hearing us, e.g. after a reset */
+        if ((link_baud != MOTOR_DEFAULT_BAUD) && (now_ns >= (last_frame_ns + BAUD_SILENCE_NS)))
+        {
+            printf("Nothing heard at %"PRIu32" baud, going back to %u\n", link_baud, MOTOR_DEFAULT_BAUD);
+            restore_baud();
+        }
+        break;
+    }
+}
+
+/**
+ * Go back to MOTOR_DEFAULT_BAUD, which the controller will
+ * also have done, or soon will.
+ */
+static void restore_baud(void)
+{
+    tx_queue_len = 0;
+    if (serial_set_baud(fd, MOTOR_DEFAULT_BAUD) < 0)
+    {
+        perror("Can't restore serial port baud rate");
+    }
+    __atomic_store_n(&link_baud, MOTOR_DEFAULT_BAUD, __ATOMIC_RELAXED);
+    protocol_decoder_reset(&decoder);
+    baud_state = BAUD_STATE_IDLE;
+}
+
+/**
+ * Back to the rate motor_init() opens the port at, e.g.
+ * because the port has been reopened and the controller has
+ * reset.
+ */
+static void reset_baud(void)
+{
+    __atomic_store_n(&link_baud, MOTOR_DEFAULT_BAUD, __ATOMIC_RELAXED);
+    baud_supported = false;
+    baud_state = BAUD_STATE_IDLE;
+    baud_tried = false;
+}
+
+/**
+ * Read everything waiting on the serial port and decode it.
+ *
+ * @return An error code
+ */
+static motor_status_t drain_rx(void)
+{
+    motor_status_t result = MOTOR_STATUS_OK;
+    if (fd >= 0)
+    {
+        /* How far behind the controller we are, before we catch up */
+        int waiting = 0;
+        if (ioctl(fd, FIONREAD, &waiting) == 0)
+        {
+            __atomic_store_n(&rx_backlog, (size_t) waiting, __ATOMIC_RELAXED);
+            if ((size_t) waiting > rx_backlog_max)
+            {
+                __atomic_store_n(&rx_backlog_max, (size_t) waiting, __ATOMIC_RELAXED);
+            }
+        }
+
+        /* Keep reading until the port is empty, so we always
+         * act on the latest indications */
+        for (unsigned int reads = 0; reads < RX_MAX_READS; reads++)
+        {
+            ssize_t read_result = read(fd, rx_buffer, sizeof(rx_buffer));
+            if (read_result > 0)
+            {
+                //printf("Read %zu from serial port\n", read_result);
+                rx_time_ns = get_time_ns();
+                count(&link_stats.bytes_rx, (uint32_t) read_result);
+                protocol_decode(&decoder, rx_buffer, (size_t) read_result);
+            }
+            else if ((read_result < 0) && (errno == EINTR))
+            {
+                /* Try again */
+            }
+            else if ((read_result == 0) || (errno == EAGAIN) || (errno == EWOULDBLOCK))
+            {
+                break;
+            }
+            else
+            {
+                printf("Error reading serial port! %zd\n", read_result);
+                count(&link_stats.read_errors, 1);
+                result = MOTOR_STATUS_SERIAL_ERROR;
+                break;
+            }
+        }
+    }
+    else
+    {
+        result = MOTOR_STATUS_NO_DEVICE;
+    }
+    return result;
+}
+
+/**
+ * Sleep until there is data on the serial port or the timeout
+ * passes, and decode whatever has arrived. Only for use before
+ * the I/O thread is started.
+ *
+ * @param timeout_ns[in] The longest to wait
+ */
+static void wait_rx(uint64_t timeout_ns)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    const int timeout_ms = (int) ((timeout_ns + 999999) / 1000000);
+    if (poll(&pfd, 1, timeout_ms) > 0)
+    {
+        drain_rx();
+    }
+}
+
+/**
+ * Mark the published readings as changing, so readers will
+ * retry. Only the thread decoding frames calls this.
+ */
+static void publish_begin(void)
+{
+    __atomic_store_n(&published_seq, published_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * Copy the working sensor readings to where readers can see
+ * them, and mark the published readings as stable again.
+ */
+static void publish_end(void)
+{
+    published = sensors;
+    __atomic_store_n(&published_seq, published_seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Take a consistent copy of the published sensor readings.
+ * Never blocks; retries if a new set was published mid-copy.
+ *
+ * @param p_snapshot[out] Where to put the copy
+ */
+static void read_sensors(sensor_snapshot_t* p_snapshot)
+{
+    uint32_t before;
+    uint32_t after;
+    do
+    {
+        before = __atomic_load_n(&published_seq, __ATOMIC_ACQUIRE);
+        *p_snapshot = published;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&published_seq, __ATOMIC_RELAXED);
+    } while ((before & 1) || (before != after));
+}
+
+/**
+ * Take a consistent copy of one sensor's history. As
+ * read_sensors(), but the copy is larger so only take it
+ * when it is wanted.
+ *
+ * @param p_history[in] The history to copy
+ * @param p_copy[out] Where to put the copy
+ */
+static void read_history(const struct stats_window_t* p_history, struct stats_window_t* p_copy)
+{
+    uint32_t before;
+    uint32_t after;
+    do
+    {
+        before = __atomic_load_n(&published_seq, __ATOMIC_ACQUIRE);
+        *p_copy = *p_history;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&published_seq, __ATOMIC_RELAXED);
+    } while ((before & 1) || (before != after));
+}
+
+/**
+ * Fill in a sample, working out its age.
+ *
+ * @param p_sample[out] The sample
+ * @param value[in] The reading
+ * @param timestamp_ns[in] When it arrived, or 0 if it never did
+ */
+static void fill_sample(struct motor_sample_t* p_sample, double value, uint64_t timestamp_ns)
+{
+    p_sample->value = value;
+    p_sample->timestamp_ns = timestamp_ns;
+    p_sample->age_ns = (timestamp_ns != 0) ? (get_time_ns() - timestamp_ns) : UINT64_MAX;
+}
+
+/**
+ * Queue a setpoint update for the I/O thread.
+ *
+ * @param p_update[in] The update
+ * @return false if the ring is full
+ */
+static bool ring_push(const setpoint_update_t* p_update)
+{
+    const uint32_t head = ring_head;
+    const uint32_t tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+    if ((head - tail) == SETPOINT_RING_LEN)
+    {
+        return false;
+    }
+    setpoint_ring[head % SETPOINT_RING_LEN] = *p_update;
+    __atomic_store_n(&ring_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Take the oldest setpoint update off the ring.
+ *
+ * @param p_update[out] Where to put the update
+ * @return false if the ring is empty
+ */
+static bool ring_pop(setpoint_update_t* p_update)
+{
+    const uint32_t tail = ring_tail;
+    const uint32_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    if (head == tail)
+    {
+        return false;
+    }
+    *p_update = setpoint_ring[tail % SETPOINT_RING_LEN];
+    __atomic_store_n(&ring_tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * The I/O thread. Sleeps until either the serial port has
+ * data or motor_commit() has queued some speeds.
+ *
+ * @param p_arg[in] Unused
+ * @return NULL
+ */
+static void* io_thread_main(void* p_arg)
+{
+    struct pollfd fds[2] = {
+        { .fd = fd, .events = POLLIN },
+        { .fd = io_event_fd, .events = POLLIN }
+    };
+
+    while (!__atomic_load_n(&io_thread_stop, __ATOMIC_ACQUIRE))
+    {
+        /* Wake up in time to chase any missing ACK_IND, or
+         * to give up on a baud rate change */
+        const bool waiting = (inflight_count != 0) ||
+            (baud_state != BAUD_STATE_IDLE) ||
+            (link_baud != MOTOR_DEFAULT_BAUD);
+        const int timeout_ms = waiting ? (int) (ACK_TIMEOUT_NS / 1000000) : -1;
+        if (poll(fds, NUMELTS(fds), timeout_ms) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("Serial thread poll");
+            break;
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            const uint64_t start = get_time_ns();
+            drain_rx();
+            perf_record(PERF_STAGE_MOTOR_POLL, start);
+        }
+        else if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL))
+        {
+            printf("Serial port gone, stopping serial thread\n");
+            break;
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            uint64_t count;
+            if (read(io_event_fd, &count, sizeof(count)) < 0)
+            {
+                /* Nothing there after all */
+            }
+            /* Later updates win, but keep every side that was set */
+            setpoint_update_t merged = { { false } };
+            setpoint_update_t update;
+            while (ring_pop(&update))
+            {
+                for (uint8_t side = 0; side < NUMELTS(update.set); side++)
+                {
+                    if (update.set[side])
+                    {
+                        merged.set[side] = true;
+                        merged.speed[side] = update.speed[side];
+                        if (update.origin_ns[side] != 0)
+                        {
+                            merged.origin_ns[side] = update.origin_ns[side];
+                        }
+                    }
+                }
+            }
+            if (merged.set[0] || merged.set[1])
+            {
+                send_setpoints(&merged);
+            }
+        }
+
+        check_inflight(get_time_ns());
+        check_baud(get_time_ns());
+        flush_queue();
+    }
+    return NULL;
+}
+
+/**
+ * Stop the I/O thread, if it is running, and wait for it.
+ */
+static void stop_io_thread(void)
+{
+    if (io_thread_running)
+    {
+        const uint64_t one = 1;
+        __atomic_store_n(&io_thread_stop, true, __ATOMIC_RELEASE);
+        if (write(io_event_fd, &one, sizeof(one)) != sizeof(one))
+        {
+            perror("Waking serial thread");
+        }
+        pthread_join(io_thread, NULL);
+        close(io_event_fd);
+        io_event_fd = -1;
+        io_thread_running = false;
+    }
+}
+
+/**
+ * Add to a link counter, such that another thread can read
+ * it safely. Only one thread may write each counter.
+ *
+ * @param p_counter[in,out] The counter
+ * @param n[in] How much to add
+ */
+static void count(uint32_t* p_counter, uint32_t n)
+{
+    __atomic_store_n(p_counter, *p_counter + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Read a link counter written by count().
+ *
+ * @param p_counter[in] The counter
+ * @return its value
+ */
+static uint32_t load(const uint32_t* p_counter)
+{
+    return __atomic_load_n(p_counter, __ATOMIC_RELAXED);
 }
 
 #ifdef VERBOSE
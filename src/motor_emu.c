@@ -0,0 +1,919 @@
+/*****************************************************
+*
+* Pi Wars Robot Software (PWRS) Motor Controller Emulator
+*
+* Copyright (c) 2013-2017 theJPster (www.thejpster.org.uk)
+*
+* PWRS is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* PWRS is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with PWRS.  If not, see <http://www.gnu.org/licenses/>.
+*
+* Pretends to be the Arduino motor controller, on a
+* pseudo-terminal, so pwrs can be run and measured without
+* any hardware:
+*
+*   ./motor_emu --link /tmp/motor &
+*   ./pwrs --serdev /tmp/motor
+*
+* Speed requests drive a simple model of the robot in a
+* straight corridor. The wheels lag behind their requested
+* speeds, the robot drives and turns accordingly, and the
+* ultrasonics see the walls (with some noise). Speed, current
+* and range indications are sent at configurable rates.
+* The emulator can change baud rate when asked. A pty has no
+* real baud rate, but pwrs sets one on the slave side anyway,
+* so bytes are dropped whenever that doesn't match ours - as
+* they would be garbled on a real UART.
+* ACK_INDs can be held back, to look like a slow round trip.
+* Line noise can be added in both directions, and SIGUSR1
+* makes the emulator hang (ignore everything, send nothing)
+* until the next SIGUSR1.
+*
+*****************************************************/
+
+/**************************************************
+* Includes
+***************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <util/util.h>
+#include <protocol/protocol.h>
+#include <serial/serial.h>
+
+/**************************************************
+* Defines
+***************************************************/
+
+#define MODEL_STEP_NS (10 * 1000 * 1000ULL)
+
+/* Stop the wheels if pwrs goes quiet for this long */
+#define WATCHDOG_NS (1000 * 1000 * 1000ULL)
+
+/* How quickly a wheel reaches its requested speed */
+#define WHEEL_TAU_S 0.1
+#define CM_PER_CLICK 0.1
+#define WHEEL_BASE_CM 15.0
+
+/* The course */
+#define CORRIDOR_WIDTH_CM 100.0
+#define CORRIDOR_LENGTH_CM 700.0
+#define MAX_RANGE_CM 400.0
+#define MIN_RANGE_CM 2.0
+
+/* Ultrasonic noise: standard deviation, and how often
+ * (parts per thousand) an echo is missed entirely */
+#define RANGE_NOISE_CM 1.5
+#define RANGE_MISS_PPT 10
+
+#define MICROSECONDS_PER_CM 29.154519
+
+/* Amps drawn by a stalled and a flat-out motor */
+#define CURRENT_IDLE_A 0.15
+#define CURRENT_FULL_A 1.2
+#define FULL_SPEED 320.0
+
+/* Sensor order, as in the real wiring */
+#define SENSOR_LEFT 0
+#define SENSOR_RIGHT 1
+#define SENSOR_FRONT 2
+#define NUM_RANGE_SENSORS 3
+#define NUM_CURRENT_CHANNELS 4
+
+/* The rate the link starts at, and how long we go without a
+ * good frame at any other rate before going back to it */
+#define DEFAULT_BAUD 115200
+#define BAUD_REVERT_NS (1000 * 1000 * 1000ULL)
+
+#define TX_BUFFER_LEN 4096
+#define RX_BUFFER_LEN 4096
+
+/* ACK_INDs held back by --ackdelay */
+#define ACK_QUEUE_LEN 64
+
+/**************************************************
+* Data Types
+**************************************************/
+
+struct robot_t
+{
+    /* Clicks per second, per wheel */
+    double target[2];
+    double speed[2];
+    /* From the left wall, and along the corridor */
+    double x_cm;
+    double y_cm;
+    /* Radians, anticlockwise, 0 is straight down the corridor */
+    double heading;
+    uint64_t last_request_ns;
+};
+
+/* A periodic indication */
+struct schedule_t
+{
+    double rate_hz;
+    uint64_t next_ns;
+    /* Which sensor/motor is next */
+    unsigned int turn;
+};
+
+/* An ACK_IND waiting for --ackdelay to pass */
+struct delayed_ack_t
+{
+    uint64_t due_ns;
+    enum protocol_command_t command;
+    uint16_t ctx;
+};
+
+/**************************************************
+* Function Prototypes
+**************************************************/
+
+static int process_arguments(int argc, char** argv);
+static void print_help(void);
+static int open_pty(void);
+static void handle_sigint(int signum);
+static void handle_sigusr1(int signum);
+static void handle_message(const struct protocol_message_t *p_message, void *p_context);
+static void reset_robot(void);
+static void step_model(double dt);
+static double read_range(unsigned int sensor);
+static bool schedule_due(struct schedule_t *p_schedule, unsigned int count, uint64_t now_ns, unsigned int *p_index);
+static uint64_t schedule_next(const struct schedule_t *p_schedule, uint64_t next_ns);
+static void send_message(enum protocol_command_t command, size_t data_len, const uint8_t *p_data);
+static void send_ack(enum protocol_command_t command, uint16_t ctx);
+static void send_ack_now(enum protocol_command_t command, uint16_t ctx);
+static void send_delayed_acks(uint64_t now_ns);
+static void set_baud(uint32_t new_baud);
+static bool baud_matches(void);
+static void send_speed_ind(unsigned int motor);
+static void send_current_ind(unsigned int channel);
+static void send_range_ind(unsigned int sensor);
+static void flush_tx(void);
+static void add_noise(uint8_t *p_data, size_t len);
+static double gaussian(void);
+
+/**************************************************
+* Public Data
+**************************************************/
+
+/* None */
+
+/**************************************************
+* Private Data
+**************************************************/
+
+static int verbose_flag = 0;
+
+static int nodual_flag = 0;
+
+static int noack_flag = 0;
+
+static int nobaud_flag = 0;
+
+static struct option long_options[] =
+{
+    {"verbose", no_argument,       &verbose_flag, 1},
+    {"nodual",  no_argument,       &nodual_flag, 1},
+    {"noack",   no_argument,       &noack_flag, 1},
+    {"nobaud",  no_argument,       &nobaud_flag, 1},
+    {"help",    no_argument,       0, 'h'},
+    {"link",    required_argument, 0, 'l'},
+    {"range",   required_argument, 0, 'r'},
+    {"current", required_argument, 0, 'c'},
+    {"speed",   required_argument, 0, 's'},
+    {"noise",   required_argument, 0, 'n'},
+    {"seed",    required_argument, 0, 'e'},
+    {"maxbaud", required_argument, 0, 'b'},
+    {"ackdelay", required_argument, 0, 'a'},
+    { 0 }
+};
+
+static const char *short_options = "vhl:r:c:s:n:e:b:a:";
+
+static const char *sz_link = NULL;
+
+static struct schedule_t range_schedule = { .rate_hz = 20 };
+static struct schedule_t current_schedule = { .rate_hz = 10 };
+static struct schedule_t speed_schedule = { .rate_hz = 10 };
+
+static unsigned int seed = 1;
+
+/* Chance of each byte being corrupted, in parts per million */
+static unsigned long noise_ppm = 0;
+
+static volatile sig_atomic_t running = 1;
+
+static volatile sig_atomic_t hung = 0;
+
+static int master_fd = -1;
+
+static int slave_fd = -1;
+
+/* Our baud rate, the most we'll agree to, and when we last
+ * had a good frame */
+static uint32_t baud = DEFAULT_BAUD;
+static uint32_t max_baud = 1000000;
+static uint64_t last_frame_ns = 0;
+
+/* How long to hold back each ACK_IND, and those held back */
+static uint64_t ack_delay_ns = 0;
+static struct delayed_ack_t ack_queue[ACK_QUEUE_LEN];
+static size_t ack_head = 0;
+static size_t ack_count = 0;
+
+static struct protocol_decoder_t decoder = { .handler = handle_message };
+
+static struct robot_t robot;
+
+static uint8_t tx_buffer[TX_BUFFER_LEN];
+static size_t tx_len = 0;
+
+/* Totals, printed on exit */
+static uint64_t frames_rx = 0;
+static uint64_t frames_tx = 0;
+static uint64_t bytes_dropped = 0;
+static uint64_t bytes_corrupted = 0;
+static uint64_t bytes_garbled = 0;
+static uint64_t crashes = 0;
+
+/**************************************************
+* Public Functions
+***************************************************/
+
+int main(int argc, char **argv)
+{
+    seed = (unsigned int) get_time_ns();
+    if (process_arguments(argc, argv) != 0)
+    {
+        return 1;
+    }
+    srandom(seed);
+
+    if (open_pty() != 0)
+    {
+        return 1;
+    }
+
+    signal(SIGINT, handle_sigint);
+    signal(SIGTERM, handle_sigint);
+    signal(SIGUSR1, handle_sigusr1);
+
+    reset_robot();
+
+    uint64_t now_ns = get_time_ns();
+    uint64_t next_step_ns = now_ns + MODEL_STEP_NS;
+    range_schedule.next_ns = now_ns;
+    current_schedule.next_ns = now_ns;
+    speed_schedule.next_ns = now_ns;
+
+    while (running)
+    {
+        now_ns = get_time_ns();
+        uint64_t wake_ns = next_step_ns;
+        wake_ns = schedule_next(&range_schedule, wake_ns);
+        wake_ns = schedule_next(&current_schedule, wake_ns);
+        wake_ns = schedule_next(&speed_schedule, wake_ns);
+        if (ack_count > 0)
+        {
+            wake_ns = MIN(wake_ns, ack_queue[ack_head].due_ns);
+        }
+        int timeout_ms = 0;
+        if (wake_ns > now_ns)
+        {
+            timeout_ms = (int) (((wake_ns - now_ns) + 999999) / 1000000);
+        }
+
+        struct pollfd pfd = { .fd = master_fd, .events = POLLIN };
+        if (poll(&pfd, 1, timeout_ms) > 0)
+        {
+            uint8_t rx_buffer[RX_BUFFER_LEN];
+            ssize_t read_result = read(master_fd, rx_buffer, sizeof(rx_buffer));
+            if ((read_result > 0) && !hung)
+            {
+                if (baud_matches())
+                {
+                    add_noise(rx_buffer, (size_t) read_result);
+                    protocol_decode(&decoder, rx_buffer, (size_t) read_result);
+                }
+                else
+                {
+                    bytes_garbled += (uint64_t) read_result;
+                }
+            }
+        }
+
+        now_ns = get_time_ns();
+        if ((baud != DEFAULT_BAUD) && !hung && ((now_ns - last_frame_ns) > BAUD_REVERT_NS))
+        {
+            printf("Nothing heard at %"PRIu32" baud, going back to %u\n", baud, DEFAULT_BAUD);
+            set_baud(DEFAULT_BAUD);
+        }
+
+        now_ns = get_time_ns();
+        while (now_ns >= next_step_ns)
+        {
+            if ((now_ns - robot.last_request_ns) > WATCHDOG_NS)
+            {
+                robot.target[0] = 0;
+                robot.target[1] = 0;
+            }
+            step_model((double) MODEL_STEP_NS / 1e9);
+            next_step_ns += MODEL_STEP_NS;
+        }
+
+        if (hung)
+        {
+            continue;
+        }
+
+        unsigned int index;
+        while (schedule_due(&range_schedule, NUM_RANGE_SENSORS, now_ns, &index))
+        {
+            send_range_ind(index);
+        }
+        while (schedule_due(&current_schedule, NUM_CURRENT_CHANNELS, now_ns, &index))
+        {
+            send_current_ind(index);
+        }
+        while (schedule_due(&speed_schedule, 2, now_ns, &index))
+        {
+            send_speed_ind(index);
+        }
+        send_delayed_acks(now_ns);
+
+        flush_tx();
+    }
+
+    printf("\nFrames received %"PRIu64", sent %"PRIu64"\n", frames_rx, frames_tx);
+    printf("Bytes dropped %"PRIu64", corrupted %"PRIu64", garbled %"PRIu64", crashes %"PRIu64"\n",
+        bytes_dropped, bytes_corrupted, bytes_garbled, crashes);
+    printf("Bad checksums %"PRIu32", bad escapes %"PRIu32", oversize %"PRIu32", truncated %"PRIu32", unknown commands %"PRIu32"\n",
+        decoder.errors.bad_checksums, decoder.errors.bad_escapes, decoder.errors.oversize,
+        decoder.errors.truncated, decoder.errors.unknown_commands);
+
+    if (sz_link)
+    {
+        unlink(sz_link);
+    }
+    close(master_fd);
+
+    return 0;
+}
+
+/**************************************************
+* Private Functions
+***************************************************/
+
+static int process_arguments(int argc, char** argv)
+{
+    int retval = 0;
+    while (1)
+    {
+        int option_index = 0;
+        int c = getopt_long(argc, argv, short_options, long_options, &option_index);
+
+        if (c == -1)
+            break;
+
+        switch (c)
+        {
+        case 0:
+            /* Flag set by getopt_long */
+            break;
+
+        case 'v':
+            verbose_flag = 1;
+            break;
+
+        case 'l':
+            sz_link = optarg;
+            break;
+
+        case 'r':
+            range_schedule.rate_hz = atof(optarg);
+            break;
+
+        case 'c':
+            current_schedule.rate_hz = atof(optarg);
+            break;
+
+        case 's':
+            speed_schedule.rate_hz = atof(optarg);
+            break;
+
+        case 'n':
+            noise_ppm = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'e':
+            seed = (unsigned int) strtoul(optarg, NULL, 0);
+            break;
+
+        case 'b':
+            max_baud = (uint32_t) strtoul(optarg, NULL, 0);
+            break;
+
+        case 'a':
+            ack_delay_ns = strtoull(optarg, NULL, 0) * 1000 * 1000ULL;
+            break;
+
+        case 'h':
+        default:
+            print_help();
+            retval = 1;
+            break;
+        }
+    }
+    return retval;
+}
+
+static void print_help(void)
+{
+    printf("Usage: motor_emu [ --verbose ] [ --link <path> ] [ --range <hz> ] [ --current <hz> ]\n");
+    printf("                 [ --speed <hz> ] [ --noise <ppm> ] [ --seed <n> ] [ --maxbaud <baud> ]\n");
+    printf("                 [ --ackdelay <ms> ] [ --nodual ] [ --noack ] [ --nobaud ]\n");
+    printf("\n");
+    printf("Emulates the motor controller on a pseudo-terminal, for running pwrs without hardware.\n");
+    printf("\n");
+    printf("  --link     Also make <path> a symlink to the pseudo-terminal\n");
+    printf("  --range    RANGE_INDs per second per sensor (default 20, 0 for none)\n");
+    printf("  --current  CURRENT_INDs per second per channel (default 10, 0 for none)\n");
+    printf("  --speed    SPEED_INDs per second per wheel (default 10, 0 for none)\n");
+    printf("  --noise    Corrupt this many bytes per million, in both directions\n");
+    printf("  --seed     Seed for the noise, for repeatable runs\n");
+    printf("  --maxbaud  Refuse BAUD_REQs above this rate (default 1000000)\n");
+    printf("  --ackdelay Hold back each ACK_IND for this long\n");
+    printf("  --nodual   Act like old firmware without DUAL_SPEED_REQ\n");
+    printf("  --noack    Act like old firmware without ACK_IND\n");
+    printf("  --nobaud   Act like old firmware without BAUD_REQ\n");
+    printf("\n");
+    printf("Send SIGUSR1 to make the emulator hang, and again to recover.\n");
+}
+
+/*
+ * Make the pseudo-terminal. We keep the slave side open
+ * ourselves, so the master doesn't see a hangup every time
+ * pwrs closes it.
+ */
+static int open_pty(void)
+{
+    master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (master_fd < 0)
+    {
+        perror("posix_openpt");
+        return -1;
+    }
+    if ((grantpt(master_fd) < 0) || (unlockpt(master_fd) < 0))
+    {
+        perror("grantpt");
+        return -1;
+    }
+
+    struct termios tio;
+    tcgetattr(master_fd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(master_fd, TCSANOW, &tio);
+
+    const char *sz_slave = ptsname(master_fd);
+    slave_fd = open(sz_slave, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (slave_fd < 0)
+    {
+        perror(sz_slave);
+        return -1;
+    }
+    /* Start where pwrs will, so only a real disagreement
+     * garbles anything */
+    if (serial_set_baud(slave_fd, DEFAULT_BAUD) < 0)
+    {
+        perror("Setting pty baud rate");
+        return -1;
+    }
+
+    if (sz_link)
+    {
+        unlink(sz_link);
+        if (symlink(sz_slave, sz_link) < 0)
+        {
+            perror(sz_link);
+            return -1;
+        }
+    }
+
+    printf("Motor controller emulator on %s%s%s\n", sz_slave, sz_link ? " -> " : "", sz_link ? sz_link : "");
+    return 0;
+}
+
+static void handle_sigint(int signum)
+{
+    running = 0;
+}
+
+static void handle_sigusr1(int signum)
+{
+    hung = !hung;
+}
+
+/*
+ * Act on a message from pwrs.
+ */
+static void handle_message(const struct protocol_message_t *p_message, void *p_context)
+{
+    frames_rx++;
+    last_frame_ns = get_time_ns();
+    switch (p_message->command)
+    {
+    case MESSAGE_COMMAND_SPEED_REQ:
+        {
+            struct protocol_speed_req_t req;
+            if (protocol_unpack_speed_req(&req, p_message->data, p_message->data_len) && (req.side < 2))
+            {
+                if (verbose_flag)
+                {
+                    printf("%u: speed %s %d\n", req.ctx, req.side ? "right" : "left", req.speed);
+                }
+                robot.target[req.side] = req.speed;
+                robot.last_request_ns = get_time_ns();
+                send_ack(p_message->command, req.ctx);
+            }
+        }
+        break;
+    case MESSAGE_COMMAND_DUAL_SPEED_REQ:
+        {
+            struct protocol_dual_speed_req_t req;
+            if (!nodual_flag && protocol_unpack_dual_speed_req(&req, p_message->data, p_message->data_len))
+            {
+                if (verbose_flag)
+                {
+                    printf("%u: speed left %d right %d\n", req.ctx, req.speed_left, req.speed_right);
+                }
+                robot.target[0] = req.speed_left;
+                robot.target[1] = req.speed_right;
+                robot.last_request_ns = get_time_ns();
+                send_ack(p_message->command, req.ctx);
+            }
+        }
+        break;
+    case MESSAGE_COMMAND_CAPS_REQ:
+        {
+            uint8_t data[PROTOCOL_MAX_DATA_LEN];
+            struct protocol_caps_ind_t ind = {
+                .caps = (nodual_flag ? 0 : MESSAGE_CAPS_DUAL_SPEED) |
+                        (noack_flag ? 0 : MESSAGE_CAPS_ACK) |
+                        (nobaud_flag ? 0 : MESSAGE_CAPS_BAUD) |
+                        MESSAGE_CAPS_PING
+            };
+            send_message(MESSAGE_COMMAND_CAPS_IND, protocol_pack_caps_ind(data, &ind), data);
+        }
+        break;
+    case MESSAGE_COMMAND_PING_REQ:
+        {
+            struct protocol_ping_t ping;
+            if (protocol_unpack_ping(&ping, p_message->data, p_message->data_len))
+            {
+                uint8_t data[PROTOCOL_MAX_DATA_LEN];
+                send_message(MESSAGE_COMMAND_PING_IND, protocol_pack_ping(data, &ping), data);
+            }
+        }
+        break;
+    case MESSAGE_COMMAND_BAUD_REQ:
+        {
+            struct protocol_baud_req_t req;
+            if (!nobaud_flag && protocol_unpack_baud_req(&req, p_message->data, p_message->data_len))
+            {
+                uint8_t data[PROTOCOL_MAX_DATA_LEN];
+                struct protocol_baud_ind_t ind = {
+                    .baud = req.baud,
+                    .accepted = (req.baud >= SERIAL_MIN_BAUD) && (req.baud <= max_baud)
+                };
+                printf("%s %"PRIu32" baud\n", ind.accepted ? "Switching to" : "Refusing", req.baud);
+                /* The answer goes at the old rate */
+                send_message(MESSAGE_COMMAND_BAUD_IND, protocol_pack_baud_ind(data, &ind), data);
+                flush_tx();
+                if (ind.accepted)
+                {
+                    set_baud(req.baud);
+                }
+            }
+        }
+        break;
+    default:
+        if (verbose_flag)
+        {
+            printf("Ignoring command 0x%02x\n", p_message->command);
+        }
+        break;
+    }
+}
+
+/*
+ * Back to the start of the corridor, stationary.
+ */
+static void reset_robot(void)
+{
+    robot.speed[0] = 0;
+    robot.speed[1] = 0;
+    robot.target[0] = 0;
+    robot.target[1] = 0;
+    robot.x_cm = CORRIDOR_WIDTH_CM / 2;
+    robot.y_cm = 0;
+    /* Never quite straight */
+    robot.heading = gaussian() * 0.05;
+}
+
+/*
+ * Move the robot on by `dt` seconds.
+ */
+static void step_model(double dt)
+{
+    const double lag = MIN(dt / WHEEL_TAU_S, 1.0);
+    for (size_t i = 0; i < NUMELTS(robot.speed); i++)
+    {
+        robot.speed[i] += (robot.target[i] - robot.speed[i]) * lag;
+    }
+
+    const double left_cm = robot.speed[0] * CM_PER_CLICK;
+    const double right_cm = robot.speed[1] * CM_PER_CLICK;
+    const double forward_cm = (left_cm + right_cm) / 2;
+    robot.heading += ((right_cm - left_cm) / WHEEL_BASE_CM) * dt;
+    robot.x_cm -= forward_cm * sin(robot.heading) * dt;
+    robot.y_cm += forward_cm * cos(robot.heading) * dt;
+
+    if ((robot.x_cm < 0) || (robot.x_cm > CORRIDOR_WIDTH_CM) ||
+        (robot.y_cm < -CORRIDOR_LENGTH_CM) || (robot.y_cm > CORRIDOR_LENGTH_CM))
+    {
+        crashes++;
+        printf("Crashed at %.0f,%.0f - back to the start\n", robot.x_cm, robot.y_cm);
+        reset_robot();
+    }
+}
+
+/*
+ * What an ultrasonic sensor would see right now, in cm.
+ */
+static double read_range(unsigned int sensor)
+{
+    double range;
+    const double c = fabs(cos(robot.heading));
+    switch (sensor)
+    {
+    case SENSOR_LEFT:
+        range = robot.x_cm / c;
+        break;
+    case SENSOR_RIGHT:
+        range = (CORRIDOR_WIDTH_CM - robot.x_cm) / c;
+        break;
+    default:
+        range = (CORRIDOR_LENGTH_CM - robot.y_cm) / c;
+        break;
+    }
+
+    if ((random() % 1000) < RANGE_MISS_PPT)
+    {
+        /* No echo */
+        return MAX_RANGE_CM;
+    }
+    range += gaussian() * RANGE_NOISE_CM;
+    return MAX(MIN(range, MAX_RANGE_CM), MIN_RANGE_CM);
+}
+
+/*
+ * Is the next of `count` indications due? Each of them is
+ * sent rate_hz times a second, in turn. If we fall behind,
+ * skip rather than send a burst.
+ */
+static bool schedule_due(struct schedule_t *p_schedule, unsigned int count, uint64_t now_ns, unsigned int *p_index)
+{
+    if ((p_schedule->rate_hz <= 0) || (now_ns < p_schedule->next_ns))
+    {
+        return false;
+    }
+    const uint64_t period_ns = (uint64_t) (1e9 / (p_schedule->rate_hz * count));
+    p_schedule->next_ns += period_ns;
+    if (p_schedule->next_ns < now_ns)
+    {
+        p_schedule->next_ns = now_ns + period_ns;
+    }
+    *p_index = p_schedule->turn;
+    p_schedule->turn = (p_schedule->turn + 1) % count;
+    return true;
+}
+
+/*
+ * The earlier of `next_ns` and when this schedule is next due.
+ */
+static uint64_t schedule_next(const struct schedule_t *p_schedule, uint64_t next_ns)
+{
+    if (p_schedule->rate_hz <= 0)
+    {
+        return next_ns;
+    }
+    return MIN(p_schedule->next_ns, next_ns);
+}
+
+/*
+ * Queue a frame, to go out in the next flush_tx().
+ */
+static void send_message(enum protocol_command_t command, size_t data_len, const uint8_t *p_data)
+{
+    if ((sizeof(tx_buffer) - tx_len) < PROTOCOL_MAX_FRAME_LEN)
+    {
+        flush_tx();
+    }
+    tx_len += protocol_encode_frame(&tx_buffer[tx_len], command, data_len, p_data);
+    frames_tx++;
+}
+
+/*
+ * Acknowledge a request, now or after --ackdelay.
+ */
+static void send_ack(enum protocol_command_t command, uint16_t ctx)
+{
+    if (noack_flag)
+    {
+        return;
+    }
+    if ((ack_delay_ns == 0) || (ack_count == NUMELTS(ack_queue)))
+    {
+        send_ack_now(command, ctx);
+        return;
+    }
+    struct delayed_ack_t *p_ack = &ack_queue[(ack_head + ack_count) % NUMELTS(ack_queue)];
+    p_ack->due_ns = get_time_ns() + ack_delay_ns;
+    p_ack->command = command;
+    p_ack->ctx = ctx;
+    ack_count++;
+}
+
+static void send_ack_now(enum protocol_command_t command, uint16_t ctx)
+{
+    uint8_t data[PROTOCOL_MAX_DATA_LEN];
+    struct protocol_ack_ind_t ind = {
+        .ctx = ctx,
+        .command = (uint8_t) command
+    };
+    send_message(MESSAGE_COMMAND_ACK_IND, protocol_pack_ack_ind(data, &ind), data);
+}
+
+/*
+ * Send every held back ACK_IND which is due. They all have
+ * the same delay, so they come due in order.
+ */
+static void send_delayed_acks(uint64_t now_ns)
+{
+    while ((ack_count > 0) && (ack_queue[ack_head].due_ns <= now_ns))
+    {
+        send_ack_now(ack_queue[ack_head].command, ack_queue[ack_head].ctx);
+        BOUNDS_INCREMENT(ack_head, NUMELTS(ack_queue), 0);
+        ack_count--;
+    }
+}
+
+/*
+ * Change our end of the link. Bytes half-received at the old
+ * rate would be garbage, so forget them.
+ */
+static void set_baud(uint32_t new_baud)
+{
+    baud = new_baud;
+    last_frame_ns = get_time_ns();
+    protocol_decoder_reset(&decoder);
+}
+
+/*
+ * Does pwrs have its end at the same rate as ours?
+ */
+static bool baud_matches(void)
+{
+    return serial_get_baud(slave_fd) == baud;
+}
+
+static void send_speed_ind(unsigned int motor)
+{
+    uint8_t data[PROTOCOL_MAX_DATA_LEN];
+    struct protocol_speed_ind_t ind = {
+        .speed = (uint16_t) fabs(robot.speed[motor]),
+        .motor = (uint8_t) motor
+    };
+    send_message(MESSAGE_COMMAND_SPEED_IND, protocol_pack_speed_ind(data, &ind), data);
+}
+
+static void send_current_ind(unsigned int channel)
+{
+    uint8_t data[PROTOCOL_MAX_DATA_LEN];
+    const double load = MIN(fabs(robot.speed[channel % 2]) / FULL_SPEED, 1.0);
+    double amps = CURRENT_IDLE_A + ((CURRENT_FULL_A - CURRENT_IDLE_A) * load);
+    amps = MAX(amps + (gaussian() * 0.02), 0.0);
+    /* The controller reports in 4.9 mA steps */
+    struct protocol_current_ind_t ind = {
+        .current = (uint16_t) ((amps * 1000.0) / 4.9),
+        .motor = (uint8_t) channel
+    };
+    send_message(MESSAGE_COMMAND_CURRENT_IND, protocol_pack_current_ind(data, &ind), data);
+}
+
+static void send_range_ind(unsigned int sensor)
+{
+    uint8_t data[PROTOCOL_MAX_DATA_LEN];
+    /* Echo time, there and back */
+    struct protocol_range_ind_t ind = {
+        .range = (uint16_t) (read_range(sensor) * 2 * MICROSECONDS_PER_CM),
+        .sensor = (uint8_t) sensor
+    };
+    send_message(MESSAGE_COMMAND_RANGE_IND, protocol_pack_range_ind(data, &ind), data);
+}
+
+/*
+ * Send everything queued. If nobody is reading the pty and
+ * it fills up, the rest is dropped - just like a real UART
+ * with nothing listening.
+ */
+static void flush_tx(void)
+{
+    if (tx_len == 0)
+    {
+        return;
+    }
+    if (!baud_matches())
+    {
+        bytes_garbled += tx_len;
+        tx_len = 0;
+        return;
+    }
+    add_noise(tx_buffer, tx_len);
+    size_t done = 0;
+    while (done < tx_len)
+    {
+        ssize_t written = write(master_fd, &tx_buffer[done], tx_len - done);
+        if (written > 0)
+        {
+            done += (size_t) written;
+        }
+        else if ((written < 0) && (errno == EINTR))
+        {
+            /* Try again */
+        }
+        else
+        {
+            bytes_dropped += tx_len - done;
+            break;
+        }
+    }
+    tx_len = 0;
+}
+
+/*
+ * Flip a random bit in about noise_ppm bytes in every million.
+ */
+static void add_noise(uint8_t *p_data, size_t len)
+{
+    if (noise_ppm == 0)
+    {
+        return;
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        if ((unsigned long) (random() % 1000000) < noise_ppm)
+        {
+            p_data[i] ^= (uint8_t) (1 << (random() % 8));
+            bytes_corrupted++;
+        }
+    }
+}
+
+/*
+ * Roughly normal, mean 0 and standard deviation 1.
+ */
+static double gaussian(void)
+{
+    /* Sum of 12 uniforms has variance 1 */
+    double sum = 0;
+    for (int i = 0; i < 12; i++)
+    {
+        sum += (double) random() / RAND_MAX;
+    }
+    return sum - 6.0;
+}
+
+/**************************************************
+* End of file
+***************************************************/
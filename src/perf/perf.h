@@ -0,0 +1,137 @@
+/*****************************************************
+*
+* Pi Wars Robot Software (PWRS) Performance Counters
+*
+* Copyright (c) 2013-2017 theJPster (www.thejpster.org.uk)
+*
+* PWRS is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* PWRS is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with PWRS.  If not, see <http://www.gnu.org/licenses/>.
+*
+* Per-stage timing of the control loop. Each stage has a
+* latency histogram (in nanoseconds). Typical use is:
+*
+*     uint64_t start = get_time_ns();
+*     do_the_thing();
+*     perf_record(PERF_STAGE_THING, start);
+*
+* There is no locking. Any one stage must only be recorded
+* from one thread (with --serthread, MtrPoll and Stk2Mtr are
+* recorded on the serial thread). Dumps taken from another
+* thread may be very slightly inconsistent.
+*
+*****************************************************/
+
+#ifndef PERF_H
+#define PERF_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**************************************************
+* Includes
+***************************************************/
+
+#include "util/util.h"
+#include "stats/stats.h"
+
+/**************************************************
+* Public Defines
+***************************************************/
+
+/* None */
+
+/**************************************************
+* Public Data Types
+**************************************************/
+
+enum perf_stage_t
+{
+    /* Time between the starts of successive control ticks */
+    PERF_STAGE_TICK_PERIOD,
+    /* The whole of one control tick */
+    PERF_STAGE_TICK,
+    PERF_STAGE_MOTOR_POLL,
+    /* Just mode_handle(), within the tick */
+    PERF_STAGE_MODE_HANDLE,
+    PERF_STAGE_RENDER_TEXT,
+    PERF_STAGE_LCD_FLUSH,
+    /* From a joystick event to the speed request it caused
+     * leaving for the motor controller */
+    PERF_STAGE_STICK_TO_MOTOR,
+    PERF_NUM_STAGES
+};
+
+/**************************************************
+* Public Data
+**************************************************/
+
+/* None */
+
+/**************************************************
+* Public Function Prototypes
+***************************************************/
+
+/**
+ * Record the time taken by a stage.
+ *
+ * @param[in] stage    The stage which has just finished
+ * @param[in] start_ns The get_time_ns() value when it started
+ */
+extern void perf_record(enum perf_stage_t stage, uint64_t start_ns);
+
+/**
+ * Record an already-measured duration for a stage.
+ *
+ * @param[in] stage       The stage
+ * @param[in] duration_ns How long it took
+ */
+extern void perf_record_duration(enum perf_stage_t stage, uint64_t duration_ns);
+
+/**
+ * Get the histogram for a stage (e.g. to draw it on the LCD).
+ *
+ * @param[in] stage The stage
+ * @return the histogram
+ */
+extern const struct stats_hist_t *perf_get(enum perf_stage_t stage);
+
+/**
+ * Get a short (at most eight character) name for a stage.
+ *
+ * @param[in] stage The stage
+ * @return the name
+ */
+extern const char *perf_get_name(enum perf_stage_t stage);
+
+/**
+ * Empty all the histograms.
+ */
+extern void perf_reset(void);
+
+/**
+ * Print all the histograms, in microseconds.
+ *
+ * @param[in] p_output Where to print
+ */
+extern void perf_dump(FILE *p_output);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ndef PERF_H */
+
+/**************************************************
+* End of file
+***************************************************/
@@ -0,0 +1,126 @@
+/*****************************************************
+*
+* Pi Wars Robot Software (PWRS) Performance Counters
+*
+* Copyright (c) 2013-2017 theJPster (www.thejpster.org.uk)
+*
+* PWRS is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* PWRS is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with PWRS.  If not, see <http://www.gnu.org/licenses/>.
+*
+*****************************************************/
+
+/**************************************************
+* Includes
+***************************************************/
+
+#include <stdio.h>
+
+#include "util/util.h"
+#include "stats/stats.h"
+#include "perf/perf.h"
+
+/**************************************************
+* Defines
+***************************************************/
+
+/* None */
+
+/**************************************************
+* Data Types
+**************************************************/
+
+/* None */
+
+/**************************************************
+* Function Prototypes
+**************************************************/
+
+/* None */
+
+/**************************************************
+* Public Data
+**************************************************/
+
+/* None */
+
+/**************************************************
+* Private Data
+**************************************************/
+
+static struct stats_hist_t histograms[PERF_NUM_STAGES];
+
+static const char *stage_names[PERF_NUM_STAGES] =
+{
+    [PERF_STAGE_TICK_PERIOD] = "Period",
+    [PERF_STAGE_TICK] = "Tick",
+    [PERF_STAGE_MOTOR_POLL] = "MtrPoll",
+    [PERF_STAGE_MODE_HANDLE] = "Mode",
+    [PERF_STAGE_RENDER_TEXT] = "Render",
+    [PERF_STAGE_LCD_FLUSH] = "LCDFlush",
+    [PERF_STAGE_STICK_TO_MOTOR] = "Stk2Mtr",
+};
+
+/**************************************************
+* Public Functions
+***************************************************/
+
+void perf_record(enum perf_stage_t stage, uint64_t start_ns)
+{
+    perf_record_duration(stage, get_time_ns() - start_ns);
+}
+
+void perf_record_duration(enum perf_stage_t stage, uint64_t duration_ns)
+{
+    if (stage < PERF_NUM_STAGES)
+    {
+        stats_hist_record(&histograms[stage], duration_ns);
+    }
+}
+
+const struct stats_hist_t *perf_get(enum perf_stage_t stage)
+{
+    return &histograms[stage];
+}
+
+const char *perf_get_name(enum perf_stage_t stage)
+{
+    return stage_names[stage];
+}
+
+void perf_reset(void)
+{
+    for (size_t i = 0; i < NUMELTS(histograms); i++)
+    {
+        stats_hist_reset(&histograms[i]);
+    }
+}
+
+void perf_dump(FILE *p_output)
+{
+    fprintf(p_output, "Control loop timings (us):\n");
+    for (size_t i = 0; i < NUMELTS(histograms); i++)
+    {
+        stats_hist_print(&histograms[i], stage_names[i], 1000, p_output);
+    }
+    fflush(p_output);
+}
+
+/**************************************************
+* Private Functions
+***************************************************/
+
+/* None */
+
+/**************************************************
+* End of file
+***************************************************/
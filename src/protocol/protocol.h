@@ -0,0 +1,335 @@
+/*****************************************************
+*
+* Pi Wars Robot Software (PWRS) Motor Controller Protocol
+*
+* Copyright (c) 2013-2017 theJPster (www.thejpster.org.uk)
+*
+* PWRS is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* PWRS is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with PWRS.  If not, see <http://www.gnu.org/licenses/>.
+*
+* The messages exchanged with the motor controller, and how
+* each one is laid out on the wire. Every field is packed
+* explicitly, little-endian, with no padding, so the format
+* doesn't depend on how either compiler lays out a struct.
+*
+* Messages look like this:
+*
+* COMMAND DATA_LEN <DATA> CSUM
+*
+* where CSUM is 0xFF XOR every other byte. Messages are then
+* SLIP encoded for transmission over the UART.
+*
+* Frame Start/End: MESSAGE_HEADER
+* MESSAGE_HEADER => MESSAGE_ESC MESSAGE_ESC_HEADER
+* MESSAGE_ESC    => MESSAGE_ESC MESSAGE_ESC_ESC
+*
+* Both ends use protocol_encode_frame() and a
+* protocol_decoder_t, so the framing lives here too.
+*
+*****************************************************/
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**************************************************
+* Includes
+***************************************************/
+
+#include "util/util.h"
+
+/**************************************************
+* Public Defines
+***************************************************/
+
+#define MESSAGE_HEADER             0xC0
+#define MESSAGE_ESC                0xDB
+#define MESSAGE_ESC_HEADER         0xDC
+#define MESSAGE_ESC_ESC            0xDD
+
+#define MAX_MESSAGE_LEN 254
+
+/* Header, then command, length, data and checksum all escaped */
+#define PROTOCOL_MAX_FRAME_LEN (1 + (2 * (3 + MAX_MESSAGE_LEN)))
+
+/* Bits in the CAPS_IND bitmap */
+#define MESSAGE_CAPS_DUAL_SPEED    0x01
+#define MESSAGE_CAPS_ACK           0x02
+#define MESSAGE_CAPS_BAUD          0x04
+#define MESSAGE_CAPS_PING          0x08
+
+/* Bytes of DATA for each command */
+#define PROTOCOL_SPEED_REQ_LEN      6
+#define PROTOCOL_DUAL_SPEED_REQ_LEN 8
+#define PROTOCOL_SPEED_IND_LEN      3
+#define PROTOCOL_CURRENT_IND_LEN    3
+#define PROTOCOL_RANGE_IND_LEN      3
+#define PROTOCOL_CAPS_IND_LEN       1
+#define PROTOCOL_ACK_IND_LEN        3
+#define PROTOCOL_BAUD_REQ_LEN       4
+#define PROTOCOL_BAUD_IND_LEN       5
+#define PROTOCOL_PING_LEN           2
+
+/* Enough room for the DATA of any command */
+#define PROTOCOL_MAX_DATA_LEN 8
+
+/**************************************************
+* Public Data Types
+**************************************************/
+
+enum protocol_command_t
+{
+    MESSAGE_COMMAND_SPEED_REQ,
+    MESSAGE_COMMAND_SPEED_IND,
+    MESSAGE_COMMAND_CURRENT_OVERFLOW_IND,
+    MESSAGE_COMMAND_CURRENT_IND,
+    MESSAGE_COMMAND_RANGE_IND,
+    MESSAGE_COMMAND_DUAL_SPEED_REQ,
+    MESSAGE_COMMAND_CAPS_REQ,
+    MESSAGE_COMMAND_CAPS_IND,
+    MESSAGE_COMMAND_ACK_IND,
+    MESSAGE_COMMAND_BAUD_REQ,
+    MESSAGE_COMMAND_BAUD_IND,
+    MESSAGE_COMMAND_PING_REQ,
+    MESSAGE_COMMAND_PING_IND,
+    MAX_VALID_COMMAND
+};
+
+struct protocol_speed_req_t
+{
+    uint16_t ctx; // wraps
+    uint8_t side; // 0 = left, 1 = right
+    uint8_t clicks; // max clicks to travel
+    int16_t speed; // clicks per second
+};
+
+/* Both wheels in one frame. Only sent if the controller
+ * has set MESSAGE_CAPS_DUAL_SPEED in its CAPS_IND. */
+struct protocol_dual_speed_req_t
+{
+    uint16_t ctx; // wraps
+    uint8_t clicks_left; // max clicks to travel
+    uint8_t clicks_right;
+    int16_t speed_left; // clicks per second
+    int16_t speed_right;
+};
+
+struct protocol_speed_ind_t
+{
+    uint16_t speed;
+    uint8_t motor;
+};
+
+struct protocol_current_ind_t
+{
+    uint16_t current;
+    uint8_t motor;
+};
+
+struct protocol_range_ind_t
+{
+    uint16_t range; // echo time in microseconds
+    uint8_t sensor;
+};
+
+struct protocol_caps_ind_t
+{
+    uint8_t caps; // MESSAGE_CAPS_xxx bits
+};
+
+/* Sent by the controller once it has applied a request,
+ * if it has set MESSAGE_CAPS_ACK in its CAPS_IND */
+struct protocol_ack_ind_t
+{
+    uint16_t ctx; // as in the request
+    uint8_t command; // the request's command
+};
+
+/* Ask the controller to change baud rate. Only sent if it
+ * has set MESSAGE_CAPS_BAUD in its CAPS_IND.
+ *
+ * The controller answers with a BAUD_IND at the old rate,
+ * then switches. We switch when the BAUD_IND arrives and send
+ * a CAPS_REQ at the new rate to check the link. Either end
+ * goes back to the old rate if it hears nothing good at the
+ * new one for a second or so. */
+struct protocol_baud_req_t
+{
+    uint32_t baud;
+};
+
+struct protocol_baud_ind_t
+{
+    uint32_t baud; // as in the request
+    uint8_t accepted; // 0 = staying at the old rate
+};
+
+/* Both PING_REQ and PING_IND. The controller answers a
+ * PING_REQ with a PING_IND straight away, so the round trip
+ * is the latency of the link. Only sent if the controller
+ * has set MESSAGE_CAPS_PING in its CAPS_IND. */
+struct protocol_ping_t
+{
+    uint16_t ctx; // echoed in the PING_IND
+};
+
+/* A received message, before unpacking */
+struct protocol_message_t
+{
+    enum protocol_command_t command;
+    size_t data_len;
+    size_t data_read;
+    uint8_t data[MAX_MESSAGE_LEN];
+};
+
+/* Called for each received message with a good checksum */
+typedef void (*protocol_handler_t)(const struct protocol_message_t *p_message, void *p_context);
+
+enum protocol_read_state_t
+{
+    PROTOCOL_READ_STATE_IDLE,
+    PROTOCOL_READ_STATE_COMMAND,
+    PROTOCOL_READ_STATE_LEN,
+    PROTOCOL_READ_STATE_DATA,
+    PROTOCOL_READ_STATE_CHECKSUM,
+};
+
+/* Frames a decoder has thrown away, and why. Only the
+ * decoding thread writes these; other threads should read
+ * them with __atomic_load_n(). */
+struct protocol_decoder_errors_t
+{
+    uint32_t bad_checksums;
+    uint32_t bad_escapes;
+    /* Length too long to be real */
+    uint32_t oversize;
+    /* A new frame started before this one was finished */
+    uint32_t truncated;
+    uint32_t unknown_commands;
+};
+
+/* Decoder state. Zero-initialised is idle. */
+struct protocol_decoder_t
+{
+    protocol_handler_t handler;
+    void *p_context;
+    enum protocol_read_state_t read_state;
+    /* The last byte received was MESSAGE_ESC */
+    bool escape;
+    struct protocol_message_t message;
+    struct protocol_decoder_errors_t errors;
+};
+
+/**************************************************
+* Public Data
+**************************************************/
+
+/* None */
+
+/**************************************************
+* Public Function Prototypes
+***************************************************/
+
+/*
+ * The pack functions write the DATA for a message into
+ * p_out, which must have room for PROTOCOL_MAX_DATA_LEN
+ * bytes, and return the number of bytes written.
+ *
+ * The unpack functions read the DATA of a received message.
+ * They return false, leaving the output alone, if `len` is
+ * wrong for that message.
+ */
+
+extern size_t protocol_pack_speed_req(uint8_t *p_out, const struct protocol_speed_req_t *p_msg);
+extern bool protocol_unpack_speed_req(struct protocol_speed_req_t *p_msg, const uint8_t *p_data, size_t len);
+
+extern size_t protocol_pack_dual_speed_req(uint8_t *p_out, const struct protocol_dual_speed_req_t *p_msg);
+extern bool protocol_unpack_dual_speed_req(struct protocol_dual_speed_req_t *p_msg, const uint8_t *p_data, size_t len);
+
+extern size_t protocol_pack_speed_ind(uint8_t *p_out, const struct protocol_speed_ind_t *p_msg);
+extern bool protocol_unpack_speed_ind(struct protocol_speed_ind_t *p_msg, const uint8_t *p_data, size_t len);
+
+extern size_t protocol_pack_current_ind(uint8_t *p_out, const struct protocol_current_ind_t *p_msg);
+extern bool protocol_unpack_current_ind(struct protocol_current_ind_t *p_msg, const uint8_t *p_data, size_t len);
+
+extern size_t protocol_pack_range_ind(uint8_t *p_out, const struct protocol_range_ind_t *p_msg);
+extern bool protocol_unpack_range_ind(struct protocol_range_ind_t *p_msg, const uint8_t *p_data, size_t len);
+
+extern size_t protocol_pack_caps_ind(uint8_t *p_out, const struct protocol_caps_ind_t *p_msg);
+extern bool protocol_unpack_caps_ind(struct protocol_caps_ind_t *p_msg, const uint8_t *p_data, size_t len);
+
+extern size_t protocol_pack_ack_ind(uint8_t *p_out, const struct protocol_ack_ind_t *p_msg);
+extern bool protocol_unpack_ack_ind(struct protocol_ack_ind_t *p_msg, const uint8_t *p_data, size_t len);
+
+extern size_t protocol_pack_baud_req(uint8_t *p_out, const struct protocol_baud_req_t *p_msg);
+extern bool protocol_unpack_baud_req(struct protocol_baud_req_t *p_msg, const uint8_t *p_data, size_t len);
+
+extern size_t protocol_pack_baud_ind(uint8_t *p_out, const struct protocol_baud_ind_t *p_msg);
+extern bool protocol_unpack_baud_ind(struct protocol_baud_ind_t *p_msg, const uint8_t *p_data, size_t len);
+
+extern size_t protocol_pack_ping(uint8_t *p_out, const struct protocol_ping_t *p_msg);
+extern bool protocol_unpack_ping(struct protocol_ping_t *p_msg, const uint8_t *p_data, size_t len);
+
+/**
+ * @param[in] command A command
+ * @return A short name for it, for printing
+ */
+extern const char *protocol_command_name(enum protocol_command_t command);
+
+/**
+ * SLIP-encode a message.
+ *
+ * @param[out] p_frame  Somewhere to put PROTOCOL_MAX_FRAME_LEN bytes
+ * @param[in]  command  The command to send
+ * @param[in]  data_len The number of bytes in p_data
+ * @param[in]  p_data   The DATA for the command
+ * @return the number of bytes written to p_frame
+ */
+extern size_t protocol_encode_frame(
+    uint8_t *p_frame,
+    enum protocol_command_t command,
+    size_t data_len,
+    const uint8_t *p_data
+);
+
+/**
+ * Throw away any partly received message, e.g. after
+ * reopening the port.
+ *
+ * @param[in,out] p_decoder The decoder
+ */
+extern void protocol_decoder_reset(struct protocol_decoder_t *p_decoder);
+
+/**
+ * SLIP-decode received bytes, calling the decoder's handler
+ * for every good message and counting the bad ones. The state is kept between calls,
+ * so it doesn't matter where read() splits a frame.
+ *
+ * @param[in,out] p_decoder The decoder
+ * @param[in]     p_data    The received bytes
+ * @param[in]     len       The number of bytes in p_data
+ */
+extern void protocol_decode(struct protocol_decoder_t *p_decoder, const uint8_t *p_data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ndef PROTOCOL_H */
+
+/**************************************************
+* End of file
+***************************************************/
@@ -0,0 +1,581 @@
+/*****************************************************
+*
+* Pi Wars Robot Software (PWRS) Motor Controller Protocol
+*
+* Copyright (c) 2013-2017 theJPster (www.thejpster.org.uk)
+*
+* PWRS is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* PWRS is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with PWRS.  If not, see <http://www.gnu.org/licenses/>.
+*
+*****************************************************/
+
+/**************************************************
+* Includes
+***************************************************/
+
+#include "util/util.h"
+#include "protocol/protocol.h"
+
+/**************************************************
+* Defines
+***************************************************/
+
+/* Width of one struct member, which is also its width on the wire */
+#define FIELD_SIZE(type, field) sizeof(((const struct type *) 0)->field)
+
+/**************************************************
+* Data Types
+**************************************************/
+
+/* Every pack function writes each member of its struct, in
+ * full and in order, so the wire lengths must add up */
+STATIC_ASSERT(PROTOCOL_SPEED_REQ_LEN ==
+    (FIELD_SIZE(protocol_speed_req_t, ctx) + FIELD_SIZE(protocol_speed_req_t, side) +
+     FIELD_SIZE(protocol_speed_req_t, clicks) + FIELD_SIZE(protocol_speed_req_t, speed)), speed_req_len);
+STATIC_ASSERT(PROTOCOL_DUAL_SPEED_REQ_LEN ==
+    (FIELD_SIZE(protocol_dual_speed_req_t, ctx) +
+     FIELD_SIZE(protocol_dual_speed_req_t, clicks_left) + FIELD_SIZE(protocol_dual_speed_req_t, clicks_right) +
+     FIELD_SIZE(protocol_dual_speed_req_t, speed_left) + FIELD_SIZE(protocol_dual_speed_req_t, speed_right)), dual_speed_req_len);
+STATIC_ASSERT(PROTOCOL_SPEED_IND_LEN ==
+    (FIELD_SIZE(protocol_speed_ind_t, speed) + FIELD_SIZE(protocol_speed_ind_t, motor)), speed_ind_len);
+STATIC_ASSERT(PROTOCOL_CURRENT_IND_LEN ==
+    (FIELD_SIZE(protocol_current_ind_t, current) + FIELD_SIZE(protocol_current_ind_t, motor)), current_ind_len);
+STATIC_ASSERT(PROTOCOL_RANGE_IND_LEN ==
+    (FIELD_SIZE(protocol_range_ind_t, range) + FIELD_SIZE(protocol_range_ind_t, sensor)), range_ind_len);
+STATIC_ASSERT(PROTOCOL_CAPS_IND_LEN == FIELD_SIZE(protocol_caps_ind_t, caps), caps_ind_len);
+STATIC_ASSERT(PROTOCOL_ACK_IND_LEN ==
+    (FIELD_SIZE(protocol_ack_ind_t, ctx) + FIELD_SIZE(protocol_ack_ind_t, command)), ack_ind_len);
+STATIC_ASSERT(PROTOCOL_BAUD_REQ_LEN == FIELD_SIZE(protocol_baud_req_t, baud), baud_req_len);
+STATIC_ASSERT(PROTOCOL_BAUD_IND_LEN ==
+    (FIELD_SIZE(protocol_baud_ind_t, baud) + FIELD_SIZE(protocol_baud_ind_t, accepted)), baud_ind_len);
+STATIC_ASSERT(PROTOCOL_PING_LEN == FIELD_SIZE(protocol_ping_t, ctx), ping_len);
+
+STATIC_ASSERT(PROTOCOL_DUAL_SPEED_REQ_LEN <= PROTOCOL_MAX_DATA_LEN, max_data_len);
+STATIC_ASSERT(PROTOCOL_MAX_DATA_LEN <= MAX_MESSAGE_LEN, max_message_len);
+
+/* A command byte must never look like a frame header or escape */
+STATIC_ASSERT(MAX_VALID_COMMAND < MESSAGE_HEADER, commands_fit);
+
+/**************************************************
+* Function Prototypes
+**************************************************/
+
+static void put_u16(uint8_t *p_out, uint16_t value);
+static uint16_t get_u16(const uint8_t *p_data);
+static void put_u32(uint8_t *p_out, uint32_t value);
+static uint32_t get_u32(const uint8_t *p_data);
+static size_t encode_esc(uint8_t *p_out, uint8_t data);
+static uint8_t calc_checksum(const struct protocol_message_t *p_message);
+static size_t plain_run(const uint8_t *p_data, size_t len);
+static void process_byte(struct protocol_decoder_t *p_decoder, uint8_t byte);
+static void count_error(uint32_t *p_counter);
+
+/**************************************************
+* Public Data
+**************************************************/
+
+/* None */
+
+/**************************************************
+* Private Data
+**************************************************/
+
+static const char *command_names[MAX_VALID_COMMAND] =
+{
+    [MESSAGE_COMMAND_SPEED_REQ] = "SpeedReq",
+    [MESSAGE_COMMAND_SPEED_IND] = "SpeedInd",
+    [MESSAGE_COMMAND_CURRENT_OVERFLOW_IND] = "OverflowInd",
+    [MESSAGE_COMMAND_CURRENT_IND] = "CurrentInd",
+    [MESSAGE_COMMAND_RANGE_IND] = "RangeInd",
+    [MESSAGE_COMMAND_DUAL_SPEED_REQ] = "DualReq",
+    [MESSAGE_COMMAND_CAPS_REQ] = "CapsReq",
+    [MESSAGE_COMMAND_CAPS_IND] = "CapsInd",
+    [MESSAGE_COMMAND_ACK_IND] = "AckInd",
+    [MESSAGE_COMMAND_BAUD_REQ] = "BaudReq",
+    [MESSAGE_COMMAND_BAUD_IND] = "BaudInd",
+    [MESSAGE_COMMAND_PING_REQ] = "PingReq",
+    [MESSAGE_COMMAND_PING_IND] = "PingInd",
+};
+
+/**************************************************
+* Public Functions
+***************************************************/
+
+size_t protocol_pack_speed_req(uint8_t *p_out, const struct protocol_speed_req_t *p_msg)
+{
+    put_u16(&p_out[0], p_msg->ctx);
+    p_out[2] = p_msg->side;
+    p_out[3] = p_msg->clicks;
+    put_u16(&p_out[4], (uint16_t) p_msg->speed);
+    return PROTOCOL_SPEED_REQ_LEN;
+}
+
+bool protocol_unpack_speed_req(struct protocol_speed_req_t *p_msg, const uint8_t *p_data, size_t len)
+{
+    if (len != PROTOCOL_SPEED_REQ_LEN)
+    {
+        return false;
+    }
+    p_msg->ctx = get_u16(&p_data[0]);
+    p_msg->side = p_data[2];
+    p_msg->clicks = p_data[3];
+    p_msg->speed = (int16_t) get_u16(&p_data[4]);
+    return true;
+}
+
+size_t protocol_pack_dual_speed_req(uint8_t *p_out, const struct protocol_dual_speed_req_t *p_msg)
+{
+    put_u16(&p_out[0], p_msg->ctx);
+    p_out[2] = p_msg->clicks_left;
+    p_out[3] = p_msg->clicks_right;
+    put_u16(&p_out[4], (uint16_t) p_msg->speed_left);
+    put_u16(&p_out[6], (uint16_t) p_msg->speed_right);
+    return PROTOCOL_DUAL_SPEED_REQ_LEN;
+}
+
+bool protocol_unpack_dual_speed_req(struct protocol_dual_speed_req_t *p_msg, const uint8_t *p_data, size_t len)
+{
+    if (len != PROTOCOL_DUAL_SPEED_REQ_LEN)
+    {
+        return false;
+    }
+    p_msg->ctx = get_u16(&p_data[0]);
+    p_msg->clicks_left = p_data[2];
+    p_msg->clicks_right = p_data[3];
+    p_msg->speed_left = (int16_t) get_u16(&p_data[4]);
+    p_msg->speed_right = (int16_t) get_u16(&p_data[6]);
+    return true;
+}
+
+size_t protocol_pack_speed_ind(uint8_t *p_out, const struct protocol_speed_ind_t *p_msg)
+{
+    put_u16(&p_out[0], p_msg->speed);
+    p_out[2] = p_msg->motor;
+    return PROTOCOL_SPEED_IND_LEN;
+}
+
+bool protocol_unpack_speed_ind(struct protocol_speed_ind_t *p_msg, const uint8_t *p_data, size_t len)
+{
+    if (len != PROTOCOL_SPEED_IND_LEN)
+    {
+        return false;
+    }
+    p_msg->speed = get_u16(&p_data[0]);
+    p_msg->motor = p_data[2];
+    return true;
+}
+
+size_t protocol_pack_current_ind(uint8_t *p_out, const struct protocol_current_ind_t *p_msg)
+{
+    put_u16(&p_out[0], p_msg->current);
+    p_out[2] = p_msg->motor;
+    return PROTOCOL_CURRENT_IND_LEN;
+}
+
+bool protocol_unpack_current_ind(struct protocol_current_ind_t *p_msg, const uint8_t *p_data, size_t len)
+{
+    if (len != PROTOCOL_CURRENT_IND_LEN)
+    {
+        return false;
+    }
+    p_msg->current = get_u16(&p_data[0]);
+    p_msg->motor = p_data[2];
+    return true;
+}
+
+size_t protocol_pack_range_ind(uint8_t *p_out, const struct protocol_range_ind_t *p_msg)
+{
+    put_u16(&p_out[0], p_msg->range);
+    p_out[2] = p_msg->sensor;
+    return PROTOCOL_RANGE_IND_LEN;
+}
+
+bool protocol_unpack_range_ind(struct protocol_range_ind_t *p_msg, const uint8_t *p_data, size_t len)
+{
+    if (len != PROTOCOL_RANGE_IND_LEN)
+    {
+        return false;
+    }
+    p_msg->range = get_u16(&p_data[0]);
+    p_msg->sensor = p_data[2];
+    return true;
+}
+
+size_t protocol_pack_caps_ind(uint8_t *p_out, const struct protocol_caps_ind_t *p_msg)
+{
+    p_out[0] = p_msg->caps;
+    return PROTOCOL_CAPS_IND_LEN;
+}
+
+bool protocol_unpack_caps_ind(struct protocol_caps_ind_t *p_msg, const uint8_t *p_data, size_t len)
+{
+    if (len != PROTOCOL_CAPS_IND_LEN)
+    {
+        return false;
+    }
+    p_msg->caps = p_data[0];
+    return true;
+}
+
+size_t protocol_pack_ack_ind(uint8_t *p_out, const struct protocol_ack_ind_t *p_msg)
+{
+    put_u16(&p_out[0], p_msg->ctx);
+    p_out[2] = p_msg->command;
+    return PROTOCOL_ACK_IND_LEN;
+}
+
+bool protocol_unpack_ack_ind(struct protocol_ack_ind_t *p_msg, const uint8_t *p_data, size_t len)
+{
+    if (len != PROTOCOL_ACK_IND_LEN)
+    {
+        return false;
+    }
+    p_msg->ctx = get_u16(&p_data[0]);
+    p_msg->command = p_data[2];
+    return true;
+}
+
+size_t protocol_pack_baud_req(uint8_t *p_out, const struct protocol_baud_req_t *p_msg)
+{
+    put_u32(&p_out[0], p_msg->baud);
+    return PROTOCOL_BAUD_REQ_LEN;
+}
+
+bool protocol_unpack_baud_req(struct protocol_baud_req_t *p_msg, const uint8_t *p_data, size_t len)
+{
+    if (len != PROTOCOL_BAUD_REQ_LEN)
+    {
+        return false;
+    }
+    p_msg->baud = get_u32(&p_data[0]);
+    return true;
+}
+
+size_t protocol_pack_baud_ind(uint8_t *p_out, const struct protocol_baud_ind_t *p_msg)
+{
+    put_u32(&p_out[0], p_msg->baud);
+    p_out[4] = p_msg->accepted;
+    return PROTOCOL_BAUD_IND_LEN;
+}
+
+bool protocol_unpack_baud_ind(struct protocol_baud_ind_t *p_msg, const uint8_t *p_data, size_t len)
+{
+    if (len != PROTOCOL_BAUD_IND_LEN)
+    {
+        return false;
+    }
+    p_msg->baud = get_u32(&p_data[0]);
+    p_msg->accepted = p_data[4];
+    return true;
+}
+
+size_t protocol_pack_ping(uint8_t *p_out, const struct protocol_ping_t *p_msg)
+{
+    put_u16(&p_out[0], p_msg->ctx);
+    return PROTOCOL_PING_LEN;
+}
+
+bool protocol_unpack_ping(struct protocol_ping_t *p_msg, const uint8_t *p_data, size_t len)
+{
+    if (len != PROTOCOL_PING_LEN)
+    {
+        return false;
+    }
+    p_msg->ctx = get_u16(&p_data[0]);
+    return true;
+}
+
+const char *protocol_command_name(enum protocol_command_t command)
+{
+    if (((unsigned int) command < NUMELTS(command_names)) && command_names[command])
+    {
+        return command_names[command];
+    }
+    return "Unknown";
+}
+
+size_t protocol_encode_frame(
+    uint8_t *p_frame,
+    enum protocol_command_t command,
+    size_t data_len,
+    const uint8_t *p_data
+)
+{
+    uint8_t csum = 0xFF;
+    size_t len = 0;
+
+    p_frame[len++] = MESSAGE_HEADER;
+
+    csum ^= (uint8_t) command;
+    len += encode_esc(&p_frame[len], (uint8_t) command);
+
+    csum ^= (uint8_t) data_len;
+    len += encode_esc(&p_frame[len], (uint8_t) data_len);
+
+    for (size_t i = 0; i < data_len; i++)
+    {
+        len += encode_esc(&p_frame[len], p_data[i]);
+        csum ^= (uint8_t) p_data[i];
+    }
+
+    len += encode_esc(&p_frame[len], csum);
+
+    return len;
+}
+
+void protocol_decoder_reset(struct protocol_decoder_t *p_decoder)
+{
+    p_decoder->read_state = PROTOCOL_READ_STATE_IDLE;
+    p_decoder->escape = false;
+}
+
+void protocol_decode(struct protocol_decoder_t *p_decoder, const uint8_t *p_data, size_t len)
+{
+    struct protocol_message_t *p_message = &p_decoder->message;
+    while (len > 0)
+    {
+        if (!p_decoder->escape && (p_decoder->read_state == PROTOCOL_READ_STATE_IDLE))
+        {
+            /* Nothing to do until the next frame starts */
+            const uint8_t *p_header = memchr(p_data, MESSAGE_HEADER, len);
+            if (!p_header)
+            {
+                return;
+            }
+            len -= (size_t) (p_header - p_data);
+            p_data = p_header;
+        }
+        else if (!p_decoder->escape && (p_decoder->read_state == PROTOCOL_READ_STATE_DATA))
+        {
+            /* Copy runs of ordinary bytes in the body straight in */
+            const size_t wanted = p_message->data_len - p_message->data_read;
+            const size_t run = plain_run(p_data, MIN(wanted, len));
+            if (run > 0)
+            {
+                memcpy(&p_message->data[p_message->data_read], p_data, run);
+                p_message->data_read += run;
+                if (p_message->data_read == p_message->data_len)
+                {
+                    p_decoder->read_state = PROTOCOL_READ_STATE_CHECKSUM;
+                }
+                p_data += run;
+                len -= run;
+                continue;
+            }
+        }
+
+        /* One byte the slow way */
+        const uint8_t data = *p_data++;
+        len--;
+        if (p_decoder->escape)
+        {
+            if (data == MESSAGE_ESC_HEADER)
+            {
+                // Escaped header => process normally
+                process_byte(p_decoder, MESSAGE_HEADER);
+            }
+            else if (data == MESSAGE_ESC_ESC)
+            {
+                process_byte(p_decoder, MESSAGE_ESC);
+            }
+            else
+            {
+                count_error(&p_decoder->errors.bad_escapes);
+            }
+            p_decoder->escape = false;
+        }
+        else if (data == MESSAGE_ESC)
+        {
+            p_decoder->escape = true;
+        }
+        else if (data == MESSAGE_HEADER)
+        {
+            // Unescaped header => start of message
+            if (p_decoder->read_state != PROTOCOL_READ_STATE_IDLE)
+            {
+                count_error(&p_decoder->errors.truncated);
+            }
+            p_decoder->read_state = PROTOCOL_READ_STATE_COMMAND;
+        }
+        else
+        {
+            process_byte(p_decoder, data);
+        }
+    }
+}
+
+/**************************************************
+* Private Functions
+***************************************************/
+
+/*
+ * Write a 16-bit value, little-endian.
+ */
+static void put_u16(uint8_t *p_out, uint16_t value)
+{
+    p_out[0] = (uint8_t) (value & 0xFF);
+    p_out[1] = (uint8_t) (value >> 8);
+}
+
+/*
+ * Read a 16-bit little-endian value.
+ */
+static uint16_t get_u16(const uint8_t *p_data)
+{
+    return (uint16_t) (p_data[0] | (p_data[1] << 8));
+}
+
+/*
+ * Write a 32-bit value, little-endian.
+ */
+static void put_u32(uint8_t *p_out, uint32_t value)
+{
+    put_u16(&p_out[0], (uint16_t) (value & 0xFFFF));
+    put_u16(&p_out[2], (uint16_t) (value >> 16));
+}
+
+/*
+ * Read a 32-bit little-endian value.
+ */
+static uint32_t get_u32(const uint8_t *p_data)
+{
+    return (uint32_t) get_u16(&p_data[0]) | ((uint32_t) get_u16(&p_data[2]) << 16);
+}
+
+/*
+ * SLIP-encode a byte into up to two bytes of p_out.
+ */
+static size_t encode_esc(uint8_t *p_out, uint8_t data)
+{
+    if (data == MESSAGE_ESC)
+    {
+        p_out[0] = MESSAGE_ESC;
+        p_out[1] = MESSAGE_ESC_ESC;
+        return 2;
+    }
+    else if (data == MESSAGE_HEADER)
+    {
+        p_out[0] = MESSAGE_ESC;
+        p_out[1] = MESSAGE_ESC_HEADER;
+        return 2;
+    }
+    else
+    {
+        p_out[0] = data;
+        return 1;
+    }
+}
+
+/*
+ * 0xFF XOR the command, length and every byte of data.
+ */
+static uint8_t calc_checksum(const struct protocol_message_t *p_message)
+{
+    uint8_t result = 0xFF;
+    result ^= (uint8_t) p_message->command;
+    result ^= (uint8_t) p_message->data_len;
+    for (size_t i = 0; i < p_message->data_len; i++)
+    {
+        result ^= p_message->data[i];
+    }
+    return result;
+}
+
+/*
+ * Count the bytes before the first header or escape byte.
+ * glibc's memchr() is already vectorised, so this is as
+ * quick as a hand-written SIMD scan for frames this short.
+ */
+static size_t plain_run(const uint8_t *p_data, size_t len)
+{
+    const uint8_t *p_header = memchr(p_data, MESSAGE_HEADER, len);
+    if (p_header)
+    {
+        len = (size_t) (p_header - p_data);
+    }
+    const uint8_t *p_esc = memchr(p_data, MESSAGE_ESC, len);
+    if (p_esc)
+    {
+        len = (size_t) (p_esc - p_data);
+    }
+    return len;
+}
+
+/*
+ * Feed an unescaped byte through the state machine, calling
+ * the handler when a good message has been received.
+ */
+static void process_byte(struct protocol_decoder_t *p_decoder, uint8_t byte)
+{
+    struct protocol_message_t *p_message = &p_decoder->message;
+    switch (p_decoder->read_state)
+    {
+    case PROTOCOL_READ_STATE_IDLE:
+        break;
+    case PROTOCOL_READ_STATE_COMMAND:
+        if (byte < MAX_VALID_COMMAND)
+        {
+            p_message->command = (enum protocol_command_t) byte;
+            p_decoder->read_state = PROTOCOL_READ_STATE_LEN;
+        } else {
+            count_error(&p_decoder->errors.unknown_commands);
+            p_decoder->read_state = PROTOCOL_READ_STATE_IDLE;
+        }
+        break;
+    case PROTOCOL_READ_STATE_LEN:
+        p_message->data_read = 0;
+        p_message->data_len = byte;
+        if (p_message->data_len > MAX_MESSAGE_LEN)
+        {
+            /* Won't fit in the message - must be corrupt */
+            count_error(&p_decoder->errors.oversize);
+            p_decoder->read_state = PROTOCOL_READ_STATE_IDLE;
+        }
+        else
+        {
+            p_decoder->read_state = p_message->data_len ? PROTOCOL_READ_STATE_DATA : PROTOCOL_READ_STATE_CHECKSUM;
+        }
+        break;
+    case PROTOCOL_READ_STATE_DATA:
+        p_message->data[p_message->data_read++] = byte;
+        if (p_message->data_read == p_message->data_len)
+        {
+            p_decoder->read_state = PROTOCOL_READ_STATE_CHECKSUM;
+        }
+        break;
+    case PROTOCOL_READ_STATE_CHECKSUM:
+        if (byte == calc_checksum(p_message))
+        {
+            p_decoder->handler(p_message, p_decoder->p_context);
+        }
+        else
+        {
+            count_error(&p_decoder->errors.bad_checksums);
+        }
+        p_decoder->read_state = PROTOCOL_READ_STATE_IDLE;
+        break;
+    }
+}
+
+/*
+ * Add one to an error counter, such that another thread can
+ * read it safely.
+ */
+static void count_error(uint32_t *p_counter)
+{
+    __atomic_store_n(p_counter, *p_counter + 1, __ATOMIC_RELAXED);
+}
+
+/**************************************************
+* End of file
+***************************************************/
@@ -0,0 +1,168 @@
+/*****************************************************
+*
+* Pi Wars Robot Software (PWRS) Event Reactor
+*
+* Copyright (c) 2013-2017 theJPster (www.thejpster.org.uk)
+*
+* PWRS is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* PWRS is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with PWRS.  If not, see <http://www.gnu.org/licenses/>.
+*
+* A small epoll based event loop. File descriptors (joystick,
+* motor controller UART, etc) and periodic timers are registered
+* with a handler, which is called as soon as the descriptor
+* becomes readable or the timer expires.
+*
+*****************************************************/
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**************************************************
+* Includes
+***************************************************/
+
+#include "util/util.h"
+
+/**************************************************
+* Public Defines
+***************************************************/
+
+/* Maximum number of file descriptors (including timers) we can watch */
+#define REACTOR_MAX_HANDLERS 8
+
+/* With REACTOR_CATCHUP_BURST, never replay more than this many
+ * missed periods - anything older is skipped. */
+#define REACTOR_MAX_BURST 5
+
+/**************************************************
+* Public Data Types
+**************************************************/
+
+/*
+ * Called when a registered file descriptor is readable.
+ */
+typedef void (*reactor_handler_t)(int fd, void *p_context);
+
+/*
+ * Called when a registered timer expires. `expirations` is
+ * the number of periods which have elapsed since the handler
+ * was last called (normally 1).
+ */
+typedef void (*reactor_timer_handler_t)(uint64_t expirations, void *p_context);
+
+/*
+ * What a timer does when its handler overruns one or more
+ * deadlines.
+ */
+enum reactor_catchup_t
+{
+    /* Call the handler once, passing the number of elapsed
+     * periods, and carry on from the next deadline in the future. */
+    REACTOR_CATCHUP_SKIP,
+    /* Call the handler once for every missed period (up to
+     * REACTOR_MAX_BURST), so the number of calls tracks
+     * elapsed time. */
+    REACTOR_CATCHUP_BURST
+};
+
+/**************************************************
+* Public Data
+**************************************************/
+
+/* None */
+
+/**************************************************
+* Public Function Prototypes
+***************************************************/
+
+/**
+ * Create the epoll instance. Call once on startup.
+ *
+ * @return 0 on success, anything else on error
+ */
+extern int reactor_init(void);
+
+/**
+ * Watch a file descriptor for readability.
+ *
+ * @param[in] fd        The file descriptor to watch
+ * @param[in] fn        The function to call when fd is readable
+ * @param[in] p_context Passed to fn
+ * @return 0 on success, anything else on error
+ */
+extern int reactor_add_fd(int fd, reactor_handler_t fn, void *p_context);
+
+/**
+ * Stop watching a file descriptor. Safe to call from within
+ * a handler. The file descriptor is not closed.
+ *
+ * @param[in] fd The file descriptor to remove
+ */
+extern void reactor_remove_fd(int fd);
+
+/**
+ * Create a fixed-rate periodic timer.
+ *
+ * Deadlines are absolute CLOCK_MONOTONIC times, each exactly
+ * one period after the last, so the rate does not drift
+ * however long the handler or any other event takes.
+ *
+ * @param[in] period_us The timer period in microseconds
+ * @param[in] catchup   What to do when deadlines are missed
+ * @param[in] fn        The function to call on expiry
+ * @param[in] p_context Passed to fn
+ * @return the timer's file descriptor, or -1 on error
+ */
+extern int reactor_add_timer(
+    uint32_t period_us,
+    enum reactor_catchup_t catchup,
+    reactor_timer_handler_t fn,
+    void *p_context
+);
+
+/**
+ * Get the number of deadlines a timer has missed. A missed
+ * deadline is one which had already passed by the time the
+ * previous expiry was handled.
+ *
+ * @param[in] fd The file descriptor returned by reactor_add_timer()
+ * @return the number of missed deadlines
+ */
+extern uint64_t reactor_get_overruns(int fd);
+
+/**
+ * Wait for events and dispatch them to their handlers.
+ *
+ * @param[in] timeout_ms How long to wait. -1 means forever.
+ * @return the number of events dispatched, or -1 on error
+ */
+extern int reactor_run_once(int timeout_ms);
+
+/**
+ * Dispatch events forever.
+ */
+extern void reactor_run(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ndef REACTOR_H */
+
+/**************************************************
+* End of file
+***************************************************/
@@ -0,0 +1,342 @@
+/*****************************************************
+*
+* Pi Wars Robot Software (PWRS) Event Reactor
+*
+* Copyright (c) 2013-2017 theJPster (www.thejpster.org.uk)
+*
+* PWRS is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* PWRS is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with PWRS.  If not, see <http://www.gnu.org/licenses/>.
+*
+* The epoll set is built once; adding or removing a descriptor
+* is the only time we touch it. Timers are timerfds, so they
+* are dispatched through exactly the same path as any other
+* readable descriptor.
+*
+* Timers are one-shot timerfds armed with an absolute
+* deadline (TFD_TIMER_ABSTIME). After every expiry the next
+* deadline is the previous deadline plus one period - never
+* 'now' plus one period - so lateness in one tick is not
+* carried into the next.
+*
+*****************************************************/
+
+/**************************************************
+* Includes
+***************************************************/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "util/util.h"
+#include "reactor/reactor.h"
+
+/**************************************************
+* Defines
+***************************************************/
+
+/* None */
+
+/**************************************************
+* Data Types
+**************************************************/
+
+struct handler_t
+{
+    int fd;
+    bool in_use;
+    bool is_timer;
+    reactor_handler_t fn;
+    reactor_timer_handler_t timer_fn;
+    void *p_context;
+    /* Timers only */
+    enum reactor_catchup_t catchup;
+    uint64_t period_ns;
+    uint64_t deadline_ns;
+    uint64_t overruns;
+};
+
+/**************************************************
+* Function Prototypes
+**************************************************/
+
+static struct handler_t *alloc_handler(int fd);
+static int add_handler(struct handler_t *p_handler);
+static void dispatch(struct handler_t *p_handler);
+static void dispatch_timer(struct handler_t *p_handler);
+static int arm_timer(const struct handler_t *p_handler);
+
+/**************************************************
+* Public Data
+**************************************************/
+
+/* None */
+
+/**************************************************
+* Private Data
+**************************************************/
+
+static int epoll_fd = -1;
+
+static struct handler_t handlers[REACTOR_MAX_HANDLERS];
+
+/**************************************************
+* Public Functions
+***************************************************/
+
+int reactor_init(void)
+{
+    int retval = 0;
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+    {
+        perror("epoll_create1");
+        retval = -1;
+    }
+    return retval;
+}
+
+int reactor_add_fd(int fd, reactor_handler_t fn, void *p_context)
+{
+    struct handler_t *p_handler = alloc_handler(fd);
+    if (!p_handler)
+    {
+        return -1;
+    }
+    p_handler->is_timer = false;
+    p_handler->fn = fn;
+    p_handler->p_context = p_context;
+    return add_handler(p_handler);
+}
+
+void reactor_remove_fd(int fd)
+{
+    for (size_t i = 0; i < NUMELTS(handlers); i++)
+    {
+        if (handlers[i].in_use && (handlers[i].fd == fd))
+        {
+            /* The fd may already be closed, in which
+             * case the kernel has removed it for us. */
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            handlers[i].in_use = false;
+            handlers[i].fd = -1;
+        }
+    }
+}
+
+int reactor_add_timer(
+    uint32_t period_us,
+    enum reactor_catchup_t catchup,
+    reactor_timer_handler_t fn,
+    void *p_context
+)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+    {
+        perror("timerfd_create");
+        return -1;
+    }
+
+    struct handler_t *p_handler = alloc_handler(fd);
+    if (!p_handler)
+    {
+        close(fd);
+        return -1;
+    }
+    p_handler->is_timer = true;
+    p_handler->timer_fn = fn;
+    p_handler->p_context = p_context;
+    p_handler->catchup = catchup;
+    p_handler->period_ns = (uint64_t) period_us * 1000;
+    p_handler->deadline_ns = get_time_ns() + p_handler->period_ns;
+    p_handler->overruns = 0;
+
+    if ((arm_timer(p_handler) != 0) || (add_handler(p_handler) != 0))
+    {
+        p_handler->in_use = false;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+uint64_t reactor_get_overruns(int fd)
+{
+    for (size_t i = 0; i < NUMELTS(handlers); i++)
+    {
+        if (handlers[i].in_use && handlers[i].is_timer && (handlers[i].fd == fd))
+        {
+            return handlers[i].overruns;
+        }
+    }
+    return 0;
+}
+
+int reactor_run_once(int timeout_ms)
+{
+    struct epoll_event events[REACTOR_MAX_HANDLERS];
+    int num_events = epoll_wait(epoll_fd, events, NUMELTS(events), timeout_ms);
+    if (num_events < 0)
+    {
+        if (errno == EINTR)
+        {
+            return 0;
+        }
+        perror("epoll_wait");
+        return -1;
+    }
+    for (int i = 0; i < num_events; i++)
+    {
+        dispatch(events[i].data.ptr);
+    }
+    return num_events;
+}
+
+void reactor_run(void)
+{
+    while (reactor_run_once(-1) >= 0)
+    {
+        /* Keep going */
+    }
+}
+
+/**************************************************
+* Private Functions
+***************************************************/
+
+/*
+ * Find a free slot in the handler table.
+ */
+static struct handler_t *alloc_handler(int fd)
+{
+    for (size_t i = 0; i < NUMELTS(handlers); i++)
+    {
+        if (!handlers[i].in_use)
+        {
+            handlers[i].in_use = true;
+            handlers[i].fd = fd;
+            return &handlers[i];
+        }
+    }
+    fprintf(stderr, "Reactor full, can't watch fd %d\n", fd);
+    return NULL;
+}
+
+/*
+ * Register a filled-in handler with epoll.
+ */
+static int add_handler(struct handler_t *p_handler)
+{
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.ptr = p_handler
+    };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, p_handler->fd, &event) < 0)
+    {
+        perror("epoll_ctl");
+        p_handler->in_use = false;
+        p_handler->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Call the handler for a ready descriptor. A handler
+ * removed earlier in the same batch is skipped.
+ */
+static void dispatch(struct handler_t *p_handler)
+{
+    if (!p_handler->in_use)
+    {
+        return;
+    }
+    if (p_handler->is_timer)
+    {
+        dispatch_timer(p_handler);
+    }
+    else
+    {
+        p_handler->fn(p_handler->fd, p_handler->p_context);
+    }
+}
+
+/*
+ * A timer deadline has passed. Work out how many further
+ * deadlines have also passed, call the handler according
+ * to the catch-up policy, then arm the next deadline.
+ */
+static void dispatch_timer(struct handler_t *p_handler)
+{
+    uint64_t expirations = 0;
+    if (read(p_handler->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+    {
+        /* Spurious wakeup */
+        return;
+    }
+
+    const uint64_t now_ns = get_time_ns();
+    uint64_t missed = 0;
+    p_handler->deadline_ns += p_handler->period_ns;
+    if (now_ns >= p_handler->deadline_ns)
+    {
+        missed = 1 + ((now_ns - p_handler->deadline_ns) / p_handler->period_ns);
+        p_handler->deadline_ns += missed * p_handler->period_ns;
+        p_handler->overruns += missed;
+    }
+
+    if (p_handler->catchup == REACTOR_CATCHUP_BURST)
+    {
+        uint64_t calls = 1 + MIN(missed, REACTOR_MAX_BURST);
+        while (calls-- && p_handler->in_use)
+        {
+            p_handler->timer_fn(1, p_handler->p_context);
+        }
+    }
+    else
+    {
+        p_handler->timer_fn(1 + missed, p_handler->p_context);
+    }
+
+    if (p_handler->in_use)
+    {
+        arm_timer(p_handler);
+    }
+}
+
+/*
+ * Arm a one-shot timerfd for the handler's absolute deadline.
+ */
+static int arm_timer(const struct handler_t *p_handler)
+{
+    struct itimerspec spec = {
+        .it_value = {
+            .tv_sec = p_handler->deadline_ns / 1000000000,
+            .tv_nsec = p_handler->deadline_ns % 1000000000
+        }
+    };
+    if (timerfd_settime(p_handler->fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0)
+    {
+        perror("timerfd_settime");
+        return -1;
+    }
+    return 0;
+}
+
+/**************************************************
+* End of file
+***************************************************/
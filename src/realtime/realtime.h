@@ -0,0 +1,96 @@
+/*****************************************************
+*
+* Pi Wars Robot Software (PWRS) Real-time Support
+*
+* Copyright (c) 2013-2017 theJPster (www.thejpster.org.uk)
+*
+* PWRS is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* PWRS is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with PWRS.  If not, see <http://www.gnu.org/licenses/>.
+*
+* Puts the calling thread into a real-time execution profile,
+* so the control loop isn't held up by Bluetooth, systemd,
+* logging and so on.
+*
+*****************************************************/
+
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**************************************************
+* Includes
+***************************************************/
+
+#include "util/util.h"
+
+/**************************************************
+* Public Defines
+***************************************************/
+
+/* Default SCHED_FIFO priority. Above most kernel threads
+ * (which sit at 50) but leaves room above us. */
+#define REALTIME_DEFAULT_PRIORITY 60
+
+/* How much stack to touch up front */
+#define REALTIME_STACK_PREFAULT (256 * 1024)
+
+/* Pass as `cpu` to leave the CPU affinity alone */
+#define REALTIME_ANY_CPU -1
+
+/**************************************************
+* Public Data Types
+**************************************************/
+
+/* None */
+
+/**************************************************
+* Public Data
+**************************************************/
+
+/* None */
+
+/**************************************************
+* Public Function Prototypes
+***************************************************/
+
+/**
+ * Switch the calling thread to a real-time profile.
+ *
+ * Locks all current and future memory (mlockall), stops malloc
+ * handing memory back to the kernel, pre-faults
+ * REALTIME_STACK_PREFAULT bytes of stack, optionally pins the
+ * thread to one CPU and finally sets SCHED_FIFO at the given
+ * priority. Call it once initialisation is complete, from the
+ * thread which runs the control loop.
+ *
+ * A message explaining which privilege is missing is printed
+ * if any step fails.
+ *
+ * @param[in] priority The SCHED_FIFO priority (1..99)
+ * @param[in] cpu      The CPU to pin to, or REALTIME_ANY_CPU
+ * @return 0 on success, anything else on error
+ */
+extern int realtime_enable(int priority, int cpu);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ndef REALTIME_H */
+
+/**************************************************
+* End of file
+***************************************************/
@@ -0,0 +1,164 @@
+/*****************************************************
+*
+* Pi Wars Robot Software (PWRS) Real-time Support
+*
+* Copyright (c) 2013-2017 theJPster (www.thejpster.org.uk)
+*
+* PWRS is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* PWRS is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with PWRS.  If not, see <http://www.gnu.org/licenses/>.
+*
+* Everything here needs either root, or CAP_SYS_NICE and
+* CAP_IPC_LOCK (or suitable RLIMIT_RTPRIO / RLIMIT_MEMLOCK
+* limits, e.g. LimitRTPRIO= and LimitMEMLOCK= in a systemd unit).
+*
+*****************************************************/
+
+/**************************************************
+* Includes
+***************************************************/
+
+#include <errno.h>
+#include <malloc.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "util/util.h"
+#include "realtime/realtime.h"
+
+/**************************************************
+* Defines
+***************************************************/
+
+/* None */
+
+/**************************************************
+* Data Types
+**************************************************/
+
+/* None */
+
+/**************************************************
+* Function Prototypes
+**************************************************/
+
+static void prefault_stack(void);
+
+/**************************************************
+* Public Data
+**************************************************/
+
+/* None */
+
+/**************************************************
+* Private Data
+**************************************************/
+
+/* None */
+
+/**************************************************
+* Public Functions
+***************************************************/
+
+/**
+ * Switch the calling thread to a real-time profile.
+ *
+ * @param[in] priority The SCHED_FIFO priority (1..99)
+ * @param[in] cpu      The CPU to pin to, or REALTIME_ANY_CPU
+ * @return 0 on success, anything else on error
+ */
+int realtime_enable(int priority, int cpu)
+{
+    if ((priority < sched_get_priority_min(SCHED_FIFO)) ||
+        (priority > sched_get_priority_max(SCHED_FIFO)))
+    {
+        fprintf(stderr, "Real-time priority %d out of range (%d..%d)\n",
+            priority,
+            sched_get_priority_min(SCHED_FIFO),
+            sched_get_priority_max(SCHED_FIFO));
+        return -1;
+    }
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+    {
+        int err = errno;
+        fprintf(stderr, "Can't lock memory: %s\n", strerror(err));
+        if ((err == EPERM) || (err == ENOMEM))
+        {
+            fprintf(stderr, "Run as root, grant CAP_IPC_LOCK or raise RLIMIT_MEMLOCK (LimitMEMLOCK=infinity)\n");
+        }
+        return -1;
+    }
+
+    /* Don't let free() give pages back, or we'll fault them in again */
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+
+    prefault_stack();
+
+    if (cpu != REALTIME_ANY_CPU)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+        {
+            fprintf(stderr, "Can't pin to CPU %d: %s\n", cpu, strerror(errno));
+            return -1;
+        }
+    }
+
+    struct sched_param param = { .sched_priority = priority };
+    if (sched_setscheduler(0, SCHED_FIFO, &param) < 0)
+    {
+        int err = errno;
+        fprintf(stderr, "Can't set SCHED_FIFO priority %d: %s\n", priority, strerror(err));
+        if (err == EPERM)
+        {
+            fprintf(stderr, "Run as root, grant CAP_SYS_NICE or raise RLIMIT_RTPRIO (LimitRTPRIO=%d)\n", priority);
+        }
+        return -1;
+    }
+
+    printf("Real-time: SCHED_FIFO priority %d, memory locked", priority);
+    if (cpu != REALTIME_ANY_CPU)
+    {
+        printf(", pinned to CPU %d", cpu);
+    }
+    printf("\n");
+
+    return 0;
+}
+
+/**************************************************
+* Private Functions
+***************************************************/
+
+/*
+ * Touch a large block of stack so the pages are faulted in
+ * (and, with mlockall, locked) now rather than the first
+ * time the control loop happens to recurse that deep.
+ */
+static void __attribute__((noinline)) prefault_stack(void)
+{
+    volatile uint8_t stack[REALTIME_STACK_PREFAULT];
+    for (size_t i = 0; i < sizeof(stack); i += 4096)
+    {
+        stack[i] = 0;
+    }
+}
+
+/**************************************************
+* End of file
+***************************************************/
@@ -24,12 +24,17 @@
 ***************************************************/
 
 #include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <stdbool.h>
-#include <sys/time.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/signalfd.h>
 
 #include <time.h>
 #include <getopt.h>
@@ -39,6 +44,11 @@
 #include <gpio/gpio.h>
 #include <lcd/lcd.h>
 #include <motor/motor.h>
+#include <perf/perf.h>
+#include <reactor/reactor.h>
+#include <realtime/realtime.h>
+#include <serial/serial.h>
+#include <shaping/shaping.h>
 
 #include <modes/modes.h>
 
@@ -64,6 +74,14 @@
 
 static int process_arguments(int argc, char** argv);
 static void print_help(void);
+static bool parse_long_arg(const char *sz_what, const char *sz_arg, long minimum, long maximum, long *p_value);
+static void handle_joystick(int fd, void *p_context);
+static void handle_hotplug(int fd, void *p_context);
+static void show_waiting(const char *sz_what);
+static void handle_motor(int fd, void *p_context);
+static void handle_tick(uint64_t expirations, void *p_context);
+static int init_signals(void);
+static void handle_signal(int fd, void *p_context);
 
 /**************************************************
 * Public Data
@@ -75,23 +93,68 @@ int verbose_flag = 0;
 * Private Data
 **************************************************/
 
+static int realtime_flag = 0;
+
+static int serthread_flag = 0;
+
 static struct option long_options[] =
 {
     /* These options set a flag. */
     {"verbose", no_argument,       &verbose_flag, 1},
+    {"realtime", no_argument,      &realtime_flag, 1},
+    {"serthread", no_argument,     &serthread_flag, 1},
     {"help",    no_argument,       0, 'h'},
     {"jsdev",   required_argument, 0, 'j'},
     {"lcddev",  required_argument, 0, 'l'},
     {"serdev",  required_argument, 0, 's'},
+    {"catchup", required_argument, 0, 'c'},
+    {"rtprio",  required_argument, 0, 'p'},
+    {"rtcpu",   required_argument, 0, 'u'},
+    {"deadzone", required_argument, 0, 'd'},
+    {"expo",    required_argument, 0, 'e'},
+    {"trim",    required_argument, 0, 't'},
+    {"slew",    required_argument, 0, 'w'},
+    {"keepalive", required_argument, 0, 'k'},
+    {"serbaud", required_argument, 0, 'b'},
+    {"serselftest", required_argument, 0, 'i'},
     { 0 }
 };
 
-static const char *short_options = "vhj:l:s:";
+static const char *short_options = "vrhj:l:s:c:p:u:d:e:t:w:k:b:i:";
 
 static const char *sz_jsdev = "/dev/input/js0";
 static const char *sz_lcddev = "/dev/spidev0.1";
 static const char* sz_serdev = "/dev/ttyS0";
 
+/* Pings to time at startup, if any */
+static unsigned int serial_self_test_count = 0;
+
+/* Burst by default, so tick-counting modes (e.g. the maze
+ * turns) see one call per period even after a stall. */
+static enum reactor_catchup_t tick_catchup = REACTOR_CATCHUP_BURST;
+
+static int tick_fd = -1;
+
+/* Set when motor_commit() says the controller has stopped
+ * acknowledging requests */
+static bool motor_lost = false;
+
+static int rt_priority = REALTIME_DEFAULT_PRIORITY;
+static int rt_cpu = REALTIME_ANY_CPU;
+
+static struct shaping_config_t shaping_left = {
+    .deadzone_pct = SHAPING_DEFAULT_DEADZONE_PCT,
+    .expo_pct = SHAPING_DEFAULT_EXPO_PCT,
+    .trim_pct = SHAPING_DEFAULT_TRIM_PCT,
+    .slew_per_tick = SHAPING_DEFAULT_SLEW
+};
+static struct shaping_config_t shaping_right = {
+    .deadzone_pct = SHAPING_DEFAULT_DEADZONE_PCT,
+    .expo_pct = SHAPING_DEFAULT_EXPO_PCT,
+    .trim_pct = SHAPING_DEFAULT_TRIM_PCT,
+    .slew_per_tick = SHAPING_DEFAULT_SLEW
+};
+
 /**************************************************
 * Public Functions
 ***************************************************/
@@ -113,12 +176,23 @@ int main(int argc, char **argv)
 
     retval = process_arguments(argc, argv);
 
+    if (retval == 0)
+    {
+        mode_set_shaping(&shaping_left, &shaping_right);
+    }
+
     if (retval == 0)
     {
         printf("OK\r\nInit LCD...\r\n");
         retval = lcd_init(sz_lcddev);
     }
 
+    if (retval == 0)
+    {
+        printf("OK\r\nInit Reactor...\r\n");
+        retval = reactor_init();
+    }
+
     if (retval == 0)
     {
         printf("OK\r\nInit Motor...\r\n");
@@ -127,12 +201,15 @@ int main(int argc, char **argv)
         {
             retval = -st;
         }
+        else if (serial_self_test_count > 0)
+        {
+            /* Just a report - carry on whatever it says */
+            motor_self_test(serial_self_test_count, stdout);
+        }
     }
 
     if (retval == 0)
     {
-        const char spinner[] = { '.', 'o', 'O', 'o'};
-        size_t i = 0;
         printf("Verbose mode is %s\n", verbose_flag ? "on" : "off");
 
         lcd_paint_clear_screen();
@@ -141,40 +218,68 @@ int main(int argc, char **argv)
         sleep(1);
         lcd_paint_clear_screen();
 
+        /* If the pad isn't there yet, the hotplug watch will
+         * pick it up the moment it appears (and tries again
+         * once the watch is in place). */
         printf("Init Joystick...\r\n");
-        do
+        dualshock_init(sz_jsdev);
+        int hotplug_fd = dualshock_hotplug_init();
+        if (hotplug_fd < 0)
+        {
+            retval = -1;
+        }
+        else
         {
-            char message[10];
-            sprintf(message, "Pad? %c", spinner[i]);
-            BOUNDS_INCREMENT(i, NUMELTS(spinner), 0);
-            font_draw_text_small(0, 0, message, LCD_WHITE, LCD_BLACK, FONT_PROPORTIONAL);
-            lcd_flush();
-            retval = dualshock_init(sz_jsdev);
-            sleep(1);
-        } while(retval != 0);
-        printf("Init Joystick done!\r\n");
+            retval = reactor_add_fd(hotplug_fd, handle_hotplug, NULL);
+        }
+    }
+
+    if (retval == 0)
+    {
+        retval = init_signals();
+    }
+
+    if ((retval == 0) && dualshock_is_connected())
+    {
+        retval = reactor_add_fd(dualshock_get_fd(), handle_joystick, NULL);
     }
 
+    if ((retval == 0) && !serthread_flag)
+    {
+        retval = reactor_add_fd(motor_get_fd(), handle_motor, NULL);
+    }
 
     if (retval == 0)
     {
-        struct timeval delay_master = {
-            .tv_sec = 0,
-            .tv_usec = (1000 * 1000) / LOOPS_PER_SECOND
-        };
-        struct timeval loop_delay = delay_master;
-        while(1)
-            {
-            dualshock_read_or_timeout(&loop_delay);
-            if (loop_delay.tv_sec == 0 && loop_delay.tv_usec == 0)
-            {
-                motor_poll();
-                mode_handle();
-                loop_delay = delay_master;
-            }
+        tick_fd = reactor_add_timer((1000 * 1000) / LOOPS_PER_SECOND, tick_catchup, handle_tick, NULL);
+        if (tick_fd < 0)
+        {
+            retval = -1;
         }
     }
 
+    if ((retval == 0) && realtime_flag)
+    {
+        printf("Enabling real-time profile...\r\n");
+        retval = realtime_enable(rt_priority, rt_cpu);
+    }
+
+    if ((retval == 0) && serthread_flag)
+    {
+        /* Started last, so it inherits the real-time profile */
+        printf("Starting serial thread...\r\n");
+        enum motor_status_t st = motor_start_thread();
+        if (st != MOTOR_STATUS_OK)
+        {
+            retval = -st;
+        }
+    }
+
+    if (retval == 0)
+    {
+        reactor_run();
+    }
+
     return retval;
 }
 
@@ -185,6 +290,7 @@ int main(int argc, char **argv)
 static int process_arguments(int argc, char** argv)
 {
     int retval = 0;
+    long value;
     while (1)
     {
         /* getopt_long stores the option index here. */
@@ -217,6 +323,123 @@ static int process_arguments(int argc, char** argv)
             verbose_flag = 1;
             break;
 
+        case 'r':
+            realtime_flag = 1;
+            break;
+
+        case 'p':
+            if (parse_long_arg("Priority", optarg,
+                sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO), &value))
+            {
+                rt_priority = (int) value;
+            }
+            else
+            {
+                print_help();
+                retval = 1;
+            }
+            break;
+
+        case 'u':
+            if (parse_long_arg("CPU", optarg, 0, CPU_SETSIZE - 1, &value))
+            {
+                rt_cpu = (int) value;
+            }
+            else
+            {
+                print_help();
+                retval = 1;
+            }
+            break;
+
+        case 'd':
+            if (parse_long_arg("Deadzone", optarg, 0, 100, &value))
+            {
+                shaping_left.deadzone_pct = (unsigned int) value;
+                shaping_right.deadzone_pct = shaping_left.deadzone_pct;
+            }
+            else
+            {
+                print_help();
+                retval = 1;
+            }
+            break;
+
+        case 'e':
+            if (parse_long_arg("Expo", optarg, 0, 100, &value))
+            {
+                shaping_left.expo_pct = (unsigned int) value;
+                shaping_right.expo_pct = shaping_left.expo_pct;
+            }
+            else
+            {
+                print_help();
+                retval = 1;
+            }
+            break;
+
+        case 'w':
+            if (parse_long_arg("Slew", optarg, 0, MOTOR_MAX_SPEED, &value))
+            {
+                shaping_left.slew_per_tick = (unsigned int) value;
+                shaping_right.slew_per_tick = shaping_left.slew_per_tick;
+            }
+            else
+            {
+                print_help();
+                retval = 1;
+            }
+            break;
+
+        case 't':
+            if (sscanf(optarg, "%u,%u", &shaping_left.trim_pct, &shaping_right.trim_pct) != 2)
+            {
+                fprintf(stderr, "Trim should be <left%%>,<right%%>, not %s\n", optarg);
+                print_help();
+                retval = 1;
+            }
+            break;
+
+        case 'k':
+            if (parse_long_arg("Keepalive", optarg, 0, MOTOR_MAX_KEEPALIVE_MS, &value))
+            {
+                motor_set_keepalive((uint32_t) value);
+            }
+            else
+            {
+                print_help();
+                retval = 1;
+            }
+            break;
+
+        case 'b':
+            if (parse_long_arg("Baud rate", optarg, SERIAL_MIN_BAUD, SERIAL_MAX_BAUD, &value))
+            {
+                if (!serial_is_standard_baud((uint32_t) value))
+                {
+                    printf("%ld is not a standard baud rate; the UART may round it\n", value);
+                }
+                motor_set_baud((uint32_t) value);
+            }
+            else
+            {
+                print_help();
+                retval = 1;
+            }
+            break;
+
+        case 'i':
+            if (parse_long_arg("Self-test count", optarg, 0, MOTOR_MAX_SELF_TEST_COUNT, &value))
+            {
+                serial_self_test_count = (unsigned int) value;
+            }
+            else
+            {
+                print_help();
+                retval = 1;
+            }
+            break;
+
         case 'j':
             sz_jsdev = optarg;
             break;
@@ -229,6 +452,23 @@ static int process_arguments(int argc, char** argv)
             sz_serdev = optarg;
             break;
 
+        case 'c':
+            if (strcmp(optarg, "skip") == 0)
+            {
+                tick_catchup = REACTOR_CATCHUP_SKIP;
+            }
+            else if (strcmp(optarg, "burst") == 0)
+            {
+                tick_catchup = REACTOR_CATCHUP_BURST;
+            }
+            else
+            {
+                fprintf(stderr, "Unknown catch-up policy %s\n", optarg);
+                print_help();
+                retval = 1;
+            }
+            break;
+
         case 'h':
             print_help();
             retval = 1;
@@ -244,6 +484,188 @@ static int process_arguments(int argc, char** argv)
     return retval;
 }
 
+/*
+ * Joystick events are processed as soon as they arrive, so
+ * the state is up to date when the next tick runs.
+ */
+static void handle_joystick(int fd, void *p_context)
+{
+    if (dualshock_poll() < 0)
+    {
+        /* Pad has gone - stop right now, don't wait for the tick */
+        reactor_remove_fd(fd);
+        motor_control(MOTOR_BOTH, 0);
+        printf("Joystick lost, motors stopped\r\n");
+    }
+}
+
+/*
+ * Something changed in the joystick's directory. If the pad
+ * has (re-)appeared, start reading it and go back to the menu.
+ */
+static void handle_hotplug(int fd, void *p_context)
+{
+    if (dualshock_hotplug_poll())
+    {
+        printf("Joystick attached\r\n");
+        reactor_add_fd(dualshock_get_fd(), handle_joystick, NULL);
+        lcd_paint_clear_screen();
+        mode_reset();
+    }
+}
+
+/*
+ * Tell the user we're waiting for something (the pad, or the
+ * motor controller).
+ */
+static void show_waiting(const char *sz_what)
+{
+    static const char spinner[] = { '.', 'o', 'O', 'o'};
+    static size_t ticks = 0;
+    char message[16];
+    snprintf(message, sizeof(message), "%s %c", sz_what, spinner[(ticks++ / 8) % NUMELTS(spinner)]);
+    font_draw_text_small(0, 0, message, LCD_WHITE, LCD_BLACK, FONT_PROPORTIONAL);
+    lcd_flush();
+}
+
+/*
+ * Serial data from the motor controller is decoded as soon
+ * as it arrives, rather than waiting for the next tick.
+ */
+static void handle_motor(int fd, void *p_context)
+{
+    uint64_t start = get_time_ns();
+    motor_poll();
+    perf_record(PERF_STAGE_MOTOR_POLL, start);
+}
+
+/*
+ * The control tick - runs LOOPS_PER_SECOND times per second,
+ * on absolute deadlines.
+ */
+static void handle_tick(uint64_t expirations, void *p_context)
+{
+    static uint64_t last_overruns = 0;
+    static uint64_t last_start = 0;
+    const uint64_t start = get_time_ns();
+    const uint64_t overruns = reactor_get_overruns(tick_fd);
+    if ((overruns != last_overruns) && verbose_flag)
+    {
+        printf("Tick overrun! %"PRIu64" missed in total\n", overruns);
+    }
+    last_overruns = overruns;
+    if (last_start != 0)
+    {
+        perf_record_duration(PERF_STAGE_TICK_PERIOD, start - last_start);
+    }
+    last_start = start;
+
+    if (!dualshock_is_connected())
+    {
+        /* No pad, no driving */
+        motor_control(MOTOR_BOTH, 0);
+        show_waiting("Pad?");
+        return;
+    }
+
+    if (motor_lost)
+    {
+        /* Keep asking it to stop. The first ACK_IND clears
+         * the fault, and then we start again from the menu. */
+        if (motor_control(MOTOR_BOTH, 0) == MOTOR_STATUS_NO_RESPONSE)
+        {
+            show_waiting("Motor?");
+            return;
+        }
+        printf("Motor controller back\r\n");
+        motor_lost = false;
+        lcd_paint_clear_screen();
+        mode_reset();
+    }
+
+    /* Whatever the mode asks of the motors goes out in one burst */
+    motor_begin();
+    dualshock_tick();
+    const uint64_t mode_start = get_time_ns();
+    mode_handle();
+    perf_record(PERF_STAGE_MODE_HANDLE, mode_start);
+    if (motor_commit() == MOTOR_STATUS_NO_RESPONSE)
+    {
+        /* Whatever the mode was doing, it can't do it now */
+        printf("Motor controller not responding, stopping\r\n");
+        motor_lost = true;
+        motor_control(MOTOR_BOTH, 0);
+        lcd_paint_clear_screen();
+    }
+
+    perf_record(PERF_STAGE_TICK, start);
+}
+
+/*
+ * SIGUSR1 is delivered through a signalfd, so the dump
+ * happens in the main loop rather than in a signal handler.
+ */
+static int init_signals(void)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0)
+    {
+        perror("sigprocmask");
+        return -1;
+    }
+    int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0)
+    {
+        perror("signalfd");
+        return -1;
+    }
+    return reactor_add_fd(fd, handle_signal, NULL);
+}
+
+/*
+ * Dump the statistics on SIGUSR1.
+ */
+static void handle_signal(int fd, void *p_context)
+{
+    struct signalfd_siginfo info;
+    while (read(fd, &info, sizeof(info)) == sizeof(info))
+    {
+        if (info.ssi_signo == SIGUSR1)
+        {
+            perf_dump(stdout);
+            printf("Tick overruns: %"PRIu64"\n", reactor_get_overruns(tick_fd));
+            size_t backlog_max = 0;
+            size_t backlog = motor_get_rx_backlog(&backlog_max);
+            printf("Serial RX backlog: %zu bytes (max %zu)\n", backlog, backlog_max);
+            motor_dump_sensor_rates(stdout);
+            motor_dump_round_trips(stdout);
+            motor_dump_link_stats(stdout);
+        }
+    }
+}
+
+/*
+ * Parse a whole decimal argument, which must be in
+ * minimum..maximum. Says what was wrong if it isn't.
+ *
+ * Returns true if *p_value has been set.
+ */
+static bool parse_long_arg(const char *sz_what, const char *sz_arg, long minimum, long maximum, long *p_value)
+{
+    char *p_end;
+    errno = 0;
+    const long value = strtol(sz_arg, &p_end, 10);
+    if ((p_end == sz_arg) || (*p_end != '\0') || (errno != 0) || (value < minimum) || (value > maximum))
+    {
+        fprintf(stderr, "%s should be %ld..%ld, not %s\n", sz_what, minimum, maximum, sz_arg);
+        return false;
+    }
+    *p_value = value;
+    return true;
+}
+
 static void print_help(void)
 {
     fprintf(stderr, "\n");
@@ -256,12 +678,52 @@ static void print_help(void)
     fprintf(stderr, "\n");
     fprintf(stderr, "Options are:\n");
     fprintf(stderr, "\n");
-    fprintf(stderr, "    --jsdev / -j <device>  - Specifies the /dev/event/foo device for the joystick\n");
+    fprintf(stderr, "    --jsdev / -j <device>  - Specifies the /dev/input/jsN or /dev/input/eventN\n");
+    fprintf(stderr, "                           device for the joystick. eventN uses evdev.\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "    --lcddev / -l <device> - Specifies the /dev/spidevX.X device for the LCD\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "    --serdev / -s <device> - Specifies the /dev/ttyXX device for the motor controller\n");
     fprintf(stderr, "\n");
+    fprintf(stderr, "    --keepalive / -k <ms>  - Re-send unchanged motor speeds this often, up\n");
+    fprintf(stderr, "                           to %d, or 0 to send every tick (default %d)\n",
+        MOTOR_MAX_KEEPALIVE_MS, MOTOR_DEFAULT_KEEPALIVE_MS);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "    --serbaud / -b <baud>  - Switch the motor controller link to this rate\n");
+    fprintf(stderr, "                           once it's open at %d, e.g. 230400, 460800,\n", MOTOR_DEFAULT_BAUD);
+    fprintf(stderr, "                           921600 or 1000000. Other rates are allowed if\n");
+    fprintf(stderr, "                           the UART can manage them. Needs controller\n");
+    fprintf(stderr, "                           support; falls back to %d otherwise.\n", MOTOR_DEFAULT_BAUD);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "    --serselftest / -i <n> - At startup, ping the motor controller n times\n");
+    fprintf(stderr, "                           (up to %d) and print the round trip times\n", MOTOR_MAX_SELF_TEST_COUNT);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "    --catchup / -c <skip|burst> - What to do when the control tick\n");
+    fprintf(stderr, "                           overruns. 'skip' runs one late tick, 'burst'\n");
+    fprintf(stderr, "                           replays each missed tick (default)\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "    --realtime / -r        - Run the control loop with SCHED_FIFO, locked\n");
+    fprintf(stderr, "                           memory and a pre-faulted stack (needs root)\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "    --serthread            - Talk to the motor controller from a separate\n");
+    fprintf(stderr, "                           thread, so sensor readings are always fresh\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "    --rtprio / -p <prio>   - SCHED_FIFO priority for --realtime (default %d)\n", REALTIME_DEFAULT_PRIORITY);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "    --rtcpu / -u <cpu>     - Pin the control loop to this CPU for --realtime\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "    --deadzone / -d <pct>  - Stick travel around centre ignored in remote\n");
+    fprintf(stderr, "                           control, 0..100 (default %d)\n", SHAPING_DEFAULT_DEADZONE_PCT);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "    --expo / -e <pct>      - 0 for a linear stick, 100 for fully cubic\n");
+    fprintf(stderr, "                           (default %d)\n", SHAPING_DEFAULT_EXPO_PCT);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "    --trim / -t <l>,<r>    - Left and right motor gain in percent\n");
+    fprintf(stderr, "                           (default %d,%d)\n", SHAPING_DEFAULT_TRIM_PCT, SHAPING_DEFAULT_TRIM_PCT);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "    --slew / -w <speed>    - Most a motor may speed up per tick, up to %d,\n", MOTOR_MAX_SPEED);
+    fprintf(stderr, "                           or 0 for no limit (default %d)\n", SHAPING_DEFAULT_SLEW);
+    fprintf(stderr, "\n");
     fprintf(stderr, "    --verbose / -v         - Enables more logging\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "    --help / -h            - Shows this help\n");
@@ -0,0 +1,125 @@
+/*****************************************************
+*
+* Pi Wars Robot Software (PWRS) Serial Port Settings
+*
+* Copyright (c) 2013-2017 theJPster (www.thejpster.org.uk)
+*
+* PWRS is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* PWRS is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with PWRS.  If not, see <http://www.gnu.org/licenses/>.
+*
+* Serial port settings that <termios.h> can't express: baud
+* rates without a Bxxx constant, and the driver's low latency
+* mode. This uses the Linux termios2 interface, whose header
+* can't be included alongside <termios.h>, so it has a module
+* to itself.
+*
+*****************************************************/
+
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**************************************************
+* Includes
+***************************************************/
+
+#include "util/util.h"
+
+/**************************************************
+* Public Defines
+***************************************************/
+
+/* Limits on what we'll ask a UART for */
+#define SERIAL_MIN_BAUD 1200
+#define SERIAL_MAX_BAUD 4000000
+
+/**************************************************
+* Public Data Types
+**************************************************/
+
+/* None */
+
+/**************************************************
+* Public Data
+**************************************************/
+
+/* None */
+
+/**************************************************
+* Public Function Prototypes
+***************************************************/
+
+/**
+ * Change the baud rate of an open serial port, leaving every
+ * other setting alone. Standard rates (up to 4000000) are set
+ * as such; anything else is set as a custom rate (BOTHER),
+ * which the driver may round.
+ *
+ * @param[in] fd   The serial port
+ * @param[in] baud The rate, SERIAL_MIN_BAUD..SERIAL_MAX_BAUD
+ * @return 0 on success, -1 on error (with errno set)
+ */
+extern int serial_set_baud(int fd, uint32_t baud);
+
+/**
+ * @param[in] fd The serial port
+ * @return The baud rate the driver says it is using, or 0 on error
+ */
+extern uint32_t serial_get_baud(int fd);
+
+/**
+ * @param[in] baud A baud rate
+ * @return true if it is one of the standard Bxxx rates
+ */
+extern bool serial_is_standard_baud(uint32_t baud);
+
+/**
+ * Ask the driver to hand received bytes over straight away
+ * (ASYNC_LOW_LATENCY) instead of batching them up. USB serial
+ * adapters otherwise hold bytes for their latency timer, which
+ * is 16 ms on an FTDI.
+ *
+ * @param[in] fd The serial port
+ * @return 0 on success, -1 on error (with errno set - ENOTTY
+ *         or EINVAL if the driver doesn't do low latency)
+ */
+extern int serial_set_low_latency(int fd);
+
+/**
+ * @param[in] fd The serial port
+ * @return 1 if the driver is in low latency mode, 0 if not,
+ *         or -1 if it doesn't say
+ */
+extern int serial_get_low_latency(int fd);
+
+/**
+ * Find the latency timer of a USB serial adapter, from sysfs.
+ *
+ * @param[in] fd The serial port
+ * @return The timer in milliseconds, or -1 if the port
+ *         doesn't have one
+ */
+extern int serial_get_latency_timer(int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ndef SERIAL_H */
+
+/**************************************************
+* End of file
+***************************************************/
@@ -0,0 +1,219 @@
+/*****************************************************
+*
+* Pi Wars Robot Software (PWRS) Serial Port Settings
+*
+* Copyright (c) 2013-2017 theJPster (www.thejpster.org.uk)
+*
+* PWRS is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* PWRS is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with PWRS.  If not, see <http://www.gnu.org/licenses/>.
+*
+* Don't include <termios.h> here - it clashes with
+* <asm/termbits.h>.
+*
+*****************************************************/
+
+/**************************************************
+* Includes
+***************************************************/
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <asm/termbits.h>
+#include <linux/serial.h>
+
+#include "util/util.h"
+#include "serial/serial.h"
+
+/**************************************************
+* Defines
+***************************************************/
+
+#define SYSFS_PATH_LEN 128
+
+/**************************************************
+* Data Types
+**************************************************/
+
+struct standard_baud_t
+{
+    uint32_t baud;
+    unsigned int code;
+};
+
+/**************************************************
+* Function Prototypes
+**************************************************/
+
+static const struct standard_baud_t *find_standard(uint32_t baud);
+
+/**************************************************
+* Public Data
+**************************************************/
+
+/* None */
+
+/**************************************************
+* Private Data
+**************************************************/
+
+static const struct standard_baud_t standard_bauds[] =
+{
+    { 1200, B1200 },
+    { 2400, B2400 },
+    { 4800, B4800 },
+    { 9600, B9600 },
+    { 19200, B19200 },
+    { 38400, B38400 },
+    { 57600, B57600 },
+    { 115200, B115200 },
+    { 230400, B230400 },
+    { 460800, B460800 },
+    { 500000, B500000 },
+    { 576000, B576000 },
+    { 921600, B921600 },
+    { 1000000, B1000000 },
+    { 1152000, B1152000 },
+    { 1500000, B1500000 },
+    { 2000000, B2000000 },
+    { 2500000, B2500000 },
+    { 3000000, B3000000 },
+    { 3500000, B3500000 },
+    { 4000000, B4000000 },
+};
+
+/**************************************************
+* Public Functions
+***************************************************/
+
+int serial_set_baud(int fd, uint32_t baud)
+{
+    if ((baud < SERIAL_MIN_BAUD) || (baud > SERIAL_MAX_BAUD))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct termios2 tio;
+    if (ioctl(fd, TCGETS2, &tio) < 0)
+    {
+        return -1;
+    }
+
+    const struct standard_baud_t *p_standard = find_standard(baud);
+    tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+    tio.c_cflag |= p_standard ? p_standard->code : BOTHER;
+    tio.c_ispeed = baud;
+    tio.c_ospeed = baud;
+
+    /* Let anything already queued go at the old rate first */
+    return ioctl(fd, TCSETSW2, &tio);
+}
+
+uint32_t serial_get_baud(int fd)
+{
+    struct termios2 tio;
+    if (ioctl(fd, TCGETS2, &tio) < 0)
+    {
+        return 0;
+    }
+    return tio.c_ospeed;
+}
+
+bool serial_is_standard_baud(uint32_t baud)
+{
+    return find_standard(baud) != NULL;
+}
+
+int serial_set_low_latency(int fd)
+{
+    struct serial_struct info;
+    if (ioctl(fd, TIOCGSERIAL, &info) < 0)
+    {
+        return -1;
+    }
+    info.flags |= ASYNC_LOW_LATENCY;
+    if (ioctl(fd, TIOCSSERIAL, &info) < 0)
+    {
+        return -1;
+    }
+
+    /* Some drivers accept the flag and quietly drop it */
+    if (serial_get_low_latency(fd) != 1)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+int serial_get_low_latency(int fd)
+{
+    struct serial_struct info;
+    if (ioctl(fd, TIOCGSERIAL, &info) < 0)
+    {
+        return -1;
+    }
+    return (info.flags & ASYNC_LOW_LATENCY) ? 1 : 0;
+}
+
+int serial_get_latency_timer(int fd)
+{
+    const char *sz_device = ttyname(fd);
+    if (!sz_device)
+    {
+        return -1;
+    }
+    const char *sz_name = strrchr(sz_device, '/');
+    sz_name = sz_name ? (sz_name + 1) : sz_device;
+
+    char path[SYSFS_PATH_LEN];
+    snprintf(path, sizeof(path), "/sys/class/tty/%s/device/latency_timer", sz_name);
+    FILE *p_file = fopen(path, "r");
+    if (!p_file)
+    {
+        return -1;
+    }
+    int timer_ms = -1;
+    if (fscanf(p_file, "%d", &timer_ms) != 1)
+    {
+        timer_ms = -1;
+    }
+    fclose(p_file);
+    return timer_ms;
+}
+
+/**************************************************
+* Private Functions
+***************************************************/
+
+/*
+ * Look up the Bxxx code for a baud rate.
+ */
+static const struct standard_baud_t *find_standard(uint32_t baud)
+{
+    for (size_t i = 0; i < NUMELTS(standard_bauds); i++)
+    {
+        if (standard_bauds[i].baud == baud)
+        {
+            return &standard_bauds[i];
+        }
+    }
+    return NULL;
+}
+
+/**************************************************
+* End of file
+***************************************************/
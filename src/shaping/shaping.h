@@ -0,0 +1,117 @@
+/*****************************************************
+*
+* Pi Wars Robot Software (PWRS) Input Shaping
+*
+* Copyright (c) 2013-2017 theJPster (www.thejpster.org.uk)
+*
+* PWRS is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* PWRS is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with PWRS.  If not, see <http://www.gnu.org/licenses/>.
+*
+* Maps a raw stick position to a motor speed. The deadzone,
+* expo curve and trim are baked into a lookup table when the
+* axis is configured, so shaping a sample costs one table load
+* plus the slew limit.
+*
+*****************************************************/
+
+#ifndef SHAPING_H
+#define SHAPING_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**************************************************
+* Includes
+***************************************************/
+
+#include "util/util.h"
+
+/**************************************************
+* Public Defines
+***************************************************/
+
+/* Input is -32768..32767, so each entry covers 128 counts */
+#define SHAPING_TABLE_BITS 9
+#define SHAPING_TABLE_SIZE (1 << SHAPING_TABLE_BITS)
+
+#define SHAPING_DEFAULT_DEADZONE_PCT 8
+#define SHAPING_DEFAULT_EXPO_PCT 30
+#define SHAPING_DEFAULT_TRIM_PCT 100
+#define SHAPING_DEFAULT_SLEW 0
+
+/**************************************************
+* Public Data Types
+**************************************************/
+
+struct shaping_config_t
+{
+    /* Stick travel (percent of full scale) around centre which gives zero output */
+    unsigned int deadzone_pct;
+    /* 0 is linear, 100 is fully cubic (gentle near centre) */
+    unsigned int expo_pct;
+    /* Output gain in percent, to balance one side against another */
+    unsigned int trim_pct;
+    /* Maximum increase in output magnitude per call. 0 is unlimited.
+     * Slowing down is never limited. */
+    unsigned int slew_per_tick;
+};
+
+struct shaping_axis_t
+{
+    int16_t table[SHAPING_TABLE_SIZE];
+    unsigned int slew_per_tick;
+    int last_output;
+};
+
+/**************************************************
+* Public Data
+**************************************************/
+
+/* None */
+
+/**************************************************
+* Public Function Prototypes
+***************************************************/
+
+/**
+ * Build the lookup table for an axis.
+ *
+ * @param[out] p_axis     The axis to set up
+ * @param[in]  p_config   The shaping to apply
+ * @param[in]  output_max The output at full stick (e.g. MOTOR_MAX_SPEED)
+ */
+extern void shaping_init(
+    struct shaping_axis_t *p_axis,
+    const struct shaping_config_t *p_config,
+    int output_max
+);
+
+/**
+ * Shape one stick sample. Call once per tick.
+ *
+ * @param[in,out] p_axis The axis
+ * @param[in]     input  The raw stick position, -32768..32767
+ * @return The shaped output, -output_max..output_max
+ */
+extern int shaping_apply(struct shaping_axis_t *p_axis, int input);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ndef SHAPING_H */
+
+/**************************************************
+* End of file
+***************************************************/
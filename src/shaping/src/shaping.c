@@ -0,0 +1,128 @@
+/*****************************************************
+*
+* Pi Wars Robot Software (PWRS) Input Shaping
+*
+* Copyright (c) 2013-2017 theJPster (www.thejpster.org.uk)
+*
+* PWRS is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* PWRS is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with PWRS.  If not, see <http://www.gnu.org/licenses/>.
+*
+*****************************************************/
+
+/**************************************************
+* Includes
+***************************************************/
+
+#include <stdlib.h>
+
+#include "util/util.h"
+#include "shaping/shaping.h"
+
+/**************************************************
+* Defines
+***************************************************/
+
+#define INPUT_SHIFT (16 - SHAPING_TABLE_BITS)
+#define INPUT_HALF_STEP (1 << (INPUT_SHIFT - 1))
+
+/**************************************************
+* Data Types
+**************************************************/
+
+/* None */
+
+/**************************************************
+* Function Prototypes
+**************************************************/
+
+/* None */
+
+/**************************************************
+* Public Data
+**************************************************/
+
+/* None */
+
+/**************************************************
+* Private Data
+**************************************************/
+
+/* None */
+
+/**************************************************
+* Public Functions
+***************************************************/
+
+void shaping_init(
+    struct shaping_axis_t *p_axis,
+    const struct shaping_config_t *p_config,
+    int output_max
+)
+{
+    const double deadzone = MIN(p_config->deadzone_pct, 99) / 100.0;
+    const double expo = MIN(p_config->expo_pct, 100) / 100.0;
+    const double gain = (output_max * p_config->trim_pct) / 100.0;
+
+    for (size_t i = 0; i < SHAPING_TABLE_SIZE; i++)
+    {
+        /* Centre of the range of inputs which map to this entry,
+         * scaled so the outermost entries are exactly -1 and +1 */
+        const int input = (int) (i << INPUT_SHIFT) + INPUT_HALF_STEP - 32768;
+        const double x = input / (double) (32768 - INPUT_HALF_STEP);
+        const double magnitude = (x < 0) ? -x : x;
+        double y = 0;
+        if (magnitude > deadzone)
+        {
+            y = (MIN(magnitude, 1.0) - deadzone) / (1.0 - deadzone);
+            y = ((1.0 - expo) * y) + (expo * y * y * y);
+        }
+        int output = (int) ((y * gain) + 0.5);
+        output = MIN(output, output_max);
+        p_axis->table[i] = (x < 0) ? -output : output;
+    }
+    p_axis->slew_per_tick = p_config->slew_per_tick;
+    p_axis->last_output = 0;
+}
+
+int shaping_apply(struct shaping_axis_t *p_axis, int input)
+{
+    input = MAX(MIN(input, 32767), -32768);
+    int output = p_axis->table[(input + 32768) >> INPUT_SHIFT];
+
+    /* Limit acceleration, but always allow slowing down */
+    const int last = p_axis->last_output;
+    const int step = (int) p_axis->slew_per_tick;
+    if ((step > 0) && (abs(output) > abs(last)))
+    {
+        if (output > last + step)
+        {
+            output = last + step;
+        }
+        else if (output < last - step)
+        {
+            output = last - step;
+        }
+    }
+    p_axis->last_output = output;
+    return output;
+}
+
+/**************************************************
+* Private Functions
+***************************************************/
+
+/* None */
+
+/**************************************************
+* End of file
+***************************************************/
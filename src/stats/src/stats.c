@@ -0,0 +1,373 @@
+/*****************************************************
+*
+* Pi Wars Robot Software (PWRS) Statistics
+*
+* Copyright (c) 2013-2017 theJPster (www.thejpster.org.uk)
+*
+* PWRS is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* PWRS is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with PWRS.  If not, see <http://www.gnu.org/licenses/>.
+*
+* Bucket layout, with S = STATS_HIST_SUB_BUCKETS:
+*
+*   Values 0 .. 2S-1 each get their own bucket.
+*   Above that, a value with its top bit at position
+*   b is shifted right by e = b - STATS_HIST_SUB_BITS, leaving
+*   a mantissa m in S..2S-1, and lands in bucket (e * S) + m.
+*
+*****************************************************/
+
+/**************************************************
+* Includes
+***************************************************/
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "util/util.h"
+#include "stats/stats.h"
+
+/**************************************************
+* Defines
+***************************************************/
+
+/* None */
+
+/**************************************************
+* Data Types
+**************************************************/
+
+/* None */
+
+/**************************************************
+* Function Prototypes
+**************************************************/
+
+static size_t bucket_index(uint64_t value);
+static uint64_t bucket_upper(size_t index);
+static const double *window_sample(const struct stats_window_t *p_window, uint64_t sample);
+static void deque_push(
+    struct stats_deque_t *p_deque,
+    const struct stats_window_t *p_window,
+    uint64_t sample,
+    bool keep_smaller
+);
+static void recalculate_sums(struct stats_window_t *p_window);
+
+/**************************************************
+* Public Data
+**************************************************/
+
+/* None */
+
+/**************************************************
+* Private Data
+**************************************************/
+
+/* None */
+
+/**************************************************
+* Public Functions
+***************************************************/
+
+void stats_hist_reset(struct stats_hist_t *p_hist)
+{
+    memset(p_hist, 0, sizeof(*p_hist));
+}
+
+void stats_hist_record(struct stats_hist_t *p_hist, uint64_t value)
+{
+    if ((p_hist->count == 0) || (value < p_hist->min))
+    {
+        p_hist->min = value;
+    }
+    if (value > p_hist->max)
+    {
+        p_hist->max = value;
+    }
+    p_hist->count++;
+    p_hist->sum += value;
+    p_hist->buckets[bucket_index(value)]++;
+}
+
+uint64_t stats_hist_percentile(const struct stats_hist_t *p_hist, double percentile)
+{
+    if (p_hist->count == 0)
+    {
+        return 0;
+    }
+
+    /* Rank of the value we want, counting from 1 */
+    uint64_t target = (uint64_t) ((percentile / 100.0) * p_hist->count + 0.5);
+    target = MAX(target, 1);
+    target = MIN(target, p_hist->count);
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < STATS_HIST_NUM_BUCKETS; i++)
+    {
+        seen += p_hist->buckets[i];
+        if (seen >= target)
+        {
+            return MIN(bucket_upper(i), p_hist->max);
+        }
+    }
+    return p_hist->max;
+}
+
+void stats_hist_print(
+    const struct stats_hist_t *p_hist,
+    const char *p_name,
+    uint64_t divisor,
+    FILE *p_output
+)
+{
+    if (p_hist->count == 0)
+    {
+        fprintf(p_output, "%-12s n=0\n", p_name);
+        return;
+    }
+    fprintf(p_output,
+        "%-12s n=%-8"PRIu64" min=%-6"PRIu64" mean=%-6"PRIu64" p50=%-6"PRIu64" p99=%-6"PRIu64" p99.9=%-6"PRIu64" max=%"PRIu64"\n",
+        p_name,
+        p_hist->count,
+        p_hist->min / divisor,
+        (p_hist->sum / p_hist->count) / divisor,
+        stats_hist_percentile(p_hist, 50.0) / divisor,
+        stats_hist_percentile(p_hist, 99.0) / divisor,
+        stats_hist_percentile(p_hist, 99.9) / divisor,
+        p_hist->max / divisor);
+}
+
+void stats_window_reset(struct stats_window_t *p_window, size_t capacity)
+{
+    memset(p_window, 0, sizeof(*p_window));
+    p_window->capacity = MAX(MIN(capacity, STATS_WINDOW_MAX), 1);
+}
+
+void stats_window_append(struct stats_window_t *p_window, double value, uint64_t time_ns)
+{
+    const size_t slot = p_window->total % p_window->capacity;
+    if (p_window->total >= p_window->capacity)
+    {
+        const double old = p_window->values[slot];
+        p_window->sum -= old;
+        p_window->sum_sq -= old * old;
+    }
+    p_window->values[slot] = value;
+    p_window->times_ns[slot] = time_ns;
+    p_window->sum += value;
+    p_window->sum_sq += value * value;
+
+    const uint64_t sample = p_window->total++;
+    deque_push(&p_window->min, p_window, sample, true);
+    deque_push(&p_window->max, p_window, sample, false);
+
+    if (slot == (p_window->capacity - 1))
+    {
+        /* Stop rounding errors building up in the running sums */
+        recalculate_sums(p_window);
+    }
+}
+
+size_t stats_window_count(const struct stats_window_t *p_window)
+{
+    return (size_t) MIN(p_window->total, p_window->capacity);
+}
+
+double stats_window_mean(const struct stats_window_t *p_window)
+{
+    const size_t count = stats_window_count(p_window);
+    return count ? (p_window->sum / count) : 0;
+}
+
+double stats_window_variance(const struct stats_window_t *p_window)
+{
+    const size_t count = stats_window_count(p_window);
+    if (count == 0)
+    {
+        return 0;
+    }
+    const double mean = p_window->sum / count;
+    return MAX((p_window->sum_sq / count) - (mean * mean), 0.0);
+}
+
+double stats_window_min(const struct stats_window_t *p_window)
+{
+    if (p_window->min.len == 0)
+    {
+        return 0;
+    }
+    return *window_sample(p_window, p_window->min.samples[p_window->min.first]);
+}
+
+double stats_window_max(const struct stats_window_t *p_window)
+{
+    if (p_window->max.len == 0)
+    {
+        return 0;
+    }
+    return *window_sample(p_window, p_window->max.samples[p_window->max.first]);
+}
+
+double stats_window_median(const struct stats_window_t *p_window, size_t num)
+{
+    double sorted[STATS_WINDOW_MAX];
+    num = MIN(num, stats_window_count(p_window));
+    if (num == 0)
+    {
+        return 0;
+    }
+
+    /* Insertion sort - fine for a handful of samples */
+    for (size_t i = 0; i < num; i++)
+    {
+        const double value = *window_sample(p_window, p_window->total - 1 - i);
+        size_t j = i;
+        while ((j > 0) && (sorted[j - 1] > value))
+        {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = value;
+    }
+
+    if (num & 1)
+    {
+        return sorted[num / 2];
+    }
+    return (sorted[(num / 2) - 1] + sorted[num / 2]) / 2;
+}
+
+bool stats_window_value_at(const struct stats_window_t *p_window, uint64_t time_ns, double *p_value)
+{
+    const size_t count = stats_window_count(p_window);
+    const uint64_t oldest = p_window->total - count;
+
+    /* Binary search for the last sample at or before time_ns */
+    uint64_t low = oldest;
+    uint64_t high = p_window->total;
+    while (low < high)
+    {
+        const uint64_t mid = low + ((high - low) / 2);
+        if (p_window->times_ns[mid % p_window->capacity] <= time_ns)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    if (low == oldest)
+    {
+        return false;
+    }
+    *p_value = *window_sample(p_window, low - 1);
+    return true;
+}
+
+/**************************************************
+* Private Functions
+***************************************************/
+
+/*
+ * Which bucket does this value go in?
+ */
+static size_t bucket_index(uint64_t value)
+{
+    if (value < (2 * STATS_HIST_SUB_BUCKETS))
+    {
+        return (size_t) value;
+    }
+    const unsigned int top_bit = 63 - __builtin_clzll(value);
+    const unsigned int shift = top_bit - STATS_HIST_SUB_BITS;
+    const size_t index = (shift * STATS_HIST_SUB_BUCKETS) + (size_t) (value >> shift);
+    return MIN(index, STATS_HIST_NUM_BUCKETS - 1);
+}
+
+/*
+ * The largest value which lands in the given bucket.
+ */
+static uint64_t bucket_upper(size_t index)
+{
+    if (index < (2 * STATS_HIST_SUB_BUCKETS))
+    {
+        return index;
+    }
+    const unsigned int shift = (index / STATS_HIST_SUB_BUCKETS) - 1;
+    const uint64_t mantissa = (index % STATS_HIST_SUB_BUCKETS) + STATS_HIST_SUB_BUCKETS;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+/*
+ * Where a sample, by number, is stored.
+ */
+static const double *window_sample(const struct stats_window_t *p_window, uint64_t sample)
+{
+    return &p_window->values[sample % p_window->capacity];
+}
+
+/*
+ * Add a new sample to a min (keep_smaller) or max deque.
+ * Anything that has left the window is dropped from the
+ * front first, so there is always room; anything the new
+ * sample beats can never be the answer again, so is dropped
+ * from the back.
+ */
+static void deque_push(
+    struct stats_deque_t *p_deque,
+    const struct stats_window_t *p_window,
+    uint64_t sample,
+    bool keep_smaller
+)
+{
+    if ((p_deque->len > 0) && ((sample - p_deque->samples[p_deque->first]) >= p_window->capacity))
+    {
+        p_deque->first = (p_deque->first + 1) % STATS_WINDOW_MAX;
+        p_deque->len--;
+    }
+
+    const double value = *window_sample(p_window, sample);
+    while (p_deque->len > 0)
+    {
+        const size_t last = (p_deque->first + p_deque->len - 1) % STATS_WINDOW_MAX;
+        const double other = *window_sample(p_window, p_deque->samples[last]);
+        if (keep_smaller ? (other < value) : (other > value))
+        {
+            break;
+        }
+        p_deque->len--;
+    }
+
+    p_deque->samples[(p_deque->first + p_deque->len) % STATS_WINDOW_MAX] = sample;
+    p_deque->len++;
+}
+
+/*
+ * Work out the sums from scratch.
+ */
+static void recalculate_sums(struct stats_window_t *p_window)
+{
+    const size_t count = stats_window_count(p_window);
+    p_window->sum = 0;
+    p_window->sum_sq = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        p_window->sum += p_window->values[i];
+        p_window->sum_sq += p_window->values[i] * p_window->values[i];
+    }
+}
+
+/**************************************************
+* End of file
+***************************************************/
@@ -0,0 +1,235 @@
+/*****************************************************
+*
+* Pi Wars Robot Software (PWRS) Statistics
+*
+* Copyright (c) 2013-2017 theJPster (www.thejpster.org.uk)
+*
+* PWRS is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* PWRS is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with PWRS.  If not, see <http://www.gnu.org/licenses/>.
+*
+* Allocation-free statistics helpers.
+*
+* The histogram is log-bucketed in the style of HdrHistogram:
+* each power of two is split into STATS_HIST_SUB_BUCKETS linear
+* buckets, so any recorded value can be reported to within
+* 1/STATS_HIST_SUB_BUCKETS (about 6%) of its true value,
+* whatever its magnitude. Recording is a handful of integer
+* operations and never allocates.
+*
+* The window keeps the last few samples of a signal, with the
+* time each arrived. Appending is O(1), and so are the mean,
+* variance, minimum and maximum of the window: the sums are
+* kept running and the extremes are kept in monotonic deques.
+* The median is found by sorting a copy, so keep it to small
+* windows.
+*
+*****************************************************/
+
+#ifndef STATS_H
+#define STATS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**************************************************
+* Includes
+***************************************************/
+
+#include "util/util.h"
+
+/**************************************************
+* Public Defines
+***************************************************/
+
+/* Linear buckets per power of two is 2^STATS_HIST_SUB_BITS */
+#define STATS_HIST_SUB_BITS 4
+#define STATS_HIST_SUB_BUCKETS (1 << STATS_HIST_SUB_BITS)
+
+/* Largest value we can distinguish is 2^STATS_HIST_MAX_BITS.
+ * Bigger values are counted in the top bucket. With values in
+ * nanoseconds, 2^40 is about 18 minutes. */
+#define STATS_HIST_MAX_BITS 40
+
+#define STATS_HIST_NUM_BUCKETS (STATS_HIST_SUB_BUCKETS * (STATS_HIST_MAX_BITS - STATS_HIST_SUB_BITS + 1))
+
+/* Most samples a window can hold */
+#define STATS_WINDOW_MAX 32
+
+/**************************************************
+* Public Data Types
+**************************************************/
+
+struct stats_hist_t
+{
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+    uint32_t buckets[STATS_HIST_NUM_BUCKETS];
+};
+
+/* Sample numbers (counting from 0 since reset) in a ring */
+struct stats_deque_t
+{
+    uint64_t samples[STATS_WINDOW_MAX];
+    size_t first;
+    size_t len;
+};
+
+struct stats_window_t
+{
+    size_t capacity;
+    /* Samples appended since reset */
+    uint64_t total;
+    double values[STATS_WINDOW_MAX];
+    uint64_t times_ns[STATS_WINDOW_MAX];
+    double sum;
+    double sum_sq;
+    /* Candidates for min/max, oldest first */
+    struct stats_deque_t min;
+    struct stats_deque_t max;
+};
+
+/**************************************************
+* Public Data
+**************************************************/
+
+/* None */
+
+/**************************************************
+* Public Function Prototypes
+***************************************************/
+
+/**
+ * Empty a histogram.
+ *
+ * @param[out] p_hist The histogram to reset
+ */
+extern void stats_hist_reset(struct stats_hist_t *p_hist);
+
+/**
+ * Add a value to a histogram.
+ *
+ * @param[in,out] p_hist The histogram
+ * @param[in]     value  The value to record
+ */
+extern void stats_hist_record(struct stats_hist_t *p_hist, uint64_t value);
+
+/**
+ * Find the value below which the given percentage of
+ * recorded values fall.
+ *
+ * The answer is the upper bound of the bucket in which the
+ * percentile lies, clamped to the maximum recorded value.
+ *
+ * @param[in] p_hist     The histogram
+ * @param[in] percentile 0.0 to 100.0
+ * @return The value, or 0 if the histogram is empty
+ */
+extern uint64_t stats_hist_percentile(const struct stats_hist_t *p_hist, double percentile);
+
+/**
+ * Print count, min, mean, p50, p99, p99.9 and max on one line.
+ * Values are divided by `divisor` before printing (e.g. 1000 to
+ * print nanoseconds as microseconds).
+ *
+ * @param[in] p_hist   The histogram
+ * @param[in] p_name   A label for the line
+ * @param[in] divisor  Scale factor for printed values
+ * @param[in] p_output Where to print
+ */
+extern void stats_hist_print(
+    const struct stats_hist_t *p_hist,
+    const char *p_name,
+    uint64_t divisor,
+    FILE *p_output
+);
+
+/**
+ * Empty a window and set how many samples it keeps.
+ *
+ * @param[out] p_window The window to reset
+ * @param[in]  capacity Samples to keep, 1..STATS_WINDOW_MAX
+ */
+extern void stats_window_reset(struct stats_window_t *p_window, size_t capacity);
+
+/**
+ * Add a sample, dropping the oldest if the window is full.
+ *
+ * @param[in,out] p_window The window
+ * @param[in]     value    The sample
+ * @param[in]     time_ns  When it was taken. Must not go backwards.
+ */
+extern void stats_window_append(struct stats_window_t *p_window, double value, uint64_t time_ns);
+
+/**
+ * @param[in] p_window The window
+ * @return The number of samples in the window
+ */
+extern size_t stats_window_count(const struct stats_window_t *p_window);
+
+/**
+ * @param[in] p_window The window
+ * @return The mean of the samples in the window, or 0 if empty
+ */
+extern double stats_window_mean(const struct stats_window_t *p_window);
+
+/**
+ * @param[in] p_window The window
+ * @return The (population) variance of the samples in the window
+ */
+extern double stats_window_variance(const struct stats_window_t *p_window);
+
+/**
+ * @param[in] p_window The window
+ * @return The smallest sample in the window, or 0 if empty
+ */
+extern double stats_window_min(const struct stats_window_t *p_window);
+
+/**
+ * @param[in] p_window The window
+ * @return The largest sample in the window, or 0 if empty
+ */
+extern double stats_window_max(const struct stats_window_t *p_window);
+
+/**
+ * Find the median of the most recent samples.
+ *
+ * @param[in] p_window The window
+ * @param[in] num      How many of the latest samples to use
+ *                     (clamped to the number in the window)
+ * @return The median, or 0 if empty
+ */
+extern double stats_window_median(const struct stats_window_t *p_window, size_t num);
+
+/**
+ * Find what the signal was at a given time - the latest
+ * sample taken at or before `time_ns`.
+ *
+ * @param[in]  p_window The window
+ * @param[in]  time_ns  The time of interest
+ * @param[out] p_value  The sample
+ * @return false if every sample in the window is newer than time_ns
+ */
+extern bool stats_window_value_at(const struct stats_window_t *p_window, uint64_t time_ns, double *p_value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ndef STATS_H */
+
+/**************************************************
+* End of file
+***************************************************/
@@ -0,0 +1,447 @@
+/*****************************************************
+*
+* Pi Wars Robot Software (PWRS) Statistics Tests
+*
+* Copyright (c) 2013-2017 theJPster (www.thejpster.org.uk)
+*
+* PWRS is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* PWRS is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with PWRS.  If not, see <http://www.gnu.org/licenses/>.
+*
+* Checks the sliding window (min, max, mean, variance, median
+* and value_at) and the histogram (bucket edges, min, max,
+* count and percentiles) against brute force calculations,
+* including windows at full capacity (STATS_WINDOW_MAX, as the
+* motor module uses). Exits non-zero on failure.
+*
+*****************************************************/
+
+/**************************************************
+* Includes
+***************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "util/util.h"
+#include "stats/stats.h"
+
+/**************************************************
+* Defines
+***************************************************/
+
+#define NUM_SAMPLES 1000
+
+/* Histogram data sets to try, and the most values in each */
+#define NUM_HIST_SETS 200
+#define MAX_HIST_VALUES 100
+
+/* Running sums lose a little precision */
+#define TOLERANCE 1e-6
+
+/**************************************************
+* Data Types
+**************************************************/
+
+/* The inputs to try */
+enum pattern_t
+{
+    PATTERN_RISING,
+    PATTERN_FALLING,
+    PATTERN_RANDOM,
+    NUM_PATTERNS
+};
+
+/**************************************************
+* Function Prototypes
+**************************************************/
+
+static double make_value(enum pattern_t pattern, size_t i);
+static uint64_t make_time(size_t i);
+static unsigned int check_window(size_t capacity, enum pattern_t pattern);
+static unsigned int check_value_at(const struct stats_window_t *p_window, size_t oldest, size_t newest);
+static unsigned int check_hist_buckets(void);
+static unsigned int check_hist_percentiles(void);
+static uint64_t ref_bucket_upper(uint64_t value);
+static bool near(double value, double expected);
+static int compare_doubles(const void *p_a, const void *p_b);
+static int compare_u64s(const void *p_a, const void *p_b);
+static uint64_t random_u64(void);
+
+/**************************************************
+* Public Data
+**************************************************/
+
+/* None */
+
+/**************************************************
+* Private Data
+**************************************************/
+
+static const char *pattern_names[NUM_PATTERNS] = { "rising", "falling", "random" };
+
+/* Samples appended so far, and when */
+static double values[NUM_SAMPLES];
+static uint64_t times_ns[NUM_SAMPLES];
+
+/**************************************************
+* Public Functions
+***************************************************/
+
+int main(void)
+{
+    static const size_t capacities[] = { 1, 2, 3, STATS_WINDOW_MAX - 1, STATS_WINDOW_MAX };
+    unsigned int failures = 0;
+
+    srandom(1);
+    for (size_t c = 0; c < NUMELTS(capacities); c++)
+    {
+        for (int pattern = 0; pattern < NUM_PATTERNS; pattern++)
+        {
+            failures += check_window(capacities[c], (enum pattern_t) pattern);
+        }
+    }
+    failures += check_hist_buckets();
+    failures += check_hist_percentiles();
+
+    printf("%s\n", failures ? "FAIL" : "PASS");
+    return failures ? 1 : 0;
+}
+
+/**************************************************
+* Private Functions
+***************************************************/
+
+static double make_value(enum pattern_t pattern, size_t i)
+{
+    switch (pattern)
+    {
+    case PATTERN_RISING:
+        return (double) i;
+    case PATTERN_FALLING:
+        return -(double) i;
+    default:
+        return (double) (random() % 100);
+    }
+}
+
+/*
+ * Samples arrive in pairs with the same time, so value_at()
+ * has to pick the later of two.
+ */
+static uint64_t make_time(size_t i)
+{
+    return 1000 + (10 * (i / 2));
+}
+
+/*
+ * Fill a window, checking everything about it after every
+ * sample. Returns the number of samples where something was
+ * wrong.
+ */
+static unsigned int check_window(size_t capacity, enum pattern_t pattern)
+{
+    struct stats_window_t window;
+    unsigned int failures = 0;
+    double value;
+
+    stats_window_reset(&window, capacity);
+    if ((stats_window_count(&window) != 0) ||
+        (stats_window_mean(&window) != 0) ||
+        (stats_window_median(&window, capacity) != 0) ||
+        stats_window_value_at(&window, UINT64_MAX, &value))
+    {
+        printf("capacity %zu: empty window isn't empty\n", capacity);
+        failures++;
+    }
+
+    for (size_t i = 0; i < NUM_SAMPLES; i++)
+    {
+        values[i] = make_value(pattern, i);
+        times_ns[i] = make_time(i);
+        stats_window_append(&window, values[i], times_ns[i]);
+
+        const size_t oldest = (i + 1 > capacity) ? (i + 1 - capacity) : 0;
+        const size_t count = i + 1 - oldest;
+        double min = values[oldest];
+        double max = values[oldest];
+        double sum = 0;
+        for (size_t j = oldest; j <= i; j++)
+        {
+            min = MIN(min, values[j]);
+            max = MAX(max, values[j]);
+            sum += values[j];
+        }
+        const double mean = sum / count;
+        double variance = 0;
+        for (size_t j = oldest; j <= i; j++)
+        {
+            variance += (values[j] - mean) * (values[j] - mean);
+        }
+        variance /= count;
+
+        bool ok = (stats_window_count(&window) == count) &&
+            (stats_window_min(&window) == min) &&
+            (stats_window_max(&window) == max) &&
+            (window.min.len <= capacity) &&
+            (window.max.len <= capacity) &&
+            near(stats_window_mean(&window), mean) &&
+            near(stats_window_variance(&window), variance);
+        if (!ok && (failures == 0))
+        {
+            printf("capacity %zu, %s: sample %zu min %g (want %g) max %g (want %g) mean %g (want %g) variance %g (want %g)\n",
+                capacity, pattern_names[pattern], i,
+                stats_window_min(&window), min,
+                stats_window_max(&window), max,
+                stats_window_mean(&window), mean,
+                stats_window_variance(&window), variance);
+        }
+
+        /* Fewer, exactly enough and more samples than there are */
+        const size_t medians[] = { 1, 2, 3, count, capacity + 5 };
+        for (size_t m = 0; m < NUMELTS(medians); m++)
+        {
+            double sorted[STATS_WINDOW_MAX];
+            const size_t num = MIN(medians[m], count);
+            for (size_t j = 0; j < num; j++)
+            {
+                sorted[j] = values[i - j];
+            }
+            qsort(sorted, num, sizeof(sorted[0]), compare_doubles);
+            const double median = (num & 1) ? sorted[num / 2] : ((sorted[(num / 2) - 1] + sorted[num / 2]) / 2);
+            if (stats_window_median(&window, medians[m]) != median)
+            {
+                if (ok && (failures == 0))
+                {
+                    printf("capacity %zu, %s: sample %zu median of %zu %g (want %g)\n",
+                        capacity, pattern_names[pattern], i, medians[m],
+                        stats_window_median(&window, medians[m]), median);
+                }
+                ok = false;
+            }
+        }
+
+        if (check_value_at(&window, oldest, i) != 0)
+        {
+            if (ok && (failures == 0))
+            {
+                printf("capacity %zu, %s: sample %zu value_at wrong\n", capacity, pattern_names[pattern], i);
+            }
+            ok = false;
+        }
+
+        if (!ok)
+        {
+            failures++;
+        }
+    }
+    return failures;
+}
+
+/*
+ * Ask for the value at every time from before the oldest
+ * sample in the window to after the newest. Returns the
+ * number of times the answer was wrong.
+ */
+static unsigned int check_value_at(const struct stats_window_t *p_window, size_t oldest, size_t newest)
+{
+    unsigned int failures = 0;
+    for (uint64_t t = times_ns[oldest] - 1; t <= (times_ns[newest] + 1); t++)
+    {
+        /* The latest sample at or before t, if any */
+        bool found = false;
+        double expected = 0;
+        for (size_t j = oldest; j <= newest; j++)
+        {
+            if (times_ns[j] <= t)
+            {
+                found = true;
+                expected = values[j];
+            }
+        }
+
+        double value = 0;
+        const bool result = stats_window_value_at(p_window, t, &value);
+        if ((result != found) || (found && (value != expected)))
+        {
+            failures++;
+        }
+    }
+    return failures;
+}
+
+/*
+ * Check the edges of every bucket, by recording a value with
+ * something much bigger, so the 50th percentile is the upper
+ * edge of the value's bucket rather than the maximum.
+ */
+static unsigned int check_hist_buckets(void)
+{
+    struct stats_hist_t hist;
+    unsigned int failures = 0;
+
+    for (unsigned int bit = 0; bit < 48; bit++)
+    {
+        const uint64_t power = 1ULL << bit;
+        const uint64_t width = MAX(power / STATS_HIST_SUB_BUCKETS, 1);
+        for (uint64_t sub = 0; sub <= STATS_HIST_SUB_BUCKETS; sub++)
+        {
+            const uint64_t edge = power + (sub * width);
+            const uint64_t tries[] = { edge - 1, edge, edge + 1 };
+            for (size_t t = 0; t < NUMELTS(tries); t++)
+            {
+                stats_hist_reset(&hist);
+                stats_hist_record(&hist, tries[t]);
+                stats_hist_record(&hist, UINT64_MAX);
+                const uint64_t upper = stats_hist_percentile(&hist, 50.0);
+                if (upper != ref_bucket_upper(tries[t]))
+                {
+                    if (failures == 0)
+                    {
+                        printf("histogram: %llu in bucket up to %llu (want %llu)\n",
+                            (unsigned long long) tries[t], (unsigned long long) upper,
+                            (unsigned long long) ref_bucket_upper(tries[t]));
+                    }
+                    failures++;
+                }
+            }
+        }
+    }
+    return failures;
+}
+
+/*
+ * Record random sets of values and check the summary and the
+ * percentiles, including the rounding of the rank.
+ */
+static unsigned int check_hist_percentiles(void)
+{
+    static const double percentiles[] = { 0.0, 0.1, 1.0, 25.0, 37.5, 50.0, 62.5, 75.0, 99.0, 99.9, 100.0 };
+    struct stats_hist_t hist;
+    uint64_t sorted[MAX_HIST_VALUES];
+    unsigned int failures = 0;
+
+    stats_hist_reset(&hist);
+    if (stats_hist_percentile(&hist, 50.0) != 0)
+    {
+        printf("histogram: empty percentile isn't 0\n");
+        failures++;
+    }
+
+    for (unsigned int set = 0; set < NUM_HIST_SETS; set++)
+    {
+        const size_t num = 1 + (size_t) (random() % MAX_HIST_VALUES);
+        /* Small exact values to start with, then all sizes */
+        const bool small = (set < (NUM_HIST_SETS / 4));
+        uint64_t sum = 0;
+        stats_hist_reset(&hist);
+        for (size_t i = 0; i < num; i++)
+        {
+            sorted[i] = small ? (uint64_t) (random() % (2 * STATS_HIST_SUB_BUCKETS)) : random_u64();
+            sum += sorted[i];
+            stats_hist_record(&hist, sorted[i]);
+        }
+        qsort(sorted, num, sizeof(sorted[0]), compare_u64s);
+
+        if ((hist.count != num) || (hist.sum != sum) ||
+            (hist.min != sorted[0]) || (hist.max != sorted[num - 1]))
+        {
+            if (failures == 0)
+            {
+                printf("histogram: set %u count/sum/min/max wrong\n", set);
+            }
+            failures++;
+            continue;
+        }
+
+        for (size_t p = 0; p < NUMELTS(percentiles); p++)
+        {
+            /* Nearest rank, counting from 1 */
+            size_t rank = (size_t) floor(((percentiles[p] / 100.0) * num) + 0.5);
+            rank = MAX(MIN(rank, num), 1);
+            const uint64_t expected = MIN(ref_bucket_upper(sorted[rank - 1]), sorted[num - 1]);
+            const uint64_t result = stats_hist_percentile(&hist, percentiles[p]);
+            if (result != expected)
+            {
+                if (failures == 0)
+                {
+                    printf("histogram: set %u of %zu, p%g %llu (want %llu)\n",
+                        set, num, percentiles[p],
+                        (unsigned long long) result, (unsigned long long) expected);
+                }
+                failures++;
+            }
+        }
+    }
+    return failures;
+}
+
+/*
+ * The biggest value that shares a bucket with `value`. Below
+ * 2 * STATS_HIST_SUB_BUCKETS every value has its own bucket.
+ * Above that, each power of two is split into
+ * STATS_HIST_SUB_BUCKETS equal buckets, up to
+ * 2^STATS_HIST_MAX_BITS, and everything bigger shares the top
+ * bucket.
+ */
+static uint64_t ref_bucket_upper(uint64_t value)
+{
+    if (value < (2 * STATS_HIST_SUB_BUCKETS))
+    {
+        return value;
+    }
+    if (value >= (1ULL << STATS_HIST_MAX_BITS))
+    {
+        return (1ULL << STATS_HIST_MAX_BITS) - 1;
+    }
+    uint64_t power = 1;
+    while ((power * 2) <= value)
+    {
+        power *= 2;
+    }
+    const uint64_t width = power / STATS_HIST_SUB_BUCKETS;
+    return (value - (value % width)) + width - 1;
+}
+
+static bool near(double value, double expected)
+{
+    return fabs(value - expected) <= (TOLERANCE * (1.0 + fabs(expected)));
+}
+
+static int compare_doubles(const void *p_a, const void *p_b)
+{
+    const double a = *(const double *) p_a;
+    const double b = *(const double *) p_b;
+    return (a > b) - (a < b);
+}
+
+static int compare_u64s(const void *p_a, const void *p_b)
+{
+    const uint64_t a = *(const uint64_t *) p_a;
+    const uint64_t b = *(const uint64_t *) p_b;
+    return (a > b) - (a < b);
+}
+
+/*
+ * A random value of random magnitude, sometimes bigger than
+ * the histogram can tell apart.
+ */
+static uint64_t random_u64(void)
+{
+    const uint64_t bits = ((uint64_t) random() << 31) | (uint64_t) random();
+    return bits >> (random() % 62);
+}
+
+/**************************************************
+* End of file
+***************************************************/
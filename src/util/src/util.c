@@ -70,6 +70,14 @@ void delay_ms(uint32_t milliseconds)
     nanosleep(&tv, NULL);
 }
 
+/* Returns the CLOCK_MONOTONIC time in nanoseconds */
+uint64_t get_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
 /**************************************************
 * Private Functions
 ***************************************************/
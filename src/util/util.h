@@ -52,6 +52,10 @@ extern "C" {
 #define MAX(x,y) ((x) > (y) ? (x) : (y))
 #define MIN(x,y) ((x) < (y) ? (x) : (y))
 
+/* Fails to compile if `cond` is false. `name` must be unique
+ * within the file. */
+#define STATIC_ASSERT(cond, name) typedef char static_assert_##name[(cond) ? 1 : -1]
+
 #define BOUNDS_INCREMENT(x, max, min) do { \
 	(x) = (x) + 1; \
 	if ((x) >= (max)) \
@@ -79,6 +83,9 @@ extern "C" {
 /* Delays for specified number of milliseconds */
 void delay_ms(uint32_t milliseconds);
 
+/* Returns the CLOCK_MONOTONIC time in nanoseconds */
+uint64_t get_time_ns(void);
+
 #ifdef __cplusplus
 }
 #endif